@@ -0,0 +1,223 @@
+#include "chatstore.h"
+
+StoredChatMessage StoredChatMessage::fromJson(const QJsonObject &message)
+{
+    StoredChatMessage result;
+    result.id = message["id"].toVariant().toLongLong();
+    result.sender = message["sender"].toString();
+    result.text = message["message"].toString();
+    result.timestamp = message["timestamp"].toString();
+    result.read = message["is_read"].toBool();
+    return result;
+}
+
+bool ChatStore::contains(const QString &partner) const
+{
+    QHash<QString, Chat>::const_iterator it = chats.constFind(partner);
+    return it != chats.constEnd() && it->loaded;
+}
+
+const QVector<StoredChatMessage> &ChatStore::messages(const QString &partner) const
+{
+    static const QVector<StoredChatMessage> none;
+    QHash<QString, Chat>::const_iterator it = chats.constFind(partner);
+    return it == chats.constEnd() || !it->loaded ? none : it->messages;
+}
+
+bool ChatStore::hasMore(const QString &partner) const
+{
+    QHash<QString, Chat>::const_iterator it = chats.constFind(partner);
+    return it != chats.constEnd() && it->hasMore;
+}
+
+qint64 ChatStore::oldestId(const QString &partner) const
+{
+    const QVector<StoredChatMessage> &held = messages(partner);
+    return held.isEmpty() ? 0 : held.first().id;
+}
+
+void ChatStore::prependPage(const QString &partner, const QJsonArray &page, bool hasMore)
+{
+    Chat &chat = chats[partner];
+    chat.hasMore = hasMore;
+
+    if (!chat.loaded)
+    {
+        // Live messages that came in before the page, all confirmed and in
+        // id order; merge the two by id, dropping the ones in both.
+        QVector<StoredChatMessage> merged;
+        merged.reserve(page.size() + chat.messages.size());
+        int live = 0;
+        for (const QJsonValue &messageValue : page)
+        {
+            StoredChatMessage message = StoredChatMessage::fromJson(messageValue.toObject());
+            for (; live < chat.messages.size() && chat.messages.at(live).id < message.id; ++live)
+            {
+                merged.append(chat.messages.at(live));
+            }
+            if (live < chat.messages.size() && chat.messages.at(live).id == message.id)
+            {
+                ++live;
+            }
+            merged.append(message);
+        }
+        for (; live < chat.messages.size(); ++live)
+        {
+            merged.append(chat.messages.at(live));
+        }
+        chat.messages.swap(merged);
+        chat.loaded = true;
+        return;
+    }
+
+    // A repeated first page overlaps what is held; keep only what is older.
+    qint64 oldest = chat.messages.isEmpty() ? 0 : chat.messages.first().id;
+    QVector<StoredChatMessage> older;
+    older.reserve(page.size() + chat.messages.size());
+    for (const QJsonValue &messageValue : page)
+    {
+        StoredChatMessage message = StoredChatMessage::fromJson(messageValue.toObject());
+        if (oldest <= 0 || message.id < oldest)
+        {
+            older.append(message);
+        }
+    }
+    if (older.isEmpty())
+    {
+        return;
+    }
+
+    if (chat.firstUnconfirmed >= 0)
+    {
+        chat.firstUnconfirmed += older.size();
+    }
+    older += chat.messages;
+    chat.messages.swap(older);
+}
+
+void ChatStore::append(const QString &partner, const StoredChatMessage &message)
+{
+    if (message.id == 0 && !contains(partner))
+    {
+        return;
+    }
+
+    QHash<QString, Chat>::iterator it = chats.find(partner);
+    if (it == chats.end())
+    {
+        it = chats.insert(partner, Chat());
+    }
+    if (message.id > 0 && message.id <= newestConfirmedId(*it))
+    {
+        return;
+    }
+    if (message.id == 0 && it->firstUnconfirmed < 0)
+    {
+        it->firstUnconfirmed = it->messages.size();
+    }
+    it->messages.append(message);
+}
+
+void ChatStore::appendNewer(const QString &partner, const QJsonArray &newer, const QString &self)
+{
+    QHash<QString, Chat>::iterator it = chats.find(partner);
+    if (it == chats.end() || !it->loaded)
+    {
+        return;
+    }
+
+    QVector<StoredChatMessage> &held = it->messages;
+    qint64 newest = newestConfirmedId(*it);
+    int firstUnconfirmed = it->firstUnconfirmed < 0 ? held.size() : it->firstUnconfirmed;
+    int unconfirmed = firstUnconfirmed;
+    for (const QJsonValue &messageValue : newer)
+    {
+        StoredChatMessage message = StoredChatMessage::fromJson(messageValue.toObject());
+        if (message.id <= newest)
+        {
+            continue;
+        }
+
+        bool confirmed = false;
+        if (message.sender == self)
+        {
+            for (int i = unconfirmed; i < held.size(); ++i)
+            {
+                StoredChatMessage &candidate = held[i];
+                if (candidate.id == 0 && candidate.sender == self && candidate.text == message.text)
+                {
+                    candidate.id = message.id;
+                    candidate.timestamp = message.timestamp;
+                    candidate.read = message.read;
+                    confirmed = true;
+                    unconfirmed = i + 1;
+                    break;
+                }
+            }
+        }
+        if (!confirmed)
+        {
+            held.append(message);
+        }
+        newest = message.id;
+    }
+
+    it->firstUnconfirmed = -1;
+    for (int i = firstUnconfirmed; i < held.size(); ++i)
+    {
+        if (held.at(i).id == 0)
+        {
+            it->firstUnconfirmed = i;
+            break;
+        }
+    }
+}
+
+void ChatStore::confirm(const QString &partner, const QString &self, const QString &text, qint64 id)
+{
+    QHash<QString, Chat>::iterator it = chats.find(partner);
+    if (it == chats.end() || it->firstUnconfirmed < 0)
+    {
+        return;
+    }
+
+    QVector<StoredChatMessage> &held = it->messages;
+    int firstUnconfirmed = it->firstUnconfirmed;
+    for (int i = firstUnconfirmed; i < held.size(); ++i)
+    {
+        StoredChatMessage &candidate = held[i];
+        if (candidate.id == 0 && candidate.sender == self && candidate.text == text)
+        {
+            candidate.id = id;
+            break;
+        }
+    }
+
+    it->firstUnconfirmed = -1;
+    for (int i = firstUnconfirmed; i < held.size(); ++i)
+    {
+        if (held.at(i).id == 0)
+        {
+            it->firstUnconfirmed = i;
+            break;
+        }
+    }
+}
+
+void ChatStore::clear()
+{
+    chats.clear();
+}
+
+qint64 ChatStore::newestConfirmedId(const Chat &chat)
+{
+    // Only the few unconfirmed messages at the tail are skipped.
+    for (int i = chat.messages.size() - 1; i >= 0; --i)
+    {
+        if (chat.messages.at(i).id > 0)
+        {
+            return chat.messages.at(i).id;
+        }
+    }
+    return 0;
+}
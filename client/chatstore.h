@@ -0,0 +1,67 @@
+#ifndef CHATSTORE_H
+#define CHATSTORE_H
+
+#include <QHash>
+#include <QJsonArray>
+#include <QJsonObject>
+#include <QString>
+#include <QVector>
+
+struct StoredChatMessage
+{
+    // 0 for a message we sent that the server has not echoed back yet.
+    qint64 id = 0;
+    QString sender;
+    QString text;
+    QString timestamp;
+    bool read = false;
+
+    static StoredChatMessage fromJson(const QJsonObject &message);
+};
+
+// The loaded part of every open chat, oldest message first, in one
+// contiguous vector per partner. A chat counts as loaded once its first
+// history page has arrived, so whatever is held has no gaps: older pages are
+// prepended, live and resumed messages appended. Live messages of a chat
+// that is not loaded yet are kept and merged by id into its first page, so
+// one arriving while that page is in flight is not lost.
+class ChatStore
+{
+public:
+    bool contains(const QString &partner) const;
+    // Empty for a chat that is not loaded.
+    const QVector<StoredChatMessage> &messages(const QString &partner) const;
+    bool hasMore(const QString &partner) const;
+    qint64 oldestId(const QString &partner) const;
+
+    // A history page: the first one loads the chat, later ones are older
+    // than everything held.
+    void prependPage(const QString &partner, const QJsonArray &page, bool hasMore);
+    // A live message. Unconfirmed ones are only kept for a loaded chat.
+    void append(const QString &partner, const StoredChatMessage &message);
+    // Messages the server stored after the newest one held. Our own
+    // messages that were shown unconfirmed take their id instead of being
+    // added twice.
+    void appendNewer(const QString &partner, const QJsonArray &newer, const QString &self);
+    // The server stored the oldest unconfirmed message of ours with this
+    // text under id.
+    void confirm(const QString &partner, const QString &self, const QString &text, qint64 id);
+
+    void clear();
+
+private:
+    struct Chat
+    {
+        QVector<StoredChatMessage> messages;
+        bool hasMore = false;
+        bool loaded = false;
+        // Index of the oldest unconfirmed message, -1 when there is none.
+        int firstUnconfirmed = -1;
+    };
+
+    QHash<QString, Chat> chats;
+
+    static qint64 newestConfirmedId(const Chat &chat);
+};
+
+#endif // CHATSTORE_H
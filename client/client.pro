@@ -4,19 +4,25 @@ greaterThan(QT_MAJOR_VERSION, 4): QT += widgets
 
 CONFIG += c++11
 
+INCLUDEPATH += ../common
+
 # You can make your code fail to compile if it uses deprecated APIs.
 # In order to do so, uncomment the following line.
 #DEFINES += QT_DISABLE_DEPRECATED_BEFORE=0x060000    # disables all the APIs deprecated before Qt 6.0.0
 
 SOURCES += \
+    ../common/wireprotocol.cpp \
+    chatstore.cpp \
     dialog.cpp \
     main.cpp \
     enterwindow.cpp
 
 HEADERS += \
+    ../common/systemmessage.h \
+    ../common/wireprotocol.h \
+    chatstore.h \
     dialog.h \
-    enterwindow.h \
-    systemmessage.h
+    enterwindow.h
 
 FORMS += \
     dialog.ui \
@@ -1,7 +1,15 @@
 #include "dialog.h"
 #include "ui_dialog.h"
 #include "systemmessage.h"
-
+#include "wireprotocol.h"
+#include <QScrollBar>
+
+namespace {
+constexpr int historyPageSize = 50;
+// Messages shown when a chat is opened; scrolling up reveals more of what
+// is already loaded before asking the server for older pages.
+constexpr int historyRenderWindow = 200;
+}
 
 Dialog::Dialog(QWidget *parent)
     : QDialog(parent)
@@ -12,7 +20,9 @@ Dialog::Dialog(QWidget *parent)
 
     connect(socket, &QWebSocket::disconnected, this, &Dialog::slotDisconnected);
     connect(socket, &QWebSocket::textMessageReceived, this, &Dialog::slotTextMessageReceived);
+    connect(socket, &QWebSocket::binaryMessageReceived, this, &Dialog::slotBinaryMessageReceived);
     connect(ui->lineEdit_3, &QLineEdit::textEdited, this, &Dialog::onSearchUsers_textEdited);
+    connect(ui->textBrowser->verticalScrollBar(), &QScrollBar::valueChanged, this, &Dialog::onHistoryScrolled);
 
 }
 
@@ -40,9 +50,25 @@ bool Dialog::socketConnect(SystemMessage typeMessage)
     request["password"] = password;
 
     connect(socket, &QWebSocket::connected, this, [=]() {
-        QJsonDocument doc(request);
-        socket->sendTextMessage(QString::fromUtf8(doc.toJson(QJsonDocument::Compact)));
-        qDebug() << "JSON request sent to server:" << doc.toJson(QJsonDocument::Indented);
+        // Offer binary frames first; until the server agrees everything
+        // stays JSON, so older servers simply ignore the hello.
+        binaryFrames = false;
+        socket->sendTextMessage(QString::fromUtf8(WireProtocol::encodeJson(WireProtocol::helloRequest())));
+
+        // After a dropped connection, pick up where we left off instead of
+        // logging in again and reloading everything.
+        if (!resumeToken.isEmpty())
+        {
+            QJsonObject resume;
+            resume["type"] = "resume";
+            resume["login"] = login;
+            resume["resume_token"] = resumeToken;
+            resume["last_msg_id"] = lastMessageId;
+            sendRequest(resume);
+            return;
+        }
+        sendRequest(request);
+        qDebug() << "JSON request sent to server:" << QJsonDocument(request).toJson(QJsonDocument::Indented);
     });
 
     connect(socket, QOverload<QAbstractSocket::SocketError>::of(&QWebSocket::errorOccurred), this, [](QAbstractSocket::SocketError error) {
@@ -58,33 +84,52 @@ void Dialog::SendToServer(QString str, QString toLogin)
 {
     ui->textBrowser->append(login + ": " + str);
     ui->lineEdit->clear();
+
+    StoredChatMessage sent;
+    sent.sender = login;
+    sent.text = str;
+    chatStore.append(toLogin, sent);
+    if (toLogin == ui->titleLabel->text())
+    {
+        ++renderedCount;
+    }
+
     QJsonObject request;
     request["type"] = "chat";
     request["from"] = login;
     request["to"] = toLogin;
     request["message"] = str;
 
-    QJsonDocument doc(request);
-    socket->sendTextMessage(QString::fromUtf8(doc.toJson(QJsonDocument::Compact)));
+    sendRequest(request);
 
 }
 
 void Dialog::handleClients(const QJsonArray &clients)
 {
     ui->userListWidget->clear();
+    userItemMap.clear();
     ui->textBrowser->clear();
 
-    for (const QJsonValue &chatValue : history)
+    // One summary per conversation, newest first; no message bodies needed.
+    for (const QJsonValue &conversationValue : clients)
     {
-        QJsonObject chatObj = chatValue.toObject();
+        QJsonObject conversation = conversationValue.toObject();
         QJsonObject person;
-        person["login"] = chatObj["otherUser"].toString();
-        person["online"] = chatObj["online"].toString();
+        person["login"] = conversation["login"].toString();
+        person["online"] = conversation["online"].toString();
 
         handleAddNewClient(person);
+
+        int unread = conversation["unread"].toInt();
+        QListWidgetItem *item = userItemMap.value(person["login"].toString());
+        if (item && unread > 0)
+        {
+            item->setText(item->text() + QString(" %1 NEW").arg(unread));
+        }
     }
 
-    connect(ui->userListWidget, &QListWidget::itemClicked, this, &Dialog::onUserSelected);
+    selectedUser = userItemMap.value(ui->titleLabel->text(), nullptr);
+    connect(ui->userListWidget, &QListWidget::itemClicked, this, &Dialog::onUserSelected, Qt::UniqueConnection);
 
     qDebug() << "User list updated with" << clients.size() << "clients.";
 }
@@ -143,23 +188,44 @@ void Dialog::set_login(QString login, QString password)
     this->password = password;
 }
 
+void Dialog::sendRequest(const QJsonObject &request)
+{
+    if (binaryFrames)
+    {
+        socket->sendBinaryMessage(WireProtocol::encodeCbor(request));
+    } else {
+        socket->sendTextMessage(QString::fromUtf8(WireProtocol::encodeJson(request)));
+    }
+}
+
 void Dialog::slotTextMessageReceived(const QString &message)
 {
-    QWebSocket *socket = qobject_cast<QWebSocket*>(sender());
-    if (!socket) 
+    bool ok = false;
+    QJsonObject jsonObj = WireProtocol::decodeJson(message.toUtf8(), &ok);
+    if(!ok)
     {
-        qDebug() << "Faile to identify socket";
+        qDebug() << "Invalod format message";
         return;
     }
 
-    QJsonDocument docJson = QJsonDocument::fromJson(message.toUtf8());
-    if(!docJson.isObject())
+    handleMessage(jsonObj);
+}
+
+void Dialog::slotBinaryMessageReceived(const QByteArray &message)
+{
+    bool ok = false;
+    QJsonObject jsonObj = WireProtocol::decodeBinary(message, &ok);
+    if(!ok)
     {
         qDebug() << "Invalod format message";
         return;
     }
 
-    QJsonObject jsonObj = docJson.object();
+    handleMessage(jsonObj);
+}
+
+void Dialog::handleMessage(const QJsonObject &jsonObj)
+{
     QString typeMessage = jsonObj["type"].toString();
 
     if (typeMessage == "login") 
@@ -167,14 +233,25 @@ void Dialog::slotTextMessageReceived(const QString &message)
         handleLogin(jsonObj);
     } else if (typeMessage == "registration") {
         handleRegistration(jsonObj);
+    } else if (typeMessage == "resume") {
+        handleResume(jsonObj);
     } else if (typeMessage == "chat") {
         handleChat(jsonObj);
+    } else if (typeMessage == "ack") {
+        chatStore.confirm(jsonObj["with"].toString(), login, jsonObj["message"].toString(),
+                          jsonObj["msg_id"].toVariant().toLongLong());
     } else if (typeMessage == "update_clients") {
         handleUpdateClients(jsonObj);
+    } else if (typeMessage == "get_history") {
+        handleHistory(jsonObj);
+    } else if (typeMessage == "get_conversations") {
+        handleClients(jsonObj["conversations"].toArray());
     } else if (typeMessage == "search_users"){
         onSearchUsers_dropdownAppend(jsonObj);
     } else if (typeMessage == "get_online_status"){
         getOnlineStatus(jsonObj);
+    } else if (typeMessage == "hello") {
+        binaryFrames = WireProtocol::negotiatedEncoding(jsonObj) == WireProtocol::Encoding::Cbor;
     } else {
         qDebug() << "Unknown message type.";
     }
@@ -210,41 +287,117 @@ void Dialog::onSearchUsers_textEdited()
     request["from"] = login;
     request["message"] = searchText;
 
-    QJsonDocument doc(request);
-    socket->sendTextMessage(QString::fromUtf8(doc.toJson(QJsonDocument::Compact)));
+    sendRequest(request);
 }
 
 void Dialog::loadChatHistory(const QString &user)
 {
     ui->textBrowser->clear();
+    renderedCount = historyRenderWindow;
 
-    for (const QJsonValue &chatValue : history)
+    if (chatStore.contains(user))
     {
-        QJsonObject chatObj = chatValue.toObject();
-        QString otherUser = chatObj["otherUser"].toString();
+        renderChatHistory(user);
+    } else {
+        requestHistory(user, 0);
+    }
+}
+
+void Dialog::requestHistory(const QString &user, qint64 beforeId)
+{
+    QJsonObject request;
+    request["type"] = "get_history";
+    request["from"] = login;
+    request["to"] = user;
+    request["before_id"] = beforeId;
+    request["limit"] = historyPageSize;
+
+    historyRequestPending = true;
+    sendRequest(request);
+}
+
+void Dialog::handleHistory(const QJsonObject &jsonObj)
+{
+    historyRequestPending = false;
+
+    QString user = jsonObj["with"].toString();
+    const QJsonArray page = jsonObj["messages"].toArray();
+    noteMessageIds(page);
 
-        qDebug() << "Checking chat for user:" << "against otherUser:" << otherUser;
+    int held = chatStore.messages(user).size();
+    chatStore.prependPage(user, page, jsonObj["has_more"].toBool());
 
-        if (otherUser == user) 
+    if (user != ui->titleLabel->text())
+    {
+        return;
+    }
+    renderedCount += chatStore.messages(user).size() - held;
+
+    // Keep the message that was at the top in place after prepending.
+    QScrollBar *scrollBar = ui->textBrowser->verticalScrollBar();
+    int distanceFromBottom = scrollBar->maximum() - scrollBar->value();
+    bool olderPage = jsonObj["before_id"].toVariant().toLongLong() > 0;
+
+    renderChatHistory(user);
+
+    if (olderPage)
+    {
+        scrollBar->setValue(scrollBar->maximum() - distanceFromBottom);
+    }
+}
+
+void Dialog::renderChatHistory(const QString &user)
+{
+    QScrollBar *scrollBar = ui->textBrowser->verticalScrollBar();
+    QSignalBlocker blocker(scrollBar);
+
+    // Only the newest renderedCount messages, set in one go: the browser
+    // lays out the whole text once instead of once per message.
+    const QVector<StoredChatMessage> &messages = chatStore.messages(user);
+    int first = qMax(0, int(messages.size()) - renderedCount);
+    QStringList lines;
+    lines.reserve(messages.size() - first);
+    for (int i = first; i < messages.size(); ++i)
+    {
+        const StoredChatMessage &message = messages.at(i);
+        QString formattedMessage = message.sender + ": " + message.text;
+        if (!message.read)
         {
-            QJsonArray messages = chatObj["messages"].toArray();
-            for (const QJsonValue &messageValue : messages) 
-            {
-                QJsonObject messageObj = messageValue.toObject();
-                QString sender = messageObj["sender"].toString();
-                QString message = messageObj["message"].toString();
-                bool isRead = messageObj["is_read"].toBool();
-
-                QString formattedMessage = sender + ": " + message;
-                if (!isRead)
-                {
-                    formattedMessage += " (unread)";
-                }
-                ui->textBrowser->append(formattedMessage);
-            }
-            break;
+            formattedMessage += " (unread)";
         }
+        lines.append(formattedMessage);
     }
+    ui->textBrowser->setPlainText(lines.join('\n'));
+    scrollBar->setValue(scrollBar->maximum());
+}
+
+void Dialog::onHistoryScrolled(int value)
+{
+    QString user = ui->titleLabel->text();
+    QScrollBar *scrollBar = ui->textBrowser->verticalScrollBar();
+    if (value != scrollBar->minimum() || historyRequestPending)
+    {
+        return;
+    }
+
+    const QVector<StoredChatMessage> &messages = chatStore.messages(user);
+    if (renderedCount < messages.size())
+    {
+        // Older messages are already loaded; show another page of them and
+        // keep the message that was at the top in place.
+        int distanceFromBottom = scrollBar->maximum() - scrollBar->value();
+        renderedCount += historyPageSize;
+        renderChatHistory(user);
+        scrollBar->setValue(scrollBar->maximum() - distanceFromBottom);
+        return;
+    }
+
+    if (messages.isEmpty() || !chatStore.hasMore(user))
+    {
+        return;
+    }
+
+    requestHistory(user, chatStore.oldestId(user));
 }
 
 void Dialog::onSearchUsers_dropdownAppend(const QJsonObject &jsonObj)
@@ -272,8 +425,7 @@ void Dialog::onSearchUsers_dropdownAppend(const QJsonObject &jsonObj)
             request["message"] = item->text();
             request["type"] = "get_online_status";
 
-            QJsonDocument doc(request);
-            socket->sendTextMessage(QString::fromUtf8(doc.toJson(QJsonDocument::Compact)));
+            sendRequest(request);
 
             userDropdown->hide();
             userDropdown->clear();
@@ -304,8 +456,7 @@ void Dialog::markMessagesAsRead(const QString &client)
     request["from"] = login;
     request["to"] = client;
 
-    QJsonDocument doc(request);
-    socket->sendTextMessage(QString::fromUtf8(doc.toJson(QJsonDocument::Compact)));
+    sendRequest(request);
 
     qDebug() << "Sent mark_as_read request for chat with:" << client;
 }
@@ -315,12 +466,17 @@ void Dialog::handleLogin(const QJsonObject &jsonObj)
     if(jsonObj["status"] == "success")
     {
         ui->textBrowser->append(login + " successfully logged in.");
-        if (jsonObj.contains("history_messages")) 
+        resumeToken = jsonObj["resume_token"].toString();
+        if (jsonObj.contains("conversations")) 
         {
-            history = jsonObj["history_messages"].toArray();
-            handleClients(jsonObj["history_messages"].toArray());
+            const QJsonArray conversations = jsonObj["conversations"].toArray();
+            for (const QJsonValue &conversationValue : conversations)
+            {
+                lastMessageId = qMax(lastMessageId, conversationValue.toObject()["msg_id"].toVariant().toLongLong());
+            }
+            handleClients(conversations);
         } else {
-            qDebug() << "Key 'history_messages' not found or is not an array.";
+            qDebug() << "Key 'conversations' not found or is not an array.";
         }
 
         showInitialState();
@@ -335,6 +491,7 @@ void Dialog::handleRegistration(const QJsonObject &jsonObj)
     if (jsonObj["status"] == "success")
     {
         ui->textBrowser->append(login + " successfully registered.");
+        resumeToken = jsonObj["resume_token"].toString();
         showInitialState();
 
         emit onSuccess();
@@ -344,9 +501,97 @@ void Dialog::handleRegistration(const QJsonObject &jsonObj)
     }
 }
 
+void Dialog::handleResume(const QJsonObject &jsonObj)
+{
+    if (jsonObj["status"] != "success")
+    {
+        // The token expired or the server restarted; log in from scratch.
+        resumeToken.clear();
+        QJsonObject request;
+        request["type"] = "login";
+        request["login"] = login;
+        request["password"] = password;
+        sendRequest(request);
+        return;
+    }
+
+    // A long delta comes in several replies, oldest messages first; only
+    // the last one, without has_more, carries the new token.
+    bool lastPage = !jsonObj["has_more"].toBool();
+    if (lastPage)
+    {
+        resumeToken = jsonObj["resume_token"].toString();
+    }
+
+    const QJsonArray chats = jsonObj["history_messages"].toArray();
+    for (const QJsonValue &chatValue : chats)
+    {
+        QJsonObject chatObj = chatValue.toObject();
+        QString user = chatObj["otherUser"].toString();
+        QJsonArray delta = chatObj["messages"].toArray();
+
+        QJsonObject person;
+        person["login"] = user;
+        person["online"] = chatObj["online"].toString();
+        handleAddNewClient(person);
+
+        noteMessageIds(delta);
+        chatStore.appendNewer(user, delta, login);
+    }
+
+    if (lastMessageId > 0)
+    {
+        QJsonObject ack;
+        ack["type"] = "ack";
+        ack["msg_id"] = lastMessageId;
+        sendRequest(ack);
+    }
+
+    if (!lastPage)
+    {
+        return;
+    }
+
+    QString current = ui->titleLabel->text();
+    if (userItemMap.contains(current))
+    {
+        loadChatHistory(current);
+    } else {
+        ui->textBrowser->append("Reconnected.");
+    }
+}
+
+void Dialog::noteMessageIds(const QJsonArray &messages)
+{
+    for (const QJsonValue &messageValue : messages)
+    {
+        lastMessageId = qMax(lastMessageId, messageValue.toObject()["id"].toVariant().toLongLong());
+    }
+}
+
 void Dialog::handleChat(const QJsonObject &jsonObj)
 {
-    if (jsonObj["from"] == userItemMap.key(selectedUser))
+    qint64 msgId = jsonObj["msg_id"].toVariant().toLongLong();
+    lastMessageId = qMax(lastMessageId, msgId);
+
+    QString from = jsonObj["from"].toString();
+    bool chatOpen = from == userItemMap.key(selectedUser);
+    if (jsonObj["status"] == "success")
+    {
+        StoredChatMessage message;
+        message.id = msgId;
+        message.sender = from;
+        message.text = jsonObj["message"].toString();
+        message.timestamp = jsonObj["timestamp"].toString();
+        message.read = chatOpen;
+        chatStore.append(from, message);
+        if (chatOpen)
+        {
+            ++renderedCount;
+        }
+    }
+
+    if (chatOpen)
     {
         if (jsonObj["status"] == "success")
         {
@@ -354,34 +599,46 @@ void Dialog::handleChat(const QJsonObject &jsonObj)
         } else if (jsonObj["status"] == "fail") {
             ui->textBrowser->append("Message delivery failed: " + jsonObj["message"].toString());
         }
-    } else {
-        QListWidgetItem *item = userItemMap[jsonObj["from"].toString()];
+    } else if (userItemMap.contains(from)) {
+        QListWidgetItem *item = userItemMap[from];
         QString updatedText = login + " (online)" + " NEW";
         item->setText(updatedText);
     }
 
-    QString typeMessage = jsonObj["type"].toString();
-    QString fromUser = jsonObj["from"].toString();
-    QString msgId = jsonObj["msg_id"].toString();
-
-    QJsonObject ack;
-    ack["type"] = "ack";
-    ack["msg_id"] = msgId;
-    QJsonDocument ackDoc(ack);
-    socket->sendTextMessage(QString::fromUtf8(ackDoc.toJson(QJsonDocument::Compact)));
+    if (msgId > 0)
+    {
+        QJsonObject ack;
+        ack["type"] = "ack";
+        ack["msg_id"] = msgId;
+        sendRequest(ack);
+    }
 
 }
 
 void Dialog::handleUpdateClients(const QJsonObject &jsonObj)
 {
+    // The server batches presence changes; older servers send a single one.
+    if (jsonObj.contains("changes"))
+    {
+        const QJsonArray changes = jsonObj["changes"].toArray();
+        for (const QJsonValue &change : changes)
+        {
+            applyPresence(change.toObject());
+        }
+    } else {
+        applyPresence(jsonObj);
+    }
+}
 
-    if(userItemMap.contains(jsonObj["login"].toString()))
+void Dialog::applyPresence(const QJsonObject &client)
+{
+    if(userItemMap.contains(client["login"].toString()))
     {
-        if(jsonObj["online"] == "TRUE")
+        if(client["online"] == "TRUE")
         {
-            handleAddNewClient(jsonObj);
-        } else if (jsonObj["online"] == "FALSE") {
-            handleRemoveClient(jsonObj);
+            handleAddNewClient(client);
+        } else if (client["online"] == "FALSE") {
+            handleRemoveClient(client);
         }
     }
 }
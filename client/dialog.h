@@ -11,6 +11,7 @@
 #include <QTimer>
 #include <QListWidget>
 #include <QListWidgetItem>
+#include "chatstore.h"
 #include "systemmessage.h"
 
 namespace Ui {
@@ -38,8 +39,10 @@ private slots:
     void on_pushButton_clicked();
     void slotDisconnected();
     void slotTextMessageReceived(const QString &message);
+    void slotBinaryMessageReceived(const QByteArray &message);
     void onUserSelected(QListWidgetItem *item);
     void onSearchUsers_textEdited();
+    void onHistoryScrolled(int value);
 
 private:
     Ui::Dialog *ui;
@@ -49,20 +52,34 @@ private:
     QListWidgetItem *selectedUser;
     QWebSocket *socket;
     QListWidget *userDropdown = nullptr;
-    QJsonArray history;
     QHash<QString, QListWidgetItem*> userItemMap;
+    ChatStore chatStore;
+    // Newest messages of the open chat shown in the browser.
+    int renderedCount = 0;
+    bool historyRequestPending = false;
+    bool binaryFrames = false;
+    QString resumeToken;
+    qint64 lastMessageId = 0;
 
     void SendToServer(QString str, QString toLogin);
+    void sendRequest(const QJsonObject &request);
+    void handleMessage(const QJsonObject &jsonObj);
     void handleClients(const QJsonArray &clients);
     void handleAddNewClient(const QJsonObject &newClient);
     void handleRemoveClient(const QJsonObject &client);
     void loadChatHistory(const QString &user);
+    void requestHistory(const QString &user, qint64 beforeId);
+    void handleHistory(const QJsonObject &jsonObj);
+    void renderChatHistory(const QString &user);
     void onSearchUsers_dropdownAppend(const QJsonObject &client);
     void markMessagesAsRead(const QString &client);
     void handleLogin(const QJsonObject &jsonObj);
     void handleRegistration(const QJsonObject &jsonObj);
+    void handleResume(const QJsonObject &jsonObj);
+    void noteMessageIds(const QJsonArray &messages);
     void handleChat(const QJsonObject &jsonObj);
     void handleUpdateClients(const QJsonObject &jsonObj);
+    void applyPresence(const QJsonObject &client);
     void getOnlineStatus(const QJsonObject &jsonObj);
     void showInitialState();
     void restoreChatState();
@@ -0,0 +1,32 @@
+#ifndef SYSTEMMESSAGE_H
+#define SYSTEMMESSAGE_H
+
+#include <QtGlobal>
+
+// Message types with the name they carry in the "type" field of a frame,
+// null for those never sent as one. The position in this list is the
+// opcode of binary frames, so existing entries must never move; append new
+// ones at the end. Both the enum and WireProtocol's name table come from it.
+#define SYSTEM_MESSAGE_TYPES(X) \
+    X(ChatMessage, "chat") \
+    X(Login, "login") \
+    X(Registration, "registration") \
+    X(Fail, nullptr) \
+    X(Success, nullptr) \
+    X(SearchUsers, "search_users") \
+    X(GetOnlineStatus, "get_online_status") \
+    X(MarkAsRead, "mark_as_read") \
+    X(Ack, "ack") \
+    X(UpdateClients, "update_clients") \
+    X(GetHistory, "get_history") \
+    X(Hello, "hello") \
+    X(Resume, "resume") \
+    X(GetConversations, "get_conversations")
+
+enum SystemMessage : quint16 {
+#define SYSTEM_MESSAGE_ENUMERATOR(type, name) type,
+    SYSTEM_MESSAGE_TYPES(SYSTEM_MESSAGE_ENUMERATOR)
+#undef SYSTEM_MESSAGE_ENUMERATOR
+};
+
+#endif // SYSTEMMESSAGE_H
@@ -0,0 +1,291 @@
+#include "wireprotocol.h"
+
+#include <QCborArray>
+#include <QCborMap>
+#include <QCborValue>
+#include <QHash>
+#include <QJsonArray>
+#include <QJsonDocument>
+
+namespace WireProtocol
+{
+const char *const cborEncodingName = "cbor";
+const char *const zlibCompressionName = "zlib";
+
+namespace
+{
+// Integer keys of binary frames. Append only: the index is the wire value.
+const char *const fieldNames[] = {
+    "type", "from", "to", "message", "login", "password", "status", "online",
+    "msg_id", "history_messages", "clients", "before_id", "limit", "has_more",
+    "messages", "with", "otherUser", "sender", "timestamp", "is_read", "id",
+    "encoding", "encodings", "resume_token", "last_msg_id",
+    "conversations", "unread"
+};
+const int fieldCount = int(sizeof(fieldNames) / sizeof(fieldNames[0]));
+const qint64 typeKey = 0;
+
+// Indexed by SystemMessage; null entries are not message types.
+const char *const typeNames[] = {
+#define SYSTEM_MESSAGE_NAME(type, name) name,
+    SYSTEM_MESSAGE_TYPES(SYSTEM_MESSAGE_NAME)
+#undef SYSTEM_MESSAGE_NAME
+};
+const int typeCount = int(sizeof(typeNames) / sizeof(typeNames[0]));
+
+const char compressedFrameMarker = 'Z';
+const char compressedCbor = 'c';
+const char compressedJson = 'j';
+
+const QHash<QString, int> &fieldKeys()
+{
+    static const QHash<QString, int> keys = []() {
+        QHash<QString, int> result;
+        for (int i = 0; i < fieldCount; ++i)
+        {
+            result.insert(QString::fromLatin1(fieldNames[i]), i);
+        }
+        return result;
+    }();
+    return keys;
+}
+
+const QHash<QString, int> &typeCodes()
+{
+    static const QHash<QString, int> codes = []() {
+        QHash<QString, int> result;
+        for (int i = 0; i < typeCount; ++i)
+        {
+            if (typeNames[i])
+            {
+                result.insert(QString::fromLatin1(typeNames[i]), i);
+            }
+        }
+        return result;
+    }();
+    return codes;
+}
+
+QCborValue toCbor(const QJsonValue &value);
+
+QCborMap toCborMap(const QJsonObject &object)
+{
+    QCborMap map;
+    const QHash<QString, int> &keys = fieldKeys();
+
+    for (auto it = object.constBegin(); it != object.constEnd(); ++it)
+    {
+        int key = keys.value(it.key(), -1);
+        if (key == typeKey && it.value().isString())
+        {
+            int code = typeCodes().value(it.value().toString(), -1);
+            if (code >= 0)
+            {
+                map.insert(typeKey, code);
+                continue;
+            }
+        }
+
+        if (key >= 0)
+        {
+            map.insert(qint64(key), toCbor(it.value()));
+        } else {
+            map.insert(it.key(), toCbor(it.value()));
+        }
+    }
+    return map;
+}
+
+QCborValue toCbor(const QJsonValue &value)
+{
+    if (value.isObject())
+    {
+        return toCborMap(value.toObject());
+    }
+    if (value.isArray())
+    {
+        QCborArray array;
+        const QJsonArray items = value.toArray();
+        for (const QJsonValue &item : items)
+        {
+            array.append(toCbor(item));
+        }
+        return array;
+    }
+    return QCborValue::fromJsonValue(value);
+}
+
+QJsonValue fromCbor(const QCborValue &value);
+
+QJsonObject fromCborMap(const QCborMap &map)
+{
+    QJsonObject object;
+
+    for (auto it = map.constBegin(); it != map.constEnd(); ++it)
+    {
+        QCborValue key = it.key();
+        QCborValue value = it.value();
+
+        if (key.isInteger())
+        {
+            qint64 index = key.toInteger();
+            if (index == typeKey && value.isInteger())
+            {
+                qint64 code = value.toInteger();
+                if (code >= 0 && code < typeCount && typeNames[code])
+                {
+                    object.insert("type", QString::fromLatin1(typeNames[code]));
+                }
+                continue;
+            }
+
+            QString name = (index >= 0 && index < fieldCount)
+                               ? QString::fromLatin1(fieldNames[index])
+                               : QString::number(index);
+            object.insert(name, fromCbor(value));
+        } else {
+            object.insert(key.toString(), fromCbor(value));
+        }
+    }
+    return object;
+}
+
+QJsonValue fromCbor(const QCborValue &value)
+{
+    if (value.isMap())
+    {
+        return fromCborMap(value.toMap());
+    }
+    if (value.isArray())
+    {
+        QJsonArray array;
+        const QCborArray items = value.toArray();
+        for (const QCborValue &item : items)
+        {
+            array.append(fromCbor(item));
+        }
+        return array;
+    }
+    return value.toJsonValue();
+}
+}
+
+QByteArray encodeJson(const QJsonObject &message)
+{
+    return QJsonDocument(message).toJson(QJsonDocument::Compact);
+}
+
+QByteArray encodeCbor(const QJsonObject &message)
+{
+    return toCborMap(message).toCborValue().toCbor();
+}
+
+QJsonObject decodeJson(const QByteArray &frame, bool *ok)
+{
+    QJsonParseError error;
+    QJsonDocument doc = QJsonDocument::fromJson(frame, &error);
+    bool valid = error.error == QJsonParseError::NoError && doc.isObject();
+    if (ok)
+    {
+        *ok = valid;
+    }
+    return valid ? doc.object() : QJsonObject();
+}
+
+QJsonObject decodeCbor(const QByteArray &frame, bool *ok)
+{
+    QCborParserError error;
+    QCborValue value = QCborValue::fromCbor(frame, &error);
+    bool valid = error.error == QCborError::NoError && value.isMap();
+    if (ok)
+    {
+        *ok = valid;
+    }
+    return valid ? fromCborMap(value.toMap()) : QJsonObject();
+}
+
+QByteArray compressFrame(const QByteArray &frame, Encoding encoding, int level)
+{
+    QByteArray compressed;
+    compressed.append(compressedFrameMarker);
+    compressed.append(encoding == Encoding::Cbor ? compressedCbor : compressedJson);
+    compressed.append(qCompress(frame, level));
+    return compressed;
+}
+
+QJsonObject decodeBinary(const QByteArray &frame, bool *ok)
+{
+    if (frame.size() < 2 || frame.at(0) != compressedFrameMarker)
+    {
+        return decodeCbor(frame, ok);
+    }
+
+    QByteArray inner = qUncompress(reinterpret_cast<const uchar*>(frame.constData()) + 2, frame.size() - 2);
+    if (inner.isEmpty())
+    {
+        if (ok)
+        {
+            *ok = false;
+        }
+        return QJsonObject();
+    }
+    return frame.at(1) == compressedCbor ? decodeCbor(inner, ok) : decodeJson(inner, ok);
+}
+
+QJsonObject helloRequest()
+{
+    QJsonObject hello;
+    hello["type"] = "hello";
+    hello["encodings"] = QJsonArray({ QString::fromLatin1(cborEncodingName), QStringLiteral("json") });
+    hello["compressions"] = QJsonArray({ QString::fromLatin1(zlibCompressionName) });
+    return hello;
+}
+
+Encoding negotiatedEncoding(const QJsonObject &hello)
+{
+    if (hello["encoding"].toString() == QLatin1String(cborEncodingName))
+    {
+        return Encoding::Cbor;
+    }
+
+    const QJsonArray offered = hello["encodings"].toArray();
+    for (const QJsonValue &encoding : offered)
+    {
+        if (encoding.toString() == QLatin1String(cborEncodingName))
+        {
+            return Encoding::Cbor;
+        }
+    }
+    return Encoding::Json;
+}
+
+bool negotiatedCompression(const QJsonObject &hello)
+{
+    if (hello["compression"].toString() == QLatin1String(zlibCompressionName))
+    {
+        return true;
+    }
+
+    const QJsonArray offered = hello["compressions"].toArray();
+    for (const QJsonValue &compression : offered)
+    {
+        if (compression.toString() == QLatin1String(zlibCompressionName))
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+QJsonObject helloReply(Encoding encoding, bool compression)
+{
+    QJsonObject hello;
+    hello["type"] = "hello";
+    hello["encoding"] = encoding == Encoding::Cbor ? QString::fromLatin1(cborEncodingName) : QStringLiteral("json");
+    if (compression)
+    {
+        hello["compression"] = QString::fromLatin1(zlibCompressionName);
+    }
+    return hello;
+}
+}
@@ -0,0 +1,49 @@
+#ifndef WIREPROTOCOL_H
+#define WIREPROTOCOL_H
+
+#include <QByteArray>
+#include <QJsonObject>
+#include <QString>
+#include "systemmessage.h"
+
+// Frame encodings shared by the server and the client.
+//
+// JSON text frames are the default. A peer that sends
+//     {"type": "hello", "encodings": ["cbor", "json"]}
+// and receives {"type": "hello", "encoding": "cbor"} back may switch to
+// binary frames: a CBOR map in which "type" is replaced by its SystemMessage
+// opcode and well-known field names by small integer keys. Both peers keep
+// accepting text frames, so either side can fall back at any time.
+//
+// The hello also offers "compressions": ["zlib"]. When the reply carries
+// "compression": "zlib", the server may send any large frame as a binary
+// frame holding 'Z', the inner encoding ('c' CBOR, 'j' JSON) and the
+// qCompress()ed frame. A CBOR map never starts with 'Z', so such frames are
+// told apart by their first byte. Only the server compresses.
+namespace WireProtocol
+{
+enum class Encoding
+{
+    Json,
+    Cbor
+};
+
+extern const char *const cborEncodingName;
+extern const char *const zlibCompressionName;
+
+QByteArray encodeJson(const QJsonObject &message);
+QByteArray encodeCbor(const QJsonObject &message);
+QJsonObject decodeJson(const QByteArray &frame, bool *ok = nullptr);
+QJsonObject decodeCbor(const QByteArray &frame, bool *ok = nullptr);
+QByteArray compressFrame(const QByteArray &frame, Encoding encoding, int level);
+// Decodes a binary frame, plain CBOR or compressed.
+QJsonObject decodeBinary(const QByteArray &frame, bool *ok = nullptr);
+
+QJsonObject helloRequest();
+// Returns the encoding a hello request/reply settles on.
+Encoding negotiatedEncoding(const QJsonObject &hello);
+bool negotiatedCompression(const QJsonObject &hello);
+QJsonObject helloReply(Encoding encoding, bool compression = false);
+}
+
+#endif // WIREPROTOCOL_H
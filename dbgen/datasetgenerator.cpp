@@ -0,0 +1,231 @@
+#include "datasetgenerator.h"
+
+#include <QElapsedTimer>
+#include <QSet>
+#include <QSqlDatabase>
+#include <QSqlError>
+#include <QSqlQuery>
+#include <algorithm>
+#include <cmath>
+#include <random>
+#include <vector>
+#include "databasemanager.h"
+#include "passwordhasher.h"
+
+// The schema comes from DatabaseManager and messages go through
+// addMessage(), so every derived table (chat members, conversation
+// summaries, unread counts) is maintained by the code under test. Only users
+// and chats are bulk-inserted directly, one transaction each.
+
+namespace {
+const char bulkConnectionName[] = "dbgen-bulk";
+
+class PartnerPicker
+{
+public:
+    PartnerPicker(int userCount, double skew)
+        : uniform(0, userCount - 1)
+    {
+        if (skew <= 0)
+        {
+            return;
+        }
+
+        cdf.resize(userCount);
+        double total = 0;
+        for (int k = 0; k < userCount; ++k)
+        {
+            total += 1.0 / std::pow(k + 1, skew);
+            cdf[k] = total;
+        }
+        for (double &weight : cdf)
+        {
+            weight /= total;
+        }
+    }
+
+    int pick(std::mt19937_64 &random)
+    {
+        if (cdf.empty())
+        {
+            return uniform(random);
+        }
+        double u = std::uniform_real_distribution<double>(0, 1)(random);
+        int index = int(std::lower_bound(cdf.begin(), cdf.end(), u) - cdf.begin());
+        return qMin(index, int(cdf.size()) - 1);
+    }
+
+private:
+    std::uniform_int_distribution<int> uniform;
+    std::vector<double> cdf;
+};
+
+bool exec(QSqlQuery &query)
+{
+    if (!query.exec())
+    {
+        qCritical() << query.lastError().text();
+        return false;
+    }
+    return true;
+}
+
+quint64 pairKey(int low, int high)
+{
+    return (quint64(low) << 32) | quint32(high);
+}
+
+// Users and chats in bulk on a second connection: inserting them through
+// registrateNewClients/addMessage would cost one commit per row.
+bool insertUsersAndChats(QSqlDatabase &bulk, const DatasetSpec &spec, std::mt19937_64 &random,
+                         std::vector<std::pair<int, int>> &chats, DatasetSummary &summary,
+                         QTextStream *progress, const QElapsedTimer &timer)
+{
+    QSqlQuery query(bulk);
+    query.exec("PRAGMA synchronous = OFF");
+    query.exec("SELECT COALESCE(MAX(Id), 0) FROM Users");
+    const int firstId = query.next() ? query.value(0).toInt() + 1 : 1;
+
+    // One salt and hash for everybody keeps seeding fast; the server
+    // still verifies them the normal way.
+    const QString salt = PasswordHasher::generateSalt();
+    const QString hash = PasswordHasher::hash(spec.password, salt, spec.authIterations);
+
+    bulk.transaction();
+    query.prepare("INSERT INTO Users (Id, Login, Password, Salt, DeliveredUpTo) VALUES (?, ?, ?, ?, 0)");
+    for (int i = 0; i < spec.users; ++i)
+    {
+        query.bindValue(0, firstId + i);
+        query.bindValue(1, spec.loginPrefix + QString::number(i));
+        query.bindValue(2, hash);
+        query.bindValue(3, salt);
+        if (!exec(query))
+        {
+            bulk.rollback();
+            return false;
+        }
+    }
+    bulk.commit();
+    summary.users = spec.users;
+    if (progress)
+    {
+        *progress << "users:    " << spec.users << " in " << timer.elapsed() << " ms" << Qt::endl;
+    }
+
+    QSet<quint64> seen;
+    for (int partner = 1; partner <= qMin(spec.hubChats, spec.users - 1); ++partner)
+    {
+        seen.insert(pairKey(0, partner));
+        chats.emplace_back(0, partner);
+    }
+
+    PartnerPicker partners(spec.users, spec.skew);
+    for (int user = 0; user < spec.users; ++user)
+    {
+        for (int c = 0; c < spec.chatsPerUser; ++c)
+        {
+            int partner = partners.pick(random);
+            int low = qMin(user, partner);
+            int high = qMax(user, partner);
+            if (low == high || seen.contains(pairKey(low, high)))
+            {
+                continue;
+            }
+            seen.insert(pairKey(low, high));
+            chats.emplace_back(low, high);
+        }
+    }
+
+    bulk.transaction();
+    QSqlQuery members(bulk);
+    query.prepare("INSERT INTO Chats (IdName1, IdName2) VALUES (?, ?)");
+    members.prepare("INSERT INTO ChatMembers (ChatId, UserId) VALUES (?, ?), (?, ?)");
+    for (const auto &chat : chats)
+    {
+        query.bindValue(0, firstId + chat.first);
+        query.bindValue(1, firstId + chat.second);
+        if (!exec(query))
+        {
+            bulk.rollback();
+            return false;
+        }
+
+        QVariant chatId = query.lastInsertId();
+        members.bindValue(0, chatId);
+        members.bindValue(1, firstId + chat.first);
+        members.bindValue(2, chatId);
+        members.bindValue(3, firstId + chat.second);
+        if (!exec(members))
+        {
+            bulk.rollback();
+            return false;
+        }
+    }
+    bulk.commit();
+    summary.chats = int(chats.size());
+    if (progress)
+    {
+        *progress << "chats:    " << chats.size() << " in " << timer.elapsed() << " ms" << Qt::endl;
+    }
+    return true;
+}
+}
+
+bool generateDataset(DatabaseManager &manager, const QString &path, const DatasetSpec &spec,
+                     DatasetSummary *summary, QTextStream *progress)
+{
+    DatasetSummary written;
+    std::mt19937_64 random(spec.seed);
+    QElapsedTimer timer;
+    timer.start();
+
+    std::vector<std::pair<int, int>> chats;
+    bool inserted = false;
+    {
+        QSqlDatabase bulk = QSqlDatabase::addDatabase("QSQLITE", bulkConnectionName);
+        bulk.setDatabaseName(path);
+        if (!bulk.open())
+        {
+            qCritical() << bulk.lastError().text();
+        }
+        else
+        {
+            inserted = insertUsersAndChats(bulk, spec, random, chats, written, progress, timer);
+            bulk.close();
+        }
+    }
+    QSqlDatabase::removeDatabase(bulkConnectionName);
+    if (!inserted)
+    {
+        if (summary)
+        {
+            *summary = written;
+        }
+        return false;
+    }
+
+    // Messages in round-robin over chats so ids interleave like real traffic.
+    std::bernoulli_distribution coin(0.5);
+    for (int round = 0; round < spec.messagesPerChat; ++round)
+    {
+        for (const auto &chat : chats)
+        {
+            bool forward = coin(random);
+            QString from = spec.loginPrefix + QString::number(forward ? chat.first : chat.second);
+            QString to = spec.loginPrefix + QString::number(forward ? chat.second : chat.first);
+            manager.addMessage(from, to, QString("message %1 from %2").arg(round).arg(from));
+        }
+    }
+    manager.flushPendingMessages();
+    written.messages = quint64(chats.size()) * spec.messagesPerChat;
+    if (progress)
+    {
+        *progress << "messages: " << written.messages << " in " << timer.elapsed() << " ms" << Qt::endl;
+    }
+
+    if (summary)
+    {
+        *summary = written;
+    }
+    return true;
+}
@@ -0,0 +1,40 @@
+#ifndef DATASETGENERATOR_H
+#define DATASETGENERATOR_H
+
+#include <QString>
+#include <QTextStream>
+
+class DatabaseManager;
+
+// Shape of a synthetic dataset. Logins are <loginPrefix><n> for n in
+// [0, users); every user shares one password.
+struct DatasetSpec
+{
+    int users = 10000;
+    int chatsPerUser = 5;
+    int messagesPerChat = 20;
+    // Zipf exponent for chat partners; 0 picks them uniformly.
+    double skew = 1.0;
+    // Chats user 0 has with users 1..hubChats on top of the random ones,
+    // for a login with a long history.
+    int hubChats = 0;
+    quint64 seed = 1;
+    QString loginPrefix = "load";
+    QString password = "load-password";
+    int authIterations = 1000;
+};
+
+struct DatasetSummary
+{
+    int users = 0;
+    int chats = 0;
+    quint64 messages = 0;
+};
+
+// Seeds the database at path, already opened and migrated by manager, with
+// spec. Progress lines go to progress when it is set. Returns false if a
+// bulk insert failed; summary then holds what was written so far.
+bool generateDataset(DatabaseManager &manager, const QString &path, const DatasetSpec &spec,
+                     DatasetSummary *summary = nullptr, QTextStream *progress = nullptr);
+
+#endif // DATASETGENERATOR_H
@@ -0,0 +1,35 @@
+QT += core network sql websockets
+QT -= gui
+
+CONFIG += c++17 console
+CONFIG -= app_bundle
+
+equals(QT_MAJOR_VERSION, 5):lessThan(QT_MINOR_VERSION, 15): error("Building needs Qt 5.15 or Qt 6")
+
+INCLUDEPATH += ../server
+
+SOURCES += \
+        ../server/databasemanager.cpp \
+        ../server/metrics.cpp \
+        ../server/passwordhasher.cpp \
+        ../server/sqlitemessagestore.cpp \
+        ../server/statementcache.cpp \
+        ../server/tracer.cpp \
+        datasetgenerator.cpp \
+        main.cpp
+
+HEADERS += \
+    ../server/databasemanager.h \
+    ../server/lrucache.h \
+    ../server/messagestore.h \
+    ../server/metrics.h \
+    ../server/passwordhasher.h \
+    ../server/sqlitemessagestore.h \
+    ../server/statementcache.h \
+    ../server/tracer.h \
+    datasetgenerator.h
+
+# Default rules for deployment.
+qnx: target.path = /tmp/$${TARGET}/bin
+else: unix:!android: target.path = /opt/$${TARGET}/bin
+!isEmpty(target.path): INSTALLS += target
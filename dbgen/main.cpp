@@ -0,0 +1,54 @@
+#include <QCoreApplication>
+#include <QCommandLineParser>
+#include <QTextStream>
+#include "databasemanager.h"
+#include "datasetgenerator.h"
+
+// Seeds a database with a synthetic, reproducible dataset for measuring the
+// server: users, chats between them and messages in each chat. With a
+// non-zero skew chat partners follow a Zipf distribution, so a few users
+// end up in many chats, as in real traffic.
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication a(argc, argv);
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription("Seeds a QMessenger database with synthetic data");
+    parser.addHelpOption();
+
+    QCommandLineOption databaseOption("db", "Database file to create or extend.", "path", "./bench.db");
+    QCommandLineOption usersOption("users", "Number of users.", "count", "10000");
+    QCommandLineOption chatsOption("chats-per-user", "Chats started by each user.", "count", "5");
+    QCommandLineOption messagesOption("messages-per-chat", "Messages in every chat.", "count", "20");
+    QCommandLineOption skewOption("skew", "Zipf exponent for chat partners (0 = uniform).", "s", "1.0");
+    QCommandLineOption hubOption("hub-chats", "Extra chats of user 0, for a login with a long history.",
+                                 "count", "0");
+    QCommandLineOption seedOption("seed", "Random seed, for reproducible datasets.", "seed", "1");
+    QCommandLineOption prefixOption("login-prefix", "Logins are <prefix><n>.", "prefix", "load");
+    QCommandLineOption passwordOption("password", "Password of every generated user.", "password", "load-password");
+    QCommandLineOption iterationsOption("auth-iterations", "PBKDF2 iterations of the stored hash.", "count", "1000");
+    parser.addOptions({ databaseOption, usersOption, chatsOption, messagesOption, skewOption, hubOption,
+                        seedOption, prefixOption, passwordOption, iterationsOption });
+    parser.process(a);
+
+    DatasetSpec spec;
+    spec.users = qMax(2, parser.value(usersOption).toInt());
+    spec.chatsPerUser = qMax(0, parser.value(chatsOption).toInt());
+    spec.messagesPerChat = qMax(0, parser.value(messagesOption).toInt());
+    spec.skew = parser.value(skewOption).toDouble();
+    spec.hubChats = qMax(0, parser.value(hubOption).toInt());
+    spec.seed = parser.value(seedOption).toULongLong();
+    spec.loginPrefix = parser.value(prefixOption);
+    spec.password = parser.value(passwordOption);
+    spec.authIterations = parser.value(iterationsOption).toInt();
+
+    const QString path = parser.value(databaseOption);
+    DatabaseManager manager("dbgen", path);
+    FlushPolicy policy;
+    policy.maxBatchSize = 4096;
+    manager.setFlushPolicy(policy);
+
+    QTextStream out(stdout);
+    return generateDataset(manager, path, spec, nullptr, &out) ? 0 : 1;
+}
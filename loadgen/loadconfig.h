@@ -0,0 +1,33 @@
+#ifndef LOADCONFIG_H
+#define LOADCONFIG_H
+
+#include <QString>
+#include <QUrl>
+
+struct LoadConfig
+{
+    enum class Distribution
+    {
+        Uniform,
+        Zipf
+    };
+
+    QUrl url = QUrl("ws://127.0.0.1:1111");
+    int clients = 1000;
+    // New connections opened per second while ramping up.
+    int connectRate = 200;
+    // Per connected client, per second.
+    double messageRate = 1.0;
+    double searchRate = 0.0;
+    double readRate = 0.0;
+    double historyRate = 0.0;
+    int durationSeconds = 30;
+    Distribution distribution = Distribution::Uniform;
+    double zipfExponent = 1.0;
+    QString loginPrefix = "load";
+    QString password = "load-password";
+    int messageSize = 32;
+    bool binaryFrames = false;
+};
+
+#endif // LOADCONFIG_H
@@ -0,0 +1,27 @@
+QT += core network websockets
+QT -= gui
+
+CONFIG += c++17 console
+CONFIG -= app_bundle
+
+equals(QT_MAJOR_VERSION, 5):lessThan(QT_MINOR_VERSION, 15): error("Building needs Qt 5.15 or Qt 6")
+
+INCLUDEPATH += ../common
+
+SOURCES += \
+        ../common/wireprotocol.cpp \
+        loadgenerator.cpp \
+        main.cpp \
+        virtualclient.cpp
+
+HEADERS += \
+    ../common/systemmessage.h \
+    ../common/wireprotocol.h \
+    loadconfig.h \
+    loadgenerator.h \
+    virtualclient.h
+
+# Default rules for deployment.
+qnx: target.path = /tmp/$${TARGET}/bin
+else: unix:!android: target.path = /opt/$${TARGET}/bin
+!isEmpty(target.path): INSTALLS += target
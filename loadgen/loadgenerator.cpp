@@ -0,0 +1,292 @@
+#include "loadgenerator.h"
+
+#include <QCoreApplication>
+#include <QTextStream>
+#include <algorithm>
+#include <cmath>
+
+namespace {
+constexpr int tickIntervalMs = 10;
+constexpr int drainMs = 2000;
+// Start anyway if some connections never settle.
+constexpr int setupTimeoutMs = 60000;
+
+QTextStream &out()
+{
+    static QTextStream stream(stdout);
+    return stream;
+}
+
+double percentile(const std::vector<qint64> &sorted, double p)
+{
+    if (sorted.empty())
+    {
+        return 0;
+    }
+    size_t rank = size_t(std::ceil(p * sorted.size()));
+    return sorted[qBound<size_t>(1, rank, sorted.size()) - 1] / 1000.0;
+}
+}
+
+LoadGenerator::LoadGenerator(const LoadConfig &config, QObject *parent)
+    : QObject(parent)
+    , config(config)
+    , random(std::random_device()())
+    , bodyTag(QString("lg:%1:").arg(quint64(random()), 16, 16, QChar('0')))
+{
+    connect(&connectTimer, &QTimer::timeout, this, &LoadGenerator::connectNext);
+    connect(&tickTimer, &QTimer::timeout, this, &LoadGenerator::tick);
+    connect(&progressTimer, &QTimer::timeout, this, &LoadGenerator::printProgress);
+}
+
+void LoadGenerator::start()
+{
+    clock.start();
+    out() << "Connecting " << config.clients << " clients to " << config.url.toString() << Qt::endl;
+
+    for (int i = 0; i < config.clients; ++i)
+    {
+        VirtualClient *client = new VirtualClient(QString("%1%2").arg(config.loginPrefix).arg(i), config, this);
+        connect(client, &VirtualClient::ready, this, &LoadGenerator::clientSettled);
+        connect(client, &VirtualClient::failed, this, [this, client](const QString &reason) {
+            qDebug() << client->login() << "failed:" << reason;
+            ++failures;
+            clientSettled();
+        });
+        connect(client, &VirtualClient::connectionLost, this, [this]() {
+            ++failures;
+        });
+        connect(client, &VirtualClient::chatReceived, this, &LoadGenerator::recordDelivery);
+        clients.append(client);
+    }
+
+    // Open connections in small slices every tick to hold connectRate.
+    connectTimer.start(tickIntervalMs);
+    QTimer::singleShot(setupTimeoutMs, this, [this]() {
+        if (!loadBegun)
+        {
+            out() << "Setup timed out, starting with the clients that are ready" << Qt::endl;
+            beginLoad();
+        }
+    });
+}
+
+void LoadGenerator::connectNext()
+{
+    int perTick = qMax(1, config.connectRate * tickIntervalMs / 1000);
+    for (int i = 0; i < perTick && nextClient < clients.size(); ++i)
+    {
+        clients.at(nextClient++)->start();
+    }
+
+    if (nextClient >= clients.size())
+    {
+        connectTimer.stop();
+    }
+}
+
+void LoadGenerator::clientSettled()
+{
+    if (++settledClients == clients.size() && !loadBegun)
+    {
+        beginLoad();
+    }
+}
+
+void LoadGenerator::beginLoad()
+{
+    loadBegun = true;
+    connectTimer.stop();
+
+    for (VirtualClient *client : std::as_const(clients))
+    {
+        if (client->isReady())
+        {
+            active.append(client);
+        }
+    }
+    out() << active.size() << " of " << clients.size() << " clients ready after "
+          << clock.elapsed() << " ms" << Qt::endl;
+
+    if (active.size() < 2)
+    {
+        out() << "Not enough clients to exchange messages" << Qt::endl;
+        endLoad();
+        return;
+    }
+
+    // Recipient rank k is chosen with weight 1 / (k + 1)^s, so low-numbered
+    // users become hot spots; s = 0 would be uniform again.
+    if (config.distribution == LoadConfig::Distribution::Zipf)
+    {
+        recipientCdf.resize(active.size());
+        double total = 0;
+        for (int k = 0; k < active.size(); ++k)
+        {
+            total += 1.0 / std::pow(k + 1, config.zipfExponent);
+            recipientCdf[k] = total;
+        }
+        for (double &weight : recipientCdf)
+        {
+            weight /= total;
+        }
+    }
+
+    loadRunning = true;
+    loadStartedNs = clock.nsecsElapsed();
+    lastTickNs = loadStartedNs;
+    tickTimer.start(tickIntervalMs);
+    progressTimer.start(1000);
+    QTimer::singleShot(config.durationSeconds * 1000, this, &LoadGenerator::endLoad);
+}
+
+void LoadGenerator::tick()
+{
+    qint64 now = clock.nsecsElapsed();
+    double seconds = (now - lastTickNs) / 1e9;
+    lastTickNs = now;
+
+    // Fractional budgets carry over, so low rates still come out right on
+    // average even though each tick sends whole requests.
+    chatBudget += config.messageRate * active.size() * seconds;
+    searchBudget += config.searchRate * active.size() * seconds;
+    readBudget += config.readRate * active.size() * seconds;
+    historyBudget += config.historyRate * active.size() * seconds;
+
+    for (; chatBudget >= 1; chatBudget -= 1)
+    {
+        VirtualClient *sender = pickSender();
+        VirtualClient *recipient = pickRecipient(sender);
+        if (sender->isReady() && recipient->isReady())
+        {
+            sender->sendChat(recipient->login(), chatBody());
+            ++chatsSent;
+        }
+    }
+
+    for (; searchBudget >= 1; searchBudget -= 1)
+    {
+        VirtualClient *sender = pickSender();
+        QString target = pickRecipient(sender)->login();
+        int prefixLength = std::uniform_int_distribution<int>(1, target.size())(random);
+        sender->searchUsers(target.left(prefixLength));
+        ++searchesSent;
+    }
+
+    for (; readBudget >= 1; readBudget -= 1)
+    {
+        VirtualClient *sender = pickSender();
+        sender->markAsRead(pickRecipient(sender)->login());
+        ++readsSent;
+    }
+
+    for (; historyBudget >= 1; historyBudget -= 1)
+    {
+        if (pickSender()->requestHistory())
+        {
+            ++historiesSent;
+        }
+    }
+}
+
+void LoadGenerator::endLoad()
+{
+    if (loadRunning)
+    {
+        loadRunning = false;
+        loadEndedNs = clock.nsecsElapsed();
+        tickTimer.stop();
+        out() << "Load finished, draining for " << drainMs << " ms" << Qt::endl;
+    }
+
+    QTimer::singleShot(loadEndedNs ? drainMs : 0, this, [this]() {
+        progressTimer.stop();
+        report();
+        for (VirtualClient *client : std::as_const(clients))
+        {
+            client->stop();
+        }
+        emit finished();
+    });
+}
+
+void LoadGenerator::printProgress()
+{
+    out() << "  t=" << (clock.nsecsElapsed() - loadStartedNs) / 1000000000 << "s"
+          << " sent=" << chatsSent
+          << " delivered=" << chatsDelivered
+          << " (" << chatsDelivered - lastProgressDelivered << "/s)"
+          << " failures=" << failures << Qt::endl;
+    lastProgressDelivered = chatsDelivered;
+}
+
+void LoadGenerator::report()
+{
+    double seconds = loadEndedNs > loadStartedNs ? (loadEndedNs - loadStartedNs) / 1e9 : 0;
+    std::sort(latenciesUs.begin(), latenciesUs.end());
+
+    out() << Qt::endl
+          << "clients:            " << active.size() << " active, " << failures << " failures" << Qt::endl
+          << "duration:           " << seconds << " s" << Qt::endl
+          << "chat sent:          " << chatsSent << Qt::endl
+          << "chat delivered:     " << chatsDelivered << Qt::endl
+          << "earlier runs' chat: " << staleDeliveries << " ignored" << Qt::endl
+          << "search_users sent:  " << searchesSent << Qt::endl
+          << "mark_as_read sent:  " << readsSent << Qt::endl
+          << "get_history sent:   " << historiesSent << Qt::endl
+          << "messages/sec:       " << (seconds > 0 ? chatsDelivered / seconds : 0) << Qt::endl
+          << "latency p50:        " << percentile(latenciesUs, 0.50) << " ms" << Qt::endl
+          << "latency p99:        " << percentile(latenciesUs, 0.99) << " ms" << Qt::endl
+          << "latency p999:       " << percentile(latenciesUs, 0.999) << " ms" << Qt::endl
+          << "latency max:        " << (latenciesUs.empty() ? 0 : latenciesUs.back() / 1000.0) << " ms" << Qt::endl;
+}
+
+VirtualClient *LoadGenerator::pickSender()
+{
+    return active.at(std::uniform_int_distribution<int>(0, active.size() - 1)(random));
+}
+
+VirtualClient *LoadGenerator::pickRecipient(VirtualClient *sender)
+{
+    int index;
+    if (config.distribution == LoadConfig::Distribution::Zipf)
+    {
+        double u = std::uniform_real_distribution<double>(0, 1)(random);
+        index = int(std::lower_bound(recipientCdf.begin(), recipientCdf.end(), u) - recipientCdf.begin());
+        index = qMin(index, int(active.size()) - 1);
+    } else {
+        index = std::uniform_int_distribution<int>(0, active.size() - 1)(random);
+    }
+
+    // Nobody messages themselves; the next user over takes the hit.
+    if (active.at(index) == sender)
+    {
+        index = (index + 1) % active.size();
+    }
+    return active.at(index);
+}
+
+QString LoadGenerator::chatBody()
+{
+    QString body = bodyTag + QString::number(clock.nsecsElapsed()) + ' ';
+    if (body.size() < config.messageSize)
+    {
+        body += QString(config.messageSize - body.size(), 'x');
+    }
+    return body;
+}
+
+void LoadGenerator::recordDelivery(const QString &text)
+{
+    // Messages queued for these logins by an earlier run carry another
+    // process's clock, so only this run's tag is timed.
+    if (!text.startsWith(bodyTag))
+    {
+        ++staleDeliveries;
+        return;
+    }
+
+    qint64 sentNs = text.mid(bodyTag.size()).section(' ', 0, 0).toLongLong();
+    ++chatsDelivered;
+    latenciesUs.push_back((clock.nsecsElapsed() - sentNs) / 1000);
+}
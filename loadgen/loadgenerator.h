@@ -0,0 +1,83 @@
+#ifndef LOADGENERATOR_H
+#define LOADGENERATOR_H
+
+#include <QObject>
+#include <QVector>
+#include <QTimer>
+#include <QElapsedTimer>
+#include <random>
+#include <vector>
+#include "loadconfig.h"
+#include "virtualclient.h"
+
+// Drives a fleet of VirtualClients against a server in three phases:
+// connect (ramped at connectRate), load (for durationSeconds at the
+// configured per-client rates) and drain (a short grace period for frames
+// still in flight), then prints throughput and delivery latency.
+//
+// Chat bodies carry a tag unique to the run and the send time, so latency
+// is measured end to end from the sender's write to the recipient's read
+// within this one process.
+class LoadGenerator : public QObject
+{
+    Q_OBJECT
+
+public:
+    explicit LoadGenerator(const LoadConfig &config, QObject *parent = nullptr);
+
+    void start();
+
+signals:
+    void finished();
+
+private:
+    LoadConfig config;
+    QVector<VirtualClient*> clients;
+    QVector<VirtualClient*> active;
+    // Cumulative weights over active, used for Zipfian recipient choice.
+    std::vector<double> recipientCdf;
+    std::mt19937_64 random;
+    // "lg:<random run id>:" in front of every chat body of this run.
+    QString bodyTag;
+    QElapsedTimer clock;
+    QTimer connectTimer;
+    QTimer tickTimer;
+    QTimer progressTimer;
+
+    int nextClient = 0;
+    int settledClients = 0;
+    bool loadBegun = false;
+    bool loadRunning = false;
+    qint64 loadStartedNs = 0;
+    qint64 loadEndedNs = 0;
+    qint64 lastTickNs = 0;
+    double chatBudget = 0;
+    double searchBudget = 0;
+    double readBudget = 0;
+    double historyBudget = 0;
+
+    quint64 chatsSent = 0;
+    quint64 chatsDelivered = 0;
+    quint64 staleDeliveries = 0;
+    quint64 searchesSent = 0;
+    quint64 readsSent = 0;
+    quint64 historiesSent = 0;
+    quint64 failures = 0;
+    quint64 lastProgressDelivered = 0;
+    std::vector<qint64> latenciesUs;
+
+    void connectNext();
+    void clientSettled();
+    void beginLoad();
+    void tick();
+    void endLoad();
+    void printProgress();
+    void report();
+
+    VirtualClient *pickSender();
+    VirtualClient *pickRecipient(VirtualClient *sender);
+    QString chatBody();
+    void recordDelivery(const QString &text);
+};
+
+#endif // LOADGENERATOR_H
@@ -0,0 +1,60 @@
+#include <QCoreApplication>
+#include <QCommandLineParser>
+#include "loadgenerator.h"
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication a(argc, argv);
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription("QMessenger load generator");
+    parser.addHelpOption();
+
+    QCommandLineOption urlOption("url", "Server address.", "url", "ws://127.0.0.1:1111");
+    QCommandLineOption clientsOption("clients", "Number of concurrent connections.", "count", "1000");
+    QCommandLineOption connectRateOption("connect-rate", "New connections per second during ramp-up.", "count", "200");
+    QCommandLineOption messageRateOption("message-rate", "Chat messages per second per client.", "rate", "1");
+    QCommandLineOption searchRateOption("search-rate", "search_users requests per second per client.", "rate", "0");
+    QCommandLineOption readRateOption("read-rate", "mark_as_read requests per second per client.", "rate", "0");
+    QCommandLineOption historyRateOption("history-rate", "get_history requests per second per client.", "rate", "0");
+    QCommandLineOption durationOption("duration", "Seconds of load after all clients are connected.", "seconds", "30");
+    QCommandLineOption distributionOption("distribution", "Recipient choice: uniform or zipf.", "name", "uniform");
+    QCommandLineOption zipfOption("zipf-exponent", "Skew of the zipf distribution.", "s", "1.0");
+    QCommandLineOption prefixOption("login-prefix", "Logins are <prefix><n>.", "prefix", "load");
+    QCommandLineOption passwordOption("password", "Password of every generated user.", "password", "load-password");
+    QCommandLineOption sizeOption("message-size", "Chat message length in characters.", "chars", "32");
+    QCommandLineOption binaryOption("binary", "Negotiate CBOR binary frames.");
+    parser.addOptions({ urlOption, clientsOption, connectRateOption, messageRateOption, searchRateOption,
+                        readRateOption, historyRateOption, durationOption, distributionOption, zipfOption,
+                        prefixOption, passwordOption, sizeOption, binaryOption });
+    parser.process(a);
+
+    LoadConfig config;
+    config.url = QUrl(parser.value(urlOption));
+    config.clients = qMax(2, parser.value(clientsOption).toInt());
+    config.connectRate = qMax(1, parser.value(connectRateOption).toInt());
+    config.messageRate = parser.value(messageRateOption).toDouble();
+    config.searchRate = parser.value(searchRateOption).toDouble();
+    config.readRate = parser.value(readRateOption).toDouble();
+    config.historyRate = parser.value(historyRateOption).toDouble();
+    config.durationSeconds = qMax(1, parser.value(durationOption).toInt());
+    config.zipfExponent = parser.value(zipfOption).toDouble();
+    config.loginPrefix = parser.value(prefixOption);
+    config.password = parser.value(passwordOption);
+    config.messageSize = parser.value(sizeOption).toInt();
+    config.binaryFrames = parser.isSet(binaryOption);
+
+    QString distribution = parser.value(distributionOption);
+    if (distribution == "zipf")
+    {
+        config.distribution = LoadConfig::Distribution::Zipf;
+    } else if (distribution != "uniform") {
+        qCritical() << "Unknown distribution" << distribution;
+        return 1;
+    }
+
+    LoadGenerator generator(config);
+    QObject::connect(&generator, &LoadGenerator::finished, &a, &QCoreApplication::quit, Qt::QueuedConnection);
+    generator.start();
+    return a.exec();
+}
@@ -0,0 +1,228 @@
+#include "virtualclient.h"
+#include "wireprotocol.h"
+
+#include <QTimer>
+
+namespace {
+// Backoff before repeating a request the server refused as busy.
+constexpr int busyRetryMs = 500;
+}
+
+VirtualClient::VirtualClient(const QString &login, const LoadConfig &config, QObject *parent)
+    : QObject(parent)
+    , loginName(login)
+    , config(config)
+{
+    connect(&socket, &QWebSocket::connected, this, &VirtualClient::slotConnected);
+    connect(&socket, &QWebSocket::disconnected, this, &VirtualClient::slotDisconnected);
+    connect(&socket, &QWebSocket::textMessageReceived, this, &VirtualClient::slotTextMessageReceived);
+    connect(&socket, &QWebSocket::binaryMessageReceived, this, &VirtualClient::slotBinaryMessageReceived);
+    connect(&socket, &QWebSocket::errorOccurred, this, [this](QAbstractSocket::SocketError) {
+        if (!readyState && !stopping)
+        {
+            fail(socket.errorString());
+        }
+    });
+}
+
+void VirtualClient::start()
+{
+    socket.open(config.url);
+}
+
+void VirtualClient::stop()
+{
+    stopping = true;
+    socket.close();
+}
+
+bool VirtualClient::isReady() const
+{
+    return readyState;
+}
+
+QString VirtualClient::login() const
+{
+    return loginName;
+}
+
+void VirtualClient::sendChat(const QString &to, const QString &text)
+{
+    QJsonObject request;
+    request["type"] = "chat";
+    request["from"] = loginName;
+    request["to"] = to;
+    request["message"] = text;
+    send(request);
+}
+
+void VirtualClient::searchUsers(const QString &prefix)
+{
+    QJsonObject request;
+    request["type"] = "search_users";
+    request["from"] = loginName;
+    request["message"] = prefix;
+    send(request);
+}
+
+void VirtualClient::markAsRead(const QString &partner)
+{
+    QJsonObject request;
+    request["type"] = "mark_as_read";
+    request["from"] = loginName;
+    request["to"] = partner;
+    send(request);
+}
+
+bool VirtualClient::requestHistory()
+{
+    if (lastSender.isEmpty())
+    {
+        return false;
+    }
+
+    QJsonObject request;
+    request["type"] = "get_history";
+    request["to"] = lastSender;
+    request["before_id"] = lastMessageId;
+    send(request);
+    return true;
+}
+
+void VirtualClient::slotConnected()
+{
+    if (config.binaryFrames)
+    {
+        socket.sendTextMessage(QString::fromUtf8(WireProtocol::encodeJson(WireProtocol::helloRequest())));
+    }
+    // Registering doubles as an existence check: a taken login falls back
+    // to logging in, so reruns against the same database just work.
+    sendCredentials("registration");
+}
+
+void VirtualClient::slotDisconnected()
+{
+    if (stopping)
+    {
+        return;
+    }
+
+    if (readyState)
+    {
+        readyState = false;
+        emit connectionLost();
+    } else {
+        fail(socket.errorString());
+    }
+}
+
+void VirtualClient::slotTextMessageReceived(const QString &message)
+{
+    bool ok = false;
+    QJsonObject jsonObj = WireProtocol::decodeJson(message.toUtf8(), &ok);
+    if (ok)
+    {
+        handleMessage(jsonObj);
+    }
+}
+
+void VirtualClient::slotBinaryMessageReceived(const QByteArray &message)
+{
+    bool ok = false;
+    QJsonObject jsonObj = WireProtocol::decodeBinary(message, &ok);
+    if (ok)
+    {
+        handleMessage(jsonObj);
+    }
+}
+
+void VirtualClient::send(const QJsonObject &request)
+{
+    if (binaryFrames)
+    {
+        socket.sendBinaryMessage(WireProtocol::encodeCbor(request));
+    } else {
+        socket.sendTextMessage(QString::fromUtf8(WireProtocol::encodeJson(request)));
+    }
+}
+
+void VirtualClient::sendCredentials(const QString &type)
+{
+    QJsonObject request;
+    request["type"] = type;
+    request["login"] = loginName;
+    request["password"] = config.password;
+    send(request);
+}
+
+void VirtualClient::handleMessage(const QJsonObject &jsonObj)
+{
+    QString typeMessage = jsonObj["type"].toString();
+
+    if (typeMessage == "hello")
+    {
+        binaryFrames = WireProtocol::negotiatedEncoding(jsonObj) == WireProtocol::Encoding::Cbor;
+    } else if (typeMessage == "registration" || typeMessage == "login") {
+        handleAuthReply(jsonObj);
+    } else if (typeMessage == "chat") {
+        if (jsonObj["status"] != "success")
+        {
+            return;
+        }
+
+        qint64 msgId = jsonObj["msg_id"].toVariant().toLongLong();
+        if (msgId > 0)
+        {
+            lastSender = jsonObj["from"].toString();
+            lastMessageId = msgId;
+
+            QJsonObject ack;
+            ack["type"] = "ack";
+            ack["msg_id"] = msgId;
+            send(ack);
+        }
+        emit chatReceived(jsonObj["message"].toString());
+    }
+}
+
+void VirtualClient::handleAuthReply(const QJsonObject &jsonObj)
+{
+    QString typeMessage = jsonObj["type"].toString();
+
+    if (jsonObj["status"] == "success")
+    {
+        markReady();
+        return;
+    }
+
+    if (jsonObj["message"].toString().startsWith("Server is busy"))
+    {
+        QTimer::singleShot(busyRetryMs, this, [this, typeMessage]() {
+            sendCredentials(typeMessage);
+        });
+    } else if (typeMessage == "registration") {
+        sendCredentials("login");
+    } else {
+        fail(jsonObj["message"].toString());
+    }
+}
+
+void VirtualClient::fail(const QString &reason)
+{
+    if (failedState)
+    {
+        return;
+    }
+    failedState = true;
+    emit failed(reason);
+}
+
+void VirtualClient::markReady()
+{
+    if (readyState || failedState)
+    {
+        return;
+    }
+    readyState = true;
+    emit ready();
+}
@@ -0,0 +1,65 @@
+#ifndef VIRTUALCLIENT_H
+#define VIRTUALCLIENT_H
+
+#include <QObject>
+#include <QWebSocket>
+#include <QJsonObject>
+#include "loadconfig.h"
+
+// One simulated user speaking the same protocol as Dialog. It registers,
+// or logs in when the account already exists, then reports ready and sends
+// whatever the generator asks for. Incoming chat frames are acked like the
+// real client does.
+class VirtualClient : public QObject
+{
+    Q_OBJECT
+
+public:
+    VirtualClient(const QString &login, const LoadConfig &config, QObject *parent = nullptr);
+
+    void start();
+    void stop();
+    bool isReady() const;
+    QString login() const;
+
+    void sendChat(const QString &to, const QString &text);
+    void searchUsers(const QString &prefix);
+    void markAsRead(const QString &partner);
+    // Pages back through the chat with the last user who wrote to us,
+    // starting at the newest message received; false before any arrived.
+    bool requestHistory();
+
+signals:
+    void ready();
+    // Before ready: registration/login or the connection itself failed.
+    void failed(const QString &reason);
+    // After ready: the server dropped the connection.
+    void connectionLost();
+    void chatReceived(const QString &text);
+
+private slots:
+    void slotConnected();
+    void slotDisconnected();
+    void slotTextMessageReceived(const QString &message);
+    void slotBinaryMessageReceived(const QByteArray &message);
+
+private:
+    QWebSocket socket;
+    QString loginName;
+    const LoadConfig &config;
+    bool binaryFrames = false;
+    bool readyState = false;
+    bool failedState = false;
+    bool stopping = false;
+    QString lastSender;
+    qint64 lastMessageId = 0;
+
+    void send(const QJsonObject &request);
+    void sendCredentials(const QString &type);
+    void handleMessage(const QJsonObject &jsonObj);
+    void handleAuthReply(const QJsonObject &jsonObj);
+    void fail(const QString &reason);
+    void markReady();
+};
+
+#endif // VIRTUALCLIENT_H
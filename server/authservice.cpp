@@ -0,0 +1,138 @@
+#include "authservice.h"
+#include "passwordhasher.h"
+
+namespace {
+struct Verification
+{
+    bool ok = false;
+    QString upgradedHash;
+    QString upgradedSalt;
+};
+
+struct NewPassword
+{
+    QString hash;
+    QString salt;
+};
+}
+
+AuthService::AuthService(DbExecutor &dbExecutor, const AuthConfig &config, QObject *parent)
+    : QObject(parent), dbExecutor(dbExecutor), config(config),
+    pendingGauge(Metrics::instance().gauge("qmessenger_auth_pending", "Logins and registrations admitted and not finished.")),
+    runningGauge(Metrics::instance().gauge("qmessenger_auth_running", "Password hashes being computed.")),
+    rejectedCounter(Metrics::instance().counter("qmessenger_auth_rejected_total", "Logins and registrations refused as busy.")),
+    queueHistogram(Metrics::instance().histogram("qmessenger_auth_queue_duration_seconds",
+                                                 "Time from admission until password hashing starts.")),
+    latencyHistogram(Metrics::instance().histogram("qmessenger_auth_duration_seconds",
+                                                   "Time from admission until the result is known."))
+{
+    this->config.iterations = qMax(1, config.iterations);
+    this->config.maxPending = qMax(1, config.maxPending);
+    pool.setMaxThreadCount(qMax(1, config.threads));
+}
+
+AuthService::~AuthService()
+{
+    pool.clear();
+    pool.waitForDone();
+}
+
+bool AuthService::authenticate(const QString &login, const QString &password, Done done)
+{
+    if (!admit())
+    {
+        return false;
+    }
+
+    QElapsedTimer admitted;
+    admitted.start();
+    int iterations = config.iterations;
+
+    dbExecutor.read([login](DatabaseManager &db) {
+        return db.getUserCredentials(login);
+    }, this, [this, login, password, iterations, admitted, done](const UserCredentials &credentials) {
+        compute(admitted, [password, iterations, credentials]() {
+            TraceSpan span("verify_password", "auth");
+            Verification verification;
+            if (credentials.id < 0)
+            {
+                // Same cost as a real check, so response time does not tell
+                // which logins exist.
+                PasswordHasher::hash(password, QString(), iterations);
+                return verification;
+            }
+
+            verification.ok = PasswordHasher::verify(password, credentials.salt, credentials.passwordHash);
+            if (verification.ok && PasswordHasher::needsRehash(credentials.passwordHash, iterations))
+            {
+                verification.upgradedSalt = PasswordHasher::generateSalt();
+                verification.upgradedHash = PasswordHasher::hash(password, verification.upgradedSalt, iterations);
+            }
+            return verification;
+        }, [this, login, admitted, done](const Verification &verification) {
+            if (!verification.upgradedHash.isEmpty())
+            {
+                QString hash = verification.upgradedHash;
+                QString salt = verification.upgradedSalt;
+                dbExecutor.write([login, hash, salt](DatabaseManager &db) {
+                    db.updatePasswordHash(login, hash, salt);
+                });
+            }
+            finish(admitted);
+            done(verification.ok);
+        });
+    });
+    return true;
+}
+
+bool AuthService::registerUser(const QString &login, const QString &password, Done done)
+{
+    if (!admit())
+    {
+        return false;
+    }
+
+    QElapsedTimer admitted;
+    admitted.start();
+    int iterations = config.iterations;
+
+    compute(admitted, [password, iterations]() {
+        TraceSpan span("hash_password", "auth");
+        NewPassword newPassword;
+        newPassword.salt = PasswordHasher::generateSalt();
+        newPassword.hash = PasswordHasher::hash(password, newPassword.salt, iterations);
+        return newPassword;
+    }, [this, login, admitted, done](const NewPassword &newPassword) {
+        dbExecutor.write([login, newPassword](DatabaseManager &db) {
+            return db.registrateNewClients(login, newPassword.hash, newPassword.salt);
+        }, this, [this, admitted, done](bool registered) {
+            finish(admitted);
+            done(registered);
+        });
+    });
+    return true;
+}
+
+bool AuthService::admit()
+{
+    if (pending >= config.maxPending)
+    {
+        rejectedCounter.add();
+        return false;
+    }
+    ++pending;
+    pendingGauge.add(1);
+    return true;
+}
+
+void AuthService::finish(const QElapsedTimer &admitted)
+{
+    latencyHistogram.record(admitted.nsecsElapsed() / 1000);
+    --pending;
+    pendingGauge.add(-1);
+}
+
+void AuthService::recordQueueWait(qint64 micros)
+{
+    queueHistogram.record(micros);
+}
@@ -0,0 +1,79 @@
+#ifndef AUTHSERVICE_H
+#define AUTHSERVICE_H
+
+#include <QObject>
+#include <QThreadPool>
+#include <QElapsedTimer>
+#include <QMetaObject>
+#include <functional>
+#include "dbexecutor.h"
+#include "metrics.h"
+#include "tracer.h"
+
+// How expensive password hashing is and how much of it may run at once.
+struct AuthConfig
+{
+    int iterations = 100000;
+    int threads = 2;
+    int maxPending = 256;
+};
+
+// Login and registration requests, with the key derivation they need, run
+// on a small pool of their own so a burst of logins cannot stall routing on
+// the Server thread or starve the database lanes. At most maxPending
+// requests are admitted at once; beyond that callers are refused straight
+// away and should ask the client to retry.
+//
+// Callbacks run on the thread that owns the service. Admissions, refusals,
+// hashing in progress and the queue and total latencies are exported as
+// qmessenger_auth_* metrics.
+class AuthService : public QObject
+{
+    Q_OBJECT
+
+public:
+    typedef std::function<void(bool)> Done;
+
+    AuthService(DbExecutor &dbExecutor, const AuthConfig &config, QObject *parent = nullptr);
+    ~AuthService();
+
+    // Both return false, without calling done, when the request was refused.
+    bool authenticate(const QString &login, const QString &password, Done done);
+    bool registerUser(const QString &login, const QString &password, Done done);
+
+private:
+    DbExecutor &dbExecutor;
+    AuthConfig config;
+    QThreadPool pool;
+    int pending = 0;
+    Gauge &pendingGauge;
+    Gauge &runningGauge;
+    Counter &rejectedCounter;
+    Histogram &queueHistogram;
+    Histogram &latencyHistogram;
+
+    bool admit();
+    void finish(const QElapsedTimer &admitted);
+    void recordQueueWait(qint64 micros);
+
+    // Runs work on the pool and hands its result to done on this thread.
+    template <typename Work, typename Finished>
+    void compute(const QElapsedTimer &admitted, Work work, Finished finished)
+    {
+        TraceContext trace = Tracer::currentContext();
+        pool.start([this, admitted, work, finished, trace]() {
+            qint64 waited = admitted.nsecsElapsed() / 1000;
+            runningGauge.add(1);
+            TraceContextScope traceScope(trace);
+            auto result = work();
+            runningGauge.add(-1);
+            QMetaObject::invokeMethod(this, [this, waited, finished, result, trace]() {
+                TraceContextScope traceScope(trace);
+                recordQueueWait(waited);
+                finished(result);
+            }, Qt::QueuedConnection);
+        });
+    }
+};
+
+#endif // AUTHSERVICE_H
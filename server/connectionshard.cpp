@@ -0,0 +1,189 @@
+#include "connectionshard.h"
+
+ConnectionShard::ConnectionShard(int index, const CompressionPolicy &compression, QObject *parent)
+    : QObject(parent),
+    shardIndex(index),
+    compression(compression),
+    outboundBytesPending(Metrics::instance().gauge("qmessenger_outbound_bytes_pending",
+                                                   "Frame bytes queued on sockets but not yet written.")),
+    compressedFrames(Metrics::instance().counter("qmessenger_compressed_frames_total",
+                                                 "Outbound frames sent compressed.")),
+    compressionInputBytes(Metrics::instance().counter("qmessenger_compression_input_bytes_total",
+                                                      "Size of compressed outbound frames before compression.")),
+    compressionOutputBytes(Metrics::instance().counter("qmessenger_compression_output_bytes_total",
+                                                       "Size of compressed outbound frames as sent.")),
+    incompressibleFrames(Metrics::instance().counter("qmessenger_compression_skipped_total",
+                                                     "Frames over the threshold sent as is because compression did not shrink them.")),
+    compressionTime(Metrics::instance().histogram("qmessenger_compression_duration_seconds",
+                                                  "Time spent compressing one outbound frame."))
+{
+}
+
+int ConnectionShard::index() const
+{
+    return shardIndex;
+}
+
+void ConnectionShard::adopt(ConnectionId connection, QWebSocket *socket)
+{
+    socket->setParent(this);
+    sockets.insert(connection, socket);
+    connections.insert(socket, connection);
+
+    connect(socket, &QWebSocket::textMessageReceived, this, &ConnectionShard::slotTextMessageReceived);
+    connect(socket, &QWebSocket::binaryMessageReceived, this, &ConnectionShard::slotBinaryMessageReceived);
+    connect(socket, &QWebSocket::disconnected, this, &ConnectionShard::slotDisconnected);
+    connect(socket, &QWebSocket::bytesWritten, this, [this, connection](qint64 bytes) {
+        bytesWritten(connection, bytes);
+    });
+}
+
+void ConnectionShard::send(ConnectionId connection, const QJsonObject &message)
+{
+    // The socket may have gone away while the Server was preparing this.
+    QWebSocket *socket = sockets.value(connection, nullptr);
+    if (!socket)
+    {
+        return;
+    }
+
+    WireProtocol::Encoding encoding = encodings.value(connection, WireProtocol::Encoding::Json);
+    bool binary = encoding == WireProtocol::Encoding::Cbor;
+    QByteArray frame;
+    {
+        TraceSpan span("encode", "wire");
+        frame = binary ? WireProtocol::encodeCbor(message) : WireProtocol::encodeJson(message);
+    }
+
+    if (frame.size() >= compression.thresholdBytes && compressing.contains(connection))
+    {
+        QByteArray compressed;
+        {
+            TraceSpan span("compress", "wire");
+            MetricsTimer timer(compressionTime);
+            compressed = WireProtocol::compressFrame(frame, encoding, compression.level);
+        }
+        if (compressed.size() < frame.size())
+        {
+            compressedFrames.add();
+            compressionInputBytes.add(quint64(frame.size()));
+            compressionOutputBytes.add(quint64(compressed.size()));
+            frame = compressed;
+            binary = true;
+        } else {
+            incompressibleFrames.add();
+        }
+    }
+
+    TraceSpan span("socket_send", "wire");
+    qint64 queued = binary ? socket->sendBinaryMessage(frame) : socket->sendTextMessage(QString::fromUtf8(frame));
+
+    pendingBytes[connection] += queued;
+    outboundBytesPending.add(queued);
+}
+
+void ConnectionShard::bytesWritten(ConnectionId connection, qint64 bytes)
+{
+    // Written counts include frame headers and the hello reply, which were
+    // never added, so only drain what is actually outstanding.
+    auto it = pendingBytes.find(connection);
+    if (it == pendingBytes.end())
+    {
+        return;
+    }
+
+    qint64 drained = qMin(bytes, it.value());
+    it.value() -= drained;
+    outboundBytesPending.add(-drained);
+}
+
+void ConnectionShard::closeAll()
+{
+    for (QWebSocket *socket : std::as_const(sockets))
+    {
+        socket->disconnect(this);
+        socket->close();
+    }
+    qDeleteAll(sockets);
+    sockets.clear();
+    connections.clear();
+    encodings.clear();
+    compressing.clear();
+    for (qint64 bytes : std::as_const(pendingBytes))
+    {
+        outboundBytesPending.add(-bytes);
+    }
+    pendingBytes.clear();
+}
+
+void ConnectionShard::slotTextMessageReceived(const QString &message)
+{
+    bool ok = false;
+    QJsonObject jsonObj;
+    {
+        TraceSpan span("decode", "wire");
+        jsonObj = WireProtocol::decodeJson(message.toUtf8(), &ok);
+    }
+    if (ok)
+    {
+        dispatch(qobject_cast<QWebSocket*>(sender()), jsonObj);
+    }
+}
+
+void ConnectionShard::slotBinaryMessageReceived(const QByteArray &message)
+{
+    bool ok = false;
+    QJsonObject jsonObj;
+    {
+        TraceSpan span("decode", "wire");
+        jsonObj = WireProtocol::decodeCbor(message, &ok);
+    }
+    if (ok)
+    {
+        dispatch(qobject_cast<QWebSocket*>(sender()), jsonObj);
+    }
+}
+
+void ConnectionShard::dispatch(QWebSocket *socket, const QJsonObject &message)
+{
+    ConnectionId connection = connections.value(socket, 0);
+    if (!connection)
+    {
+        return;
+    }
+
+    // Encoding negotiation is a transport detail and never reaches the Server.
+    if (message["type"].toString() == "hello")
+    {
+        WireProtocol::Encoding encoding = WireProtocol::negotiatedEncoding(message);
+        bool compressed = compression.thresholdBytes > 0 && WireProtocol::negotiatedCompression(message);
+        socket->sendTextMessage(QString::fromUtf8(WireProtocol::encodeJson(WireProtocol::helloReply(encoding, compressed))));
+        encodings.insert(connection, encoding);
+        if (compressed)
+        {
+            compressing.insert(connection);
+        } else {
+            compressing.remove(connection);
+        }
+        return;
+    }
+
+    emit messageReceived(connection, message);
+}
+
+void ConnectionShard::slotDisconnected()
+{
+    QWebSocket *socket = qobject_cast<QWebSocket*>(sender());
+    ConnectionId connection = connections.take(socket);
+    if (!connection)
+    {
+        return;
+    }
+
+    sockets.remove(connection);
+    encodings.remove(connection);
+    compressing.remove(connection);
+    outboundBytesPending.add(-pendingBytes.take(connection));
+    emit connectionClosed(connection);
+    socket->deleteLater();
+}
@@ -0,0 +1,73 @@
+#ifndef CONNECTIONSHARD_H
+#define CONNECTIONSHARD_H
+
+#include <QObject>
+#include <QHash>
+#include <QSet>
+#include <QWebSocket>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include "metrics.h"
+#include "tracer.h"
+#include "sessionregistry.h"
+#include "wireprotocol.h"
+
+// Frames of at least thresholdBytes are sent zlib-compressed at level to
+// connections that negotiated it; 0 bytes turns compression off.
+struct CompressionPolicy
+{
+    int thresholdBytes = 4096;
+    int level = 6;
+};
+
+// Owns a subset of the accepted sockets and runs their I/O, frame decoding
+// and encoding on its own thread. The hello exchange that picks JSON or
+// binary CBOR frames and frame compression for a connection is handled here
+// as well. Incoming requests are forwarded to the
+// Server as parsed objects; the Server answers through send(), which may be
+// called for any connection of this shard from any thread via a queued
+// invocation.
+class ConnectionShard : public QObject
+{
+    Q_OBJECT
+
+public:
+    ConnectionShard(int index, const CompressionPolicy &compression, QObject *parent = nullptr);
+
+    int index() const;
+
+    // Must run on the shard's thread.
+    void adopt(ConnectionId connection, QWebSocket *socket);
+    void send(ConnectionId connection, const QJsonObject &message);
+    void closeAll();
+
+signals:
+    void messageReceived(quint64 connection, const QJsonObject &message);
+    void connectionClosed(quint64 connection);
+
+private slots:
+    void slotTextMessageReceived(const QString &message);
+    void slotBinaryMessageReceived(const QByteArray &message);
+    void slotDisconnected();
+
+private:
+    int shardIndex;
+    QHash<ConnectionId, QWebSocket*> sockets;
+    QHash<QWebSocket*, ConnectionId> connections;
+    QHash<ConnectionId, WireProtocol::Encoding> encodings;
+    CompressionPolicy compression;
+    QSet<ConnectionId> compressing;
+    // Bytes handed to each socket that it has not written out yet.
+    QHash<ConnectionId, qint64> pendingBytes;
+    Gauge &outboundBytesPending;
+    Counter &compressedFrames;
+    Counter &compressionInputBytes;
+    Counter &compressionOutputBytes;
+    Counter &incompressibleFrames;
+    Histogram &compressionTime;
+
+    void dispatch(QWebSocket *socket, const QJsonObject &message);
+    void bytesWritten(ConnectionId connection, qint64 bytes);
+};
+
+#endif // CONNECTIONSHARD_H
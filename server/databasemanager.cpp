@@ -1,26 +1,369 @@
 #include "databasemanager.h"
+#include "sqlitemessagestore.h"
+#include <QSet>
+#include <algorithm>
 
-DatabaseManager::DatabaseManager() 
+namespace {
+// Characters of the newest message kept in a conversation summary.
+constexpr int snippetLength = 100;
+const char *const defaultDatabasePath = "./messanger_users.db";
+
+QJsonObject messageJson(const StoredMessage &message, const QString &sender, bool isRead)
+{
+    QJsonObject messageObj;
+    messageObj["id"] = message.id;
+    messageObj["sender"] = sender;
+    messageObj["message"] = message.message;
+    messageObj["timestamp"] = message.timestamp;
+    messageObj["is_read"] = isRead;
+    return messageObj;
+}
+}
+
+const QString DatabaseManager::inMemoryDatabase = QStringLiteral(":memory:");
+
+DatabaseManager::DatabaseManager(const QString &connectionName, const QString &databasePath,
+                                 const StorageProfile &profile, bool readOnly, MessageStore *messageStore)
+    : connectionName(connectionName.isEmpty() ? QString(QSqlDatabase::defaultConnection) : connectionName),
+    readOnly(readOnly),
+    store(messageStore)
 {
+    exportCacheMetrics();
     if (!db.isValid()) 
     {
-        db = QSqlDatabase::addDatabase("QSQLITE");
-        db.setDatabaseName("./messanger_users.db");
+        db = QSqlDatabase::addDatabase("QSQLITE", this->connectionName);
+        // Several connections share the file; wait for a lock instead of
+        // failing straight away with SQLITE_BUSY.
+        QStringList options = { QString("QSQLITE_BUSY_TIMEOUT=%1").arg(qMax(0, profile.busyTimeoutMs)) };
+        if (readOnly)
+        {
+            options << "QSQLITE_OPEN_READONLY";
+        }
+        db.setDatabaseName(databasePath.isEmpty() ? QString(defaultDatabasePath) : databasePath);
+        db.setConnectOptions(options.join(';'));
+        if (!store)
+        {
+            ownedStore.reset(new SqliteMessageStore(db));
+            store = ownedStore.get();
+        }
         if (!db.open()) 
         {
             return;
         }
 
-        if (!initializeDatabase())
+        applyStorageProfile(profile);
+        if (!readOnly)
         {
-            return;
+            if (!initializeDatabase())
+            {
+                return;
+            }
+            loadNextMessageId();
         }
     }
+
+    flushTimer.setSingleShot(true);
+    QObject::connect(&flushTimer, &QTimer::timeout, [this]() {
+        flushPendingMessages();
+    });
+    QObject::connect(&archiveTimer, &QTimer::timeout, [this]() {
+        archiveMessages();
+    });
 }
 
 DatabaseManager::~DatabaseManager() 
 {
+    flushPendingMessages();
+    statements.clear();
+    ownedStore.reset();
     db.close();
+    db = QSqlDatabase();
+    QSqlDatabase::removeDatabase(connectionName);
+}
+
+void DatabaseManager::setFlushPolicy(const FlushPolicy &policy)
+{
+    flushPolicy = policy;
+    flushPolicy.maxBatchSize = qMax(1, flushPolicy.maxBatchSize);
+    flushPolicy.maxDelayMs = qMax(0, flushPolicy.maxDelayMs);
+}
+
+void DatabaseManager::setCommittedWatermark(std::atomic<qint64> *watermark)
+{
+    committedWatermark = watermark;
+    if (committedWatermark)
+    {
+        committedWatermark->store(nextMessageId - 1);
+    }
+}
+
+void DatabaseManager::setArchivePolicy(const ArchivePolicy &policy)
+{
+    archivePolicy = policy;
+    archiveTimer.stop();
+    if (readOnly || archivePolicy.maxAgeDays <= 0)
+    {
+        return;
+    }
+
+    publishArchiveStats();
+    archiveTimer.start(qMax(1, archivePolicy.intervalSeconds) * 1000);
+}
+
+int DatabaseManager::archiveMessages()
+{
+    if (readOnly || archivePolicy.maxAgeDays <= 0)
+    {
+        return 0;
+    }
+
+    static Histogram &latency = Metrics::dbOperation("archiveMessages");
+    MetricsTimer timer(latency);
+    TraceSpan span("archiveMessages", "db");
+
+    QString cutoff = QDateTime::currentDateTimeUtc().addDays(-archivePolicy.maxAgeDays).toString("yyyy-MM-dd HH:mm:ss");
+
+    // One bounded batch per run, so the writer lane is never held for long.
+    if (!db.transaction())
+    {
+        return 0;
+    }
+    int moved = store->archive(cutoff, archivePolicy);
+    if (!db.commit())
+    {
+        qDebug() << "Failed to commit archive batch:" << db.lastError().text();
+        db.rollback();
+        return 0;
+    }
+
+    if (moved > 0)
+    {
+        publishArchiveStats();
+    }
+    return moved;
+}
+
+void DatabaseManager::publishArchiveStats()
+{
+    static Gauge &blocks = Metrics::instance().gauge("qmessenger_archive_blocks", "Compressed blocks in the message archive.");
+    static Gauge &messages = Metrics::instance().gauge("qmessenger_archive_messages", "Messages moved to the archive.");
+    static Gauge &rawBytes = Metrics::instance().gauge("qmessenger_archive_raw_bytes",
+                                                       "Size of the archived messages before compression.");
+    static Gauge &storedBytes = Metrics::instance().gauge("qmessenger_archive_stored_bytes",
+                                                          "Size of the archived messages as stored.");
+
+    ArchiveStats stats = store->archiveStats();
+    blocks.set(stats.blocks);
+    messages.set(stats.messages);
+    rawBytes.set(stats.rawBytes);
+    storedBytes.set(stats.storedBytes);
+}
+
+// One series per cache of every connection, as each lane has caches of its
+// own.
+void DatabaseManager::exportCacheMetrics()
+{
+    auto exportCache = [this](const char *cache, auto &lru) {
+        QString labels = QString("cache=\"%1\",connection=\"%2\"").arg(QLatin1String(cache), connectionName);
+        Metrics &metrics = Metrics::instance();
+        lru.exportTo(&metrics.counter("qmessenger_cache_hits_total", "Lookups answered by a lookup cache.", labels),
+                     &metrics.counter("qmessenger_cache_misses_total", "Lookups that went to the database.", labels),
+                     &metrics.gauge("qmessenger_cache_entries", "Entries held by a lookup cache.", labels));
+    };
+    exportCache("user_id", userIdCache);
+    exportCache("chat_id", chatIdCache);
+    exportCache("login", loginCache);
+}
+
+void DatabaseManager::applyStorageProfile(const StorageProfile &profile)
+{
+    // PRAGMA values cannot be bound, so only the documented keywords pass.
+    static const QStringList journalModes = { "DELETE", "TRUNCATE", "PERSIST", "MEMORY", "WAL", "OFF" };
+    static const QStringList synchronousLevels = { "OFF", "NORMAL", "FULL", "EXTRA" };
+    static const QStringList tempStores = { "DEFAULT", "FILE", "MEMORY" };
+
+    QStringList pragmas;
+    // The journal mode belongs to the file and a read-only connection
+    // cannot change it; readers follow whatever the writer set.
+    if (!readOnly && journalModes.contains(profile.journalMode.toUpper()))
+    {
+        pragmas << "PRAGMA journal_mode = " + profile.journalMode.toUpper();
+    }
+    if (synchronousLevels.contains(profile.synchronous.toUpper()))
+    {
+        pragmas << "PRAGMA synchronous = " + profile.synchronous.toUpper();
+    }
+    if (tempStores.contains(profile.tempStore.toUpper()))
+    {
+        pragmas << "PRAGMA temp_store = " + profile.tempStore.toUpper();
+    }
+    pragmas << QString("PRAGMA mmap_size = %1").arg(qMax<qint64>(0, profile.mmapSizeBytes));
+    // A negative cache_size is a size in KiB instead of a page count.
+    pragmas << QString("PRAGMA cache_size = -%1").arg(qMax<qint64>(0, profile.cacheSizeBytes / 1024));
+
+    QSqlQuery query(db);
+    for (const QString &pragma : std::as_const(pragmas))
+    {
+        if (!query.exec(pragma))
+        {
+            qDebug() << "Failed to apply" << pragma << ":" << query.lastError().text();
+        } else if (pragma.startsWith("PRAGMA journal_mode") && query.next()
+                   && query.value(0).toString().compare(profile.journalMode, Qt::CaseInsensitive) != 0) {
+            // In-memory databases, for one, silently keep their own mode.
+            qDebug() << "Journal mode" << profile.journalMode << "not available, using" << query.value(0).toString();
+        }
+    }
+}
+
+void DatabaseManager::loadNextMessageId()
+{
+    // Ids are handed out before the message is stored, so start above the
+    // store and above every id a chat summary has already seen.
+    qint64 lastId = store->lastMessageId();
+    QSqlQuery query(db);
+    if (query.exec("SELECT COALESCE(MAX(LastMessageId), 0) FROM Chats") && query.next())
+    {
+        lastId = qMax(lastId, query.value(0).toLongLong());
+    }
+    nextMessageId = lastId + 1;
+}
+
+bool DatabaseManager::flushPendingMessages()
+{
+    flushTimer.stop();
+    if (pendingMessages.isEmpty() && pendingDelivered.isEmpty())
+    {
+        return true;
+    }
+
+    static Histogram &latency = Metrics::dbOperation("flushPendingMessages");
+    MetricsTimer timer(latency);
+    TraceSpan span("flushPendingMessages", "db");
+
+    if (!db.transaction())
+    {
+        qDebug() << "Failed to begin message batch:" << db.lastError().text();
+        flushTimer.start(flushPolicy.maxDelayMs);
+        return false;
+    }
+
+    // Summaries and watermarks below point at the batch, so they are only
+    // committed once the store holds it.
+    if (!pendingMessages.isEmpty() && !store->append(pendingMessages))
+    {
+        qDebug() << "Failed to store message batch";
+        db.rollback();
+        flushTimer.start(flushPolicy.maxDelayMs);
+        return false;
+    }
+
+    // Conversation summaries: the newest message per chat and one unread
+    // increment per recipient, folded over the batch.
+    QHash<int, const StoredMessage*> newestByChat;
+    QHash<QPair<int, int>, int> unreadByMember;
+    for (const StoredMessage &pending : pendingMessages)
+    {
+        newestByChat.insert(pending.chatId, &pending);
+        ++unreadByMember[qMakePair(pending.chatId, pending.recipientId)];
+    }
+
+    PreparedStatement summary = prepared("UPDATE Chats SET LastMessageId = ?, LastSnippet = ?, LastTimestamp = ? WHERE Id = ?");
+    for (const StoredMessage *pending : std::as_const(newestByChat))
+    {
+        summary->bindValue(0, pending->id);
+        summary->bindValue(1, pending->message.left(snippetLength));
+        summary->bindValue(2, pending->timestamp);
+        summary->bindValue(3, pending->chatId);
+        if (!summary->exec())
+        {
+            qDebug() << "Failed to update chat summary" << pending->chatId << ":" << summary->lastError().text();
+        }
+    }
+
+    PreparedStatement unread = prepared("UPDATE ChatMembers SET UnreadCount = UnreadCount + ? WHERE ChatId = ? AND UserId = ?");
+    for (auto it = unreadByMember.constBegin(); it != unreadByMember.constEnd(); ++it)
+    {
+        unread->bindValue(0, it.value());
+        unread->bindValue(1, it.key().first);
+        unread->bindValue(2, it.key().second);
+        if (!unread->exec())
+        {
+            qDebug() << "Failed to update unread count of chat" << it.key().first << ":" << unread->lastError().text();
+        }
+    }
+
+    // The chats that gained delivered messages are exactly those with
+    // messages between the old and new user watermark; the user watermark
+    // moves last.
+    PreparedStatement deliveredUpTo = prepared("SELECT DeliveredUpTo FROM Users WHERE Id = ?");
+    PreparedStatement chatsDelivered = prepared("UPDATE ChatMembers SET LastDeliveredMessageId = MAX(LastDeliveredMessageId, ?) "
+                                                "WHERE ChatId = ? AND UserId = ?");
+    PreparedStatement delivered = prepared("UPDATE Users SET DeliveredUpTo = ? WHERE Id = ? AND DeliveredUpTo < ?");
+    for (auto it = pendingDelivered.constBegin(); it != pendingDelivered.constEnd(); ++it)
+    {
+        deliveredUpTo->bindValue(0, it.key());
+        if (!deliveredUpTo->exec() || !deliveredUpTo->next())
+        {
+            continue;
+        }
+        qint64 previous = deliveredUpTo->value(0).toLongLong();
+        deliveredUpTo->finish();
+        if (previous >= it.value())
+        {
+            continue;
+        }
+
+        const QHash<int, qint64> newest = store->newestPerChat(it.key(), previous, it.value());
+        for (auto chat = newest.constBegin(); chat != newest.constEnd(); ++chat)
+        {
+            chatsDelivered->bindValue(0, chat.value());
+            chatsDelivered->bindValue(1, chat.key());
+            chatsDelivered->bindValue(2, it.key());
+            if (!chatsDelivered->exec())
+            {
+                qDebug() << "Failed to advance delivery of chat" << chat.key() << ":" << chatsDelivered->lastError().text();
+            }
+        }
+
+        delivered->bindValue(0, it.value());
+        delivered->bindValue(1, it.key());
+        delivered->bindValue(2, it.value());
+        if (!delivered->exec())
+        {
+            qDebug() << "Failed to advance delivery of user" << it.key() << ":" << delivered->lastError().text();
+        }
+    }
+
+    if (!db.commit())
+    {
+        qDebug() << "Failed to commit message batch:" << db.lastError().text();
+        db.rollback();
+        flushTimer.start(flushPolicy.maxDelayMs);
+        return false;
+    }
+
+    if (committedWatermark && !pendingMessages.isEmpty())
+    {
+        committedWatermark->store(pendingMessages.last().id);
+    }
+    pendingMessages.clear();
+    pendingDelivered.clear();
+    return true;
+}
+
+PreparedStatement DatabaseManager::prepared(const char *sql)
+{
+    return statements.prepared(db, sql);
+}
+
+void DatabaseManager::scheduleFlush()
+{
+    if (pendingMessages.size() >= flushPolicy.maxBatchSize)
+    {
+        flushPendingMessages();
+    } else if (!flushTimer.isActive()) {
+        flushTimer.start(flushPolicy.maxDelayMs);
+    }
 }
 
 bool DatabaseManager::openDatabase() 
@@ -73,233 +416,724 @@ bool DatabaseManager::initializeDatabase()
         return false;
     }
 
+    return migrateSchema();
+}
+
+bool DatabaseManager::migrateSchema()
+{
+    // Schema changes after the original tables, applied once each in order
+    // and recorded in PRAGMA user_version. Append new steps; never edit one
+    // that has shipped.
+    const QList<QStringList> migrations = {
+        // 1: per-recipient delivery. Existing messages count as delivered,
+        // they were already shown through the login history.
+        {
+            "ALTER TABLE Messages ADD COLUMN RecipientId INTEGER",
+            "UPDATE Messages SET RecipientId = (SELECT CASE WHEN c.IdName1 = Messages.SenderId "
+            "THEN c.IdName2 ELSE c.IdName1 END FROM Chats c WHERE c.Id = Messages.ChatId)",
+            "CREATE INDEX IF NOT EXISTS idx_recipient_messages ON Messages (RecipientId, Id)",
+            "ALTER TABLE Users ADD COLUMN DeliveredUpTo INTEGER NOT NULL DEFAULT 0",
+            "UPDATE Users SET DeliveredUpTo = COALESCE((SELECT MAX(Id) FROM Messages), 0)"
+        },
+        // 2: read and delivery state as per-participant watermarks instead of
+        // a status on every message.
+        {
+            "CREATE TABLE ChatMembers ("
+            "ChatId INTEGER NOT NULL, "
+            "UserId INTEGER NOT NULL, "
+            "LastReadMessageId INTEGER NOT NULL DEFAULT 0, "
+            "LastDeliveredMessageId INTEGER NOT NULL DEFAULT 0, "
+            "PRIMARY KEY (ChatId, UserId), "
+            "FOREIGN KEY (ChatId) REFERENCES Chats(Id) ON DELETE CASCADE, "
+            "FOREIGN KEY (UserId) REFERENCES Users(Id) ON DELETE CASCADE) WITHOUT ROWID",
+            "CREATE INDEX idx_member_chats ON ChatMembers (UserId, ChatId)",
+            "INSERT INTO ChatMembers (ChatId, UserId) "
+            "SELECT Id, IdName1 FROM Chats UNION SELECT Id, IdName2 FROM Chats",
+            "UPDATE ChatMembers SET "
+            "LastReadMessageId = COALESCE((SELECT MAX(Id) FROM Messages m WHERE m.ChatId = ChatMembers.ChatId "
+            "AND m.SenderId <> ChatMembers.UserId AND m.Status = 'read'), 0), "
+            "LastDeliveredMessageId = COALESCE((SELECT MAX(Id) FROM Messages m WHERE m.ChatId = ChatMembers.ChatId "
+            "AND m.RecipientId = ChatMembers.UserId "
+            "AND m.Id <= (SELECT DeliveredUpTo FROM Users WHERE Id = ChatMembers.UserId)), 0)"
+        },
+        // 3: conversation list kept up to date on write, so listing a user's
+        // chats never touches Messages.
+        {
+            "ALTER TABLE Chats ADD COLUMN LastMessageId INTEGER NOT NULL DEFAULT 0",
+            "ALTER TABLE Chats ADD COLUMN LastSnippet TEXT NOT NULL DEFAULT ''",
+            "ALTER TABLE Chats ADD COLUMN LastTimestamp DATETIME",
+            "ALTER TABLE ChatMembers ADD COLUMN UnreadCount INTEGER NOT NULL DEFAULT 0",
+            QString("UPDATE Chats SET (LastMessageId, LastSnippet, LastTimestamp) = "
+                    "(SELECT Id, substr(Message, 1, %1), Timestamp FROM Messages WHERE ChatId = Chats.Id "
+                    "ORDER BY Timestamp DESC, Id DESC LIMIT 1) "
+                    "WHERE EXISTS (SELECT 1 FROM Messages WHERE ChatId = Chats.Id)").arg(snippetLength),
+            "UPDATE ChatMembers SET UnreadCount = (SELECT COUNT(*) FROM Messages m WHERE m.ChatId = ChatMembers.ChatId "
+            "AND m.SenderId <> ChatMembers.UserId AND m.Id > ChatMembers.LastReadMessageId)"
+        },
+        // 4: cold tier for old messages, compressed blocks of one chat each.
+        {
+            "CREATE TABLE MessageArchive ("
+            "Id INTEGER PRIMARY KEY, "
+            "ChatId INTEGER NOT NULL, "
+            "FirstId INTEGER NOT NULL, "
+            "LastId INTEGER NOT NULL, "
+            "MessageCount INTEGER NOT NULL, "
+            "RawBytes INTEGER NOT NULL, "
+            "StoredBytes INTEGER NOT NULL, "
+            "Block BLOB NOT NULL, "
+            "FOREIGN KEY (ChatId) REFERENCES Chats(Id) ON DELETE CASCADE)",
+            "CREATE UNIQUE INDEX idx_archive_blocks ON MessageArchive (ChatId, LastId)",
+            "CREATE INDEX idx_archive_last ON MessageArchive (LastId)"
+        },
+        // 5: messages of one chat by id, for the resume delta.
+        {
+            "CREATE INDEX idx_chat_ids ON Messages (ChatId, Id)"
+        }
+    };
+
+    QSqlQuery query(db);
+    if (!query.exec("PRAGMA user_version") || !query.next())
+    {
+        return false;
+    }
+    int version = query.value(0).toInt();
+
+    for (int step = version; step < migrations.size(); ++step)
+    {
+        db.transaction();
+        for (const QString &statement : migrations.at(step))
+        {
+            if (!query.exec(statement))
+            {
+                qDebug() << "Schema migration" << step + 1 << "failed:" << query.lastError().text();
+                db.rollback();
+                return false;
+            }
+        }
+        if (!query.exec(QString("PRAGMA user_version = %1").arg(step + 1)) || !db.commit())
+        {
+            db.rollback();
+            return false;
+        }
+    }
     return true;
 }
 
 bool DatabaseManager::userExists(const QString &login) 
 {
-    QSqlQuery query(db);
-    query.prepare("SELECT COUNT(*) FROM Users WHERE Login = :login");
-    query.bindValue(":login", login);
-    if (!query.exec() || !query.next()) 
+    PreparedStatement query = prepared("SELECT COUNT(*) FROM Users WHERE Login = ?");
+    query->bindValue(0, login);
+    if (!query->exec() || !query->next()) 
     {
         return false;
     }
-    return query.value(0).toInt() > 0;
+    return query->value(0).toInt() > 0;
 }
 
 bool DatabaseManager::addUser(const QString &login, const QString &password, const QString &salt) 
 {
-    QSqlQuery query(db);
-    query.prepare("INSERT INTO Users (Login, Password, Salt) VALUES (:login, :password, :salt)");
-    query.bindValue(":login", login);
-    query.bindValue(":password", password);
-    query.bindValue(":salt", salt);
-    return query.exec();
+    PreparedStatement query = prepared("INSERT INTO Users (Login, Password, Salt) VALUES (?, ?, ?)");
+    query->bindValue(0, login);
+    query->bindValue(1, password);
+    query->bindValue(2, salt);
+    if (!query->exec())
+    {
+        return false;
+    }
+
+    userIdCache.put(login, query->lastInsertId().toInt());
+    return true;
 }
 
-bool DatabaseManager::checkUserPassword(const QString &login, const QString &password) 
+UserCredentials DatabaseManager::getUserCredentials(const QString &login)
 {
-    QSqlQuery query(db);
-    query.prepare("SELECT Password, Salt FROM Users WHERE Login = :login");
-    query.bindValue(":login", login);
+    static Histogram &latency = Metrics::dbOperation("getUserCredentials");
+    MetricsTimer timer(latency);
+    TraceSpan span("getUserCredentials", "db");
+
+    UserCredentials credentials;
+
+    PreparedStatement query = prepared("SELECT Id, Password, Salt FROM Users WHERE Login = ?");
+    query->bindValue(0, login);
 
-    if (!query.exec() || !query.next()) 
+    if (!query->exec() || !query->next())
     {
-        return false;
+        return credentials;
     }
 
-    QString dbHash = query.value(0).toString();
-    QString dbSalt = query.value(1).toString();
-    QByteArray saltedPassword = password.toUtf8() + dbSalt.toUtf8();
-    QByteArray hash = QCryptographicHash::hash(saltedPassword, QCryptographicHash::Sha256);
+    credentials.id = query->value(0).toInt();
+    credentials.passwordHash = query->value(1).toString();
+    credentials.salt = query->value(2).toString();
 
-    return (dbHash == hash.toHex());
+    // Everything this user does next resolves their id; warm it up now.
+    userIdCache.put(login, credentials.id);
+    return credentials;
 }
 
-QJsonArray DatabaseManager::getMessages(const QString &login, const QMap<QWebSocket*, QString> &clients)
+bool DatabaseManager::updatePasswordHash(const QString &login, const QString &passwordHash, const QString &salt)
 {
+    static Histogram &latency = Metrics::dbOperation("updatePasswordHash");
+    MetricsTimer timer(latency);
+    TraceSpan span("updatePasswordHash", "db");
+
+    PreparedStatement query = prepared("UPDATE Users SET Password = ?, Salt = ? WHERE Login = ?");
+    query->bindValue(0, passwordHash);
+    query->bindValue(1, salt);
+    query->bindValue(2, login);
+
+    if (!query->exec())
+    {
+        qDebug() << "Failed to update password hash:" << query->lastError().text();
+        return false;
+    }
+    return true;
+}
+
+QJsonArray DatabaseManager::getMessagesSince(const QString &login, qint64 afterId, int limit, bool *truncated)
+{
+    static Histogram &latency = Metrics::dbOperation("getMessagesSince");
+    MetricsTimer timer(latency);
+    TraceSpan span("getMessagesSince", "db");
+
     QJsonArray chatsArray;
+    *truncated = false;
 
-    int userId = -1;
-    QSqlQuery query(db);
-    query.prepare("SELECT Id FROM Users WHERE Login = :login");
-    query.bindValue(":login", login);
-    if (query.exec() && query.next()) 
+    int userId = getUserId(login);
+    if (userId < 0)
     {
-        userId = query.value(0).toInt();
-    } else {
         return chatsArray;
     }
 
-    query.prepare("SELECT Id, CASE WHEN IdName1 = :userId THEN IdName2 ELSE IdName1 END AS OtherUserId "
-                  "FROM Chats WHERE IdName1 = :userId OR IdName2 = :userId");
-    query.bindValue(":userId", userId);
-    if (!query.exec()) 
+    // Every chat of the user, so the client can rebuild its contact list,
+    // with only the messages stored after afterId. One message past the
+    // limit tells whether the reply is complete.
+    const QVector<UserChat> chats = getUserChats(userId);
+    QVector<int> chatIds;
+    chatIds.reserve(chats.size());
+    for (const UserChat &chat : chats)
     {
-        return chatsArray;
+        chatIds.append(chat.chatId);
     }
 
-    while (query.next()) 
+    // Queued messages have higher ids than anything stored, so they follow
+    // the stored ones.
+    QVector<StoredMessage> messages = store->readChatsAfter(chatIds, afterId, limit + 1);
+    if (messages.size() <= limit && !pendingMessages.isEmpty())
     {
-        int chatId = query.value("Id").toInt();
-        int otherUserId = query.value("OtherUserId").toInt();
+        const QSet<int> wanted(chatIds.cbegin(), chatIds.cend());
+        for (const StoredMessage &pending : std::as_const(pendingMessages))
+        {
+            if (messages.size() > limit)
+            {
+                break;
+            }
+            if (pending.id > afterId && wanted.contains(pending.chatId))
+            {
+                messages.append(pending);
+            }
+        }
+    }
+    if (messages.size() > limit)
+    {
+        *truncated = true;
+        messages.resize(limit);
+    }
+
+    QHash<int, QJsonArray> messagesByChat;
+    QHash<int, const UserChat*> chatById;
+    for (const UserChat &chat : chats)
+    {
+        chatById.insert(chat.chatId, &chat);
+    }
+    for (const StoredMessage &message : std::as_const(messages))
+    {
+        const UserChat *chat = chatById.value(message.chatId);
+        bool ownMessage = message.senderId == userId;
+        qint64 readUpTo = ownMessage ? chat->readByPartner : chat->readByUser;
+        messagesByChat[message.chatId].append(messageJson(message, ownMessage ? login : chat->partner,
+                                                          message.id <= readUpTo));
+    }
+
+    for (const UserChat &chat : chats)
+    {
+        QJsonObject chatObj;
+        chatObj["otherUser"] = chat.partner;
+        chatObj["messages"] = messagesByChat.value(chat.chatId);
+        chatsArray.append(chatObj);
+    }
+
+    return chatsArray;
+}
+
+QJsonArray DatabaseManager::getConversations(const QString &login)
+{
+    static Histogram &latency = Metrics::dbOperation("getConversations");
+    MetricsTimer timer(latency);
+    TraceSpan span("getConversations", "db");
 
-        QSqlQuery userQuery(db);
-        userQuery.prepare("SELECT Login FROM Users WHERE Id = :id");
-        userQuery.bindValue(":id", otherUserId);
-        QString otherUserName;
-        if (userQuery.exec() && userQuery.next()) 
+    QJsonArray conversations;
+
+    int userId = getUserId(login);
+    if (userId < 0)
+    {
+        return conversations;
+    }
+
+    // The summary and unread count of queued messages are only written
+    // when their batch is, so they are laid over the stored rows here.
+    QHash<int, const StoredMessage*> newestPending;
+    QHash<int, int> unreadPending;
+    for (const StoredMessage &pending : std::as_const(pendingMessages))
+    {
+        if (pending.senderId == userId || pending.recipientId == userId)
         {
-            otherUserName = userQuery.value(0).toString();
-        } else {
-            continue;
+            newestPending.insert(pending.chatId, &pending);
+            if (pending.recipientId == userId)
+            {
+                ++unreadPending[pending.chatId];
+            }
+        }
+    }
+
+    // One row per chat straight from the materialized summary.
+    PreparedStatement query = prepared("SELECT u.Login, c.LastMessageId, c.LastSnippet, c.LastTimestamp, me.UnreadCount, c.Id "
+                                       "FROM ChatMembers me "
+                                       "JOIN Chats c ON c.Id = me.ChatId "
+                                       "JOIN ChatMembers other ON other.ChatId = me.ChatId AND other.UserId <> me.UserId "
+                                       "JOIN Users u ON u.Id = other.UserId "
+                                       "WHERE me.UserId = ? "
+                                       "ORDER BY c.LastMessageId DESC");
+    query->bindValue(0, userId);
+    if (!query->exec())
+    {
+        qDebug() << "Failed to load conversations:" << query->lastError().text();
+        return conversations;
+    }
+
+    QVector<QJsonObject> rows;
+    bool reorder = false;
+    while (query->next())
+    {
+        QJsonObject conversation;
+        conversation["login"] = query->value(0).toString();
+        conversation["msg_id"] = query->value(1).toLongLong();
+        conversation["message"] = query->value(2).toString();
+        conversation["timestamp"] = query->value(3).toString();
+        conversation["unread"] = query->value(4).toInt();
+
+        int chatId = query->value(5).toInt();
+        if (const StoredMessage *pending = newestPending.value(chatId))
+        {
+            conversation["msg_id"] = pending->id;
+            conversation["message"] = pending->message.left(snippetLength);
+            conversation["timestamp"] = pending->timestamp;
+            conversation["unread"] = query->value(4).toInt() + unreadPending.value(chatId);
+            reorder = true;
         }
+        rows.append(conversation);
+    }
+
+    if (reorder)
+    {
+        std::stable_sort(rows.begin(), rows.end(), [](const QJsonObject &a, const QJsonObject &b) {
+            return a["msg_id"].toVariant().toLongLong() > b["msg_id"].toVariant().toLongLong();
+        });
+    }
+    for (const QJsonObject &conversation : std::as_const(rows))
+    {
+        conversations.append(conversation);
+    }
+    return conversations;
+}
+
+QJsonArray DatabaseManager::getHistory(const QString &login, const QString &partner, qint64 beforeId, int limit)
+{
+    static Histogram &latency = Metrics::dbOperation("getHistory");
+    MetricsTimer timer(latency);
+    TraceSpan span("getHistory", "db");
+
+    QJsonArray messagesArray;
+
+    int userId = getUserId(login);
+    int partnerId = getUserId(partner);
+    if (userId < 0 || partnerId < 0)
+    {
+        return messagesArray;
+    }
 
-        QSqlQuery messagesQuery(db);
-        messagesQuery.prepare("SELECT SenderId, Message, Timestamp FROM Messages WHERE ChatId = :chatId ORDER BY Timestamp ASC");
-        messagesQuery.bindValue(":chatId", chatId);
+    int chatId = findChatId(userId, partnerId);
+    if (chatId < 0)
+    {
+        return messagesArray;
+    }
 
-        QJsonArray messagesArray;
-        if (messagesQuery.exec()) 
+    qint64 readByUser = 0;
+    qint64 readByPartner = 0;
+    {
+        PreparedStatement members = prepared("SELECT UserId, LastReadMessageId FROM ChatMembers WHERE ChatId = ?");
+        members->bindValue(0, chatId);
+        if (members->exec())
         {
-            while (messagesQuery.next()) 
+            while (members->next())
             {
-                QJsonObject messageObj;
-                int senderId = messagesQuery.value("SenderId").toInt();
-                messageObj["sender"] = (senderId == userId) ? login : otherUserName;
-                messageObj["message"] = messagesQuery.value("Message").toString();
-                messageObj["timestamp"] = messagesQuery.value("Timestamp").toString();
-                messageObj["is_read"] = messagesQuery.value("IsRead").toInt();
-                messagesArray.append(messageObj);
+                (members->value(0).toInt() == userId ? readByUser : readByPartner) = members->value(1).toLongLong();
             }
-        } else {
-            continue;
         }
+    }
 
-        QJsonObject chatObj;
-        chatObj["otherUser"] = otherUserName;
-        chatObj["messages"] = messagesArray;
-        if (clients.key(otherUserName, nullptr))
+    // Queued messages of the chat are newer than every stored one: the page
+    // is the newest limit of both.
+    QVector<StoredMessage> page = store->readChat(chatId, beforeId, limit);
+    for (const StoredMessage &pending : std::as_const(pendingMessages))
+    {
+        if (pending.chatId == chatId && (beforeId <= 0 || pending.id < beforeId))
         {
-            chatObj["online"] = "TRUE";
-        } else {
-            chatObj["online"] = "FALSE";
+            page.append(pending);
         }
-        chatsArray.append(chatObj);
+    }
+    if (limit >= 0 && page.size() > limit)
+    {
+        page.remove(0, page.size() - limit);
+    }
+    for (const StoredMessage &message : std::as_const(page))
+    {
+        bool ownMessage = message.senderId == userId;
+        messagesArray.append(messageJson(message, ownMessage ? login : partner,
+                                         message.id <= (ownMessage ? readByPartner : readByUser)));
     }
 
-    return chatsArray;
+    return messagesArray;
 }
 
-void DatabaseManager::addMessage(const QString &from, const QString &to, const QString &message)
+int DatabaseManager::getUserId(const QString &login)
 {
-    if (from.isEmpty() || to.isEmpty() || message.isEmpty()) 
+    int userId = -1;
+    if (userIdCache.get(login, &userId))
     {
-        return;
+        return userId;
     }
 
-    QSqlQuery query(db);
+    PreparedStatement query = prepared("SELECT Id FROM Users WHERE Login = ?");
+    query->bindValue(0, login);
+    if (!query->exec() || !query->next())
+    {
+        return -1;
+    }
+
+    userId = query->value(0).toInt();
+    userIdCache.put(login, userId);
+    return userId;
+}
 
-    int fromId = -1, toId = -1;
-    query.prepare("SELECT Id FROM Users WHERE Login = :login");
-    query.bindValue(":login", from);
-    if (query.exec() && query.next()) 
+QString DatabaseManager::getLogin(int userId)
+{
+    QString login;
+    if (loginCache.get(userId, &login))
     {
-        fromId = query.value(0).toInt();
-    } else {
-        return;
+        return login;
     }
 
-    query.bindValue(":login", to);
-    if (query.exec() && query.next()) 
+    PreparedStatement query = prepared("SELECT Login FROM Users WHERE Id = ?");
+    query->bindValue(0, userId);
+    if (!query->exec() || !query->next())
     {
-        toId = query.value(0).toInt();
-    } else {
-        return;
+        return QString();
+    }
+
+    login = query->value(0).toString();
+    loginCache.put(userId, login);
+    return login;
+}
+
+QVector<DatabaseManager::UserChat> DatabaseManager::getUserChats(int userId)
+{
+    QVector<UserChat> chats;
+
+    PreparedStatement query = prepared("SELECT c.Id, u.Login, me.LastReadMessageId, other.LastReadMessageId "
+                                       "FROM ChatMembers me "
+                                       "JOIN Chats c ON c.Id = me.ChatId "
+                                       "JOIN ChatMembers other ON other.ChatId = me.ChatId AND other.UserId <> me.UserId "
+                                       "JOIN Users u ON u.Id = other.UserId "
+                                       "WHERE me.UserId = ? "
+                                       "ORDER BY c.Id");
+    query->bindValue(0, userId);
+    if (!query->exec())
+    {
+        qDebug() << "Failed to load chats of user" << userId << ":" << query->lastError().text();
+        return chats;
+    }
+
+    while (query->next())
+    {
+        UserChat chat;
+        chat.chatId = query->value(0).toInt();
+        chat.partner = query->value(1).toString();
+        chat.readByUser = query->value(2).toLongLong();
+        chat.readByPartner = query->value(3).toLongLong();
+        chats.append(chat);
     }
+    return chats;
+}
 
+int DatabaseManager::findChatId(int userId1, int userId2)
+{
+    quint64 key = chatCacheKey(userId1, userId2);
     int chatId = -1;
-    query.prepare("SELECT Id FROM Chats WHERE (IdName1 = :fromId AND IdName2 = :toId) "
-                  "OR (IdName1 = :toId AND IdName2 = :fromId)");
-    query.bindValue(":fromId", fromId);
-    query.bindValue(":toId", toId);
-
-    if (query.exec() && query.next()) 
-    {
-        chatId = query.value(0).toInt();
-    } else {
-        query.prepare("INSERT INTO Chats (IdName1, IdName2) VALUES (:fromId, :toId)");
-        query.bindValue(":fromId", qMin(fromId, toId));
-        query.bindValue(":toId", qMax(fromId, toId));
-        if (query.exec()) {
-            chatId = query.lastInsertId().toInt();
-        } else {
-            return;
+    if (chatIdCache.get(key, &chatId))
+    {
+        return chatId;
+    }
+
+    // Chats are stored with IdName1 < IdName2, so this is a single unique
+    // index probe.
+    PreparedStatement query = prepared("SELECT Id FROM Chats WHERE IdName1 = ? AND IdName2 = ?");
+    query->bindValue(0, qMin(userId1, userId2));
+    query->bindValue(1, qMax(userId1, userId2));
+    if (!query->exec() || !query->next())
+    {
+        return -1;
+    }
+
+    chatId = query->value(0).toInt();
+    chatIdCache.put(key, chatId);
+    return chatId;
+}
+
+int DatabaseManager::findOrCreateChatId(int userId1, int userId2)
+{
+    int chatId = findChatId(userId1, userId2);
+    if (chatId >= 0)
+    {
+        return chatId;
+    }
+
+    PreparedStatement query = prepared("INSERT INTO Chats (IdName1, IdName2) VALUES (?, ?)");
+    query->bindValue(0, qMin(userId1, userId2));
+    query->bindValue(1, qMax(userId1, userId2));
+    if (!query->exec())
+    {
+        // Lost a race with another insert of the same pair.
+        return findChatId(userId1, userId2);
+    }
+
+    chatId = query->lastInsertId().toInt();
+    chatIdCache.put(chatCacheKey(userId1, userId2), chatId);
+
+    PreparedStatement members = prepared("INSERT OR IGNORE INTO ChatMembers (ChatId, UserId) VALUES (?, ?), (?, ?)");
+    members->bindValue(0, chatId);
+    members->bindValue(1, userId1);
+    members->bindValue(2, chatId);
+    members->bindValue(3, userId2);
+    if (!members->exec())
+    {
+        qDebug() << "Failed to add chat members:" << members->lastError().text();
+    }
+    return chatId;
+}
+
+quint64 DatabaseManager::chatCacheKey(int userId1, int userId2)
+{
+    return (quint64(quint32(qMin(userId1, userId2))) << 32) | quint32(qMax(userId1, userId2));
+}
+
+qint64 DatabaseManager::addMessage(const QString &from, const QString &to, const QString &message)
+{
+    static Histogram &latency = Metrics::dbOperation("addMessage");
+    MetricsTimer timer(latency);
+    TraceSpan span("addMessage", "db");
+
+    if (from.isEmpty() || to.isEmpty() || message.isEmpty()) 
+    {
+        return 0;
+    }
+
+    int fromId = getUserId(from);
+    int toId = getUserId(to);
+    if (fromId < 0 || toId < 0)
+    {
+        return 0;
+    }
+
+    int chatId = findOrCreateChatId(fromId, toId);
+    if (chatId < 0)
+    {
+        return 0;
+    }
+
+    StoredMessage pending;
+    pending.id = nextMessageId++;
+    pending.chatId = chatId;
+    pending.senderId = fromId;
+    pending.recipientId = toId;
+    pending.message = message;
+    pending.timestamp = QDateTime::currentDateTimeUtc().toString("yyyy-MM-dd HH:mm:ss");
+    pendingMessages.append(pending);
+
+    scheduleFlush();
+    return pending.id;
+}
+
+QJsonArray DatabaseManager::getPendingMessages(const QString &login)
+{
+    static Histogram &latency = Metrics::dbOperation("getPendingMessages");
+    MetricsTimer timer(latency);
+    TraceSpan span("getPendingMessages", "db");
+
+    QJsonArray messagesArray;
+
+    int userId = getUserId(login);
+    if (userId < 0)
+    {
+        return messagesArray;
+    }
+
+    qint64 deliveredUpTo = 0;
+    {
+        PreparedStatement query = prepared("SELECT DeliveredUpTo FROM Users WHERE Id = ?");
+        query->bindValue(0, userId);
+        if (!query->exec() || !query->next())
+        {
+            qDebug() << "Failed to load pending messages:" << query->lastError().text();
+            return messagesArray;
         }
+        deliveredUpTo = qMax(query->value(0).toLongLong(), pendingDelivered.value(userId));
     }
 
-    query.prepare("INSERT INTO Messages (ChatId, SenderId, Message, Status) "
-                  "VALUES (:chatId, :senderId, :message, 'sent')");
-    query.bindValue(":chatId", chatId);
-    query.bindValue(":senderId", fromId);
-    query.bindValue(":message", message);
+    // Everything addressed to the user above their delivered watermark,
+    // stored or still queued.
+    QVector<StoredMessage> messages = store->readForRecipient(userId, deliveredUpTo);
+    for (const StoredMessage &pending : std::as_const(pendingMessages))
+    {
+        if (pending.recipientId == userId && pending.id > deliveredUpTo)
+        {
+            messages.append(pending);
+        }
+    }
+    for (const StoredMessage &message : std::as_const(messages))
+    {
+        QJsonObject messageObj;
+        messageObj["id"] = message.id;
+        messageObj["sender"] = getLogin(message.senderId);
+        messageObj["message"] = message.message;
+        messageObj["timestamp"] = message.timestamp;
+        messagesArray.append(messageObj);
+    }
+    return messagesArray;
+}
 
-    if (!query.exec()) 
+void DatabaseManager::markDelivered(const QString &login, qint64 msgId)
+{
+    static Histogram &latency = Metrics::dbOperation("markDelivered");
+    MetricsTimer timer(latency);
+    TraceSpan span("markDelivered", "db");
+
+    int userId = getUserId(login);
+    if (userId < 0 || msgId <= 0)
     {
         return;
     }
+
+    // Written with the next message batch rather than one UPDATE per ack.
+    qint64 &watermark = pendingDelivered[userId];
+    watermark = qMax(watermark, msgId);
+    scheduleFlush();
 }
 
-void DatabaseManager::markMessagesAsRead(const QString &from, const QString &to, const QString &msgId)
+void DatabaseManager::markMessagesAsRead(const QString &from, const QString &to, qint64 upToId)
 {
-    QSqlQuery query(db);
+    static Histogram &latency = Metrics::dbOperation("markMessagesAsRead");
+    MetricsTimer timer(latency);
+    TraceSpan span("markMessagesAsRead", "db");
+
+    int fromId = getUserId(from);
+    int toId = getUserId(to);
+    if (fromId < 0 || toId < 0)
+    {
+        return;
+    }
+
+    int chatId = findChatId(fromId, toId);
+    if (chatId < 0)
+    {
+        return;
+    }
 
-    if(msgId.isEmpty())
+    // Reading a chat only moves the reader's watermark: one row, however
+    // many messages were unread. The batch adds to the unread count of the
+    // messages it holds, so only a chat with queued messages commits it
+    // first.
+    for (const StoredMessage &pending : std::as_const(pendingMessages))
+    {
+        if (pending.chatId == chatId)
+        {
+            flushPendingMessages();
+            break;
+        }
+    }
+    if (upToId > 0)
     {
-        query.prepare("UPDATE Messages SET IsRead = 1 WHERE ChatId IN "
-                      "(SELECT Id FROM Chats WHERE (IdName1 = (SELECT Id FROM Users WHERE Login = :from) "
-                      "AND IdName2 = (SELECT Id FROM Users WHERE Login = :to)) "
-                      "OR (IdName1 = (SELECT Id FROM Users WHERE Login = :to) "
-                      "AND IdName2 = (SELECT Id FROM Users WHERE Login = :from))) "
-                      "AND SenderId = (SELECT Id FROM Users WHERE Login = :to) "
-                      "AND IsRead = 0");
-        query.bindValue(":from", from);
-        query.bindValue(":to", to);
-    } else {
-        query.prepare("UPDATE Messages SET Status = 'read' WHERE Id = :msgId");
-        query.bindValue(":msgId", msgId);
+        qint64 lastRead = 0;
+        {
+            PreparedStatement current = prepared("SELECT LastReadMessageId FROM ChatMembers WHERE ChatId = ? AND UserId = ?");
+            current->bindValue(0, chatId);
+            current->bindValue(1, fromId);
+            if (!current->exec() || !current->next())
+            {
+                return;
+            }
+            lastRead = qMax(current->value(0).toLongLong(), upToId);
+        }
+
+        // Only the messages past the new watermark are left to count.
+        PreparedStatement query = prepared("UPDATE ChatMembers SET LastReadMessageId = ?, UnreadCount = ? "
+                                           "WHERE ChatId = ? AND UserId = ?");
+        query->bindValue(0, lastRead);
+        query->bindValue(1, store->countUnread(chatId, fromId, lastRead));
+        query->bindValue(2, chatId);
+        query->bindValue(3, fromId);
+        if (!query->exec())
+        {
+            qDebug() << "Failed to mark messages as read:" << query->lastError().text();
+        }
+        return;
     }
 
+    PreparedStatement query = prepared("UPDATE ChatMembers SET LastReadMessageId = "
+                                       "MAX(LastReadMessageId, (SELECT LastMessageId FROM Chats WHERE Id = ?)), "
+                                       "UnreadCount = 0 "
+                                       "WHERE ChatId = ? AND UserId = ?");
+    query->bindValue(0, chatId);
+    query->bindValue(1, chatId);
+    query->bindValue(2, fromId);
+    if (!query->exec())
+    {
+        qDebug() << "Failed to mark messages as read:" << query->lastError().text();
+    }
 }
 
-QJsonArray DatabaseManager::getUsersByName(const QMap<QWebSocket*, QString> &clients, const QString &login, const QString &letters)
+QJsonArray DatabaseManager::getUsersByName(const QString &login, const QString &letters)
 {
+    static Histogram &latency = Metrics::dbOperation("getUsersByName");
+    MetricsTimer timer(latency);
+    TraceSpan span("getUsersByName", "db");
+
     QJsonArray users;
 
-    QSqlQuery query(db);
-    query.prepare("SELECT Login FROM Users WHERE Login LIKE :letters");
-    query.bindValue(":letters", letters + "%");
+    PreparedStatement query = prepared("SELECT Login FROM Users WHERE Login LIKE ?");
+    query->bindValue(0, letters + "%");
 
-    if (!query.exec()) 
+    if (!query->exec()) 
     {
         return users;
     }
 
-    while(query.next())
+    while(query->next())
     {
-        QString currentLogin = query.value("Login").toString();
+        QString currentLogin = query->value(0).toString();
         if (currentLogin != login)
         {
             QJsonObject user;
-            QString currentLogin = query.value("Login").toString();
             user["login"] = currentLogin;
-            if (clients.key(currentLogin, nullptr))
-            {
-                user["online"] = "TRUE";
-            } else {
-                user["online"] = "FALSE";
-            }
             users.append(user);
         }
     }
@@ -307,67 +1141,61 @@ QJsonArray DatabaseManager::getUsersByName(const QMap<QWebSocket*, QString> &cli
     return users;
 }
 
-bool DatabaseManager::executeQuery(const QString &queryString, const QMap<QString, QVariant> &params, QSqlQuery *query)
+QStringList DatabaseManager::getAllLogins()
 {
-    if (!query) 
-    {
-        qDebug() << "Query pointer is null";
-        return false;
-    }
-    query->prepare(queryString);
+    static Histogram &latency = Metrics::dbOperation("getAllLogins");
+    MetricsTimer timer(latency);
+    TraceSpan span("getAllLogins", "db");
 
+    QStringList logins;
 
-    for (auto it = params.constBegin(); it != params.constEnd(); ++it) 
+    QSqlQuery query(db);
+    query.setForwardOnly(true);
+    if (!query.exec("SELECT Login FROM Users"))
     {
-        QString placeholder = ":" + it.key();
-        query->bindValue(placeholder, it.value());
+        return logins;
     }
 
-    if (!query->exec()) 
+    while (query.next())
     {
-        return false;
+        logins.append(query.value(0).toString());
     }
-    return true;
+    return logins;
 }
 
-QString DatabaseManager::generateSalt()
+bool DatabaseManager::registrateNewClients(const QString &login, const QString &passwordHash, const QString &salt)
 {
-    QByteArray salt = QByteArray::number(QRandomGenerator::global()->generate64(), 16);
-    return QString(salt);
-}
+    static Histogram &latency = Metrics::dbOperation("registrateNewClients");
+    MetricsTimer timer(latency);
+    TraceSpan span("registrateNewClients", "db");
 
-QString DatabaseManager::hashPassword(const QString &password, const QString &salt)
-{
-    QByteArray saltedPassword = password.toUtf8() + salt.toUtf8();
-    QByteArray hash = QCryptographicHash::hash(saltedPassword, QCryptographicHash::Sha256);
-    return QString(hash.toHex());
-}
-
-bool DatabaseManager::registrateNewClients(const QString &login, const QString &password)
-{
 
-    if (login.isEmpty() || password.isEmpty()) 
+    if (login.isEmpty() || passwordHash.isEmpty()) 
     {
         return false;
     }
 
     db.transaction();
 
-    QString salt = generateSalt();
-    QString hash = hashPassword(password, salt);
-    QSqlQuery query(db);
-    QString insertQuery = "INSERT INTO Users (Login, Password, Salt) VALUES (:login, :password, :salt)";
-    QMap<QString, QVariant> params = { {"login", login}, {"password", hash}, {"salt", salt} };
-
-    if (!executeQuery(insertQuery, params, &query)) 
+    int userId;
     {
-        db.rollback();
-        return false;
+        PreparedStatement query = prepared("INSERT INTO Users (Login, Password, Salt) VALUES (?, ?, ?)");
+        query->bindValue(0, login);
+        query->bindValue(1, passwordHash);
+        query->bindValue(2, salt);
+        if (!query->exec()) 
+        {
+            db.rollback();
+            return false;
+        }
+        userId = query->lastInsertId().toInt();
     }
 
     if (!db.commit()) 
     {
         return false;
     }
+
+    userIdCache.put(login, userId);
     return true;
 }
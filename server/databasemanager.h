@@ -12,31 +12,135 @@
 #include <QCryptographicHash>
 #include <QRandomGenerator>
 #include <QWebSocket>
+#include <QVector>
+#include <QTimer>
+#include <QDateTime>
+#include "lrucache.h"
+#include "messagestore.h"
+#include "metrics.h"
+#include "statementcache.h"
+#include "tracer.h"
+#include <atomic>
+#include <memory>
+
+// When queued chat messages are committed: after maxDelayMs since the first
+// pending message, or as soon as maxBatchSize messages are waiting. Reads on
+// the writer merge the queue into their results rather than committing it
+// early.
+struct FlushPolicy
+{
+    int maxBatchSize = 256;
+    int maxDelayMs = 5;
+};
+
+// SQLite settings applied to every connection as it is opened. The
+// defaults trade a little durability for throughput: in WAL mode with
+// synchronous=NORMAL a power loss can drop the last commits, but the file
+// never corrupts, and readers no longer wait for the writer.
+struct StorageProfile
+{
+    QString journalMode = "WAL";
+    QString synchronous = "NORMAL";
+    qint64 mmapSizeBytes = 256LL * 1024 * 1024;
+    qint64 cacheSizeBytes = 64LL * 1024 * 1024;
+    QString tempStore = "MEMORY";
+    int busyTimeoutMs = 5000;
+};
+
+// Stored password hash of a user; id is -1 when the login does not exist.
+struct UserCredentials
+{
+    int id = -1;
+    QString passwordHash;
+    QString salt;
+};
 
 class DatabaseManager {
 public:
-    DatabaseManager();
+    // Path that selects a private in-memory database, seen by this
+    // connection only. DbExecutor backs it with a temporary file instead,
+    // so all of its lanes share it.
+    static const QString inMemoryDatabase;
+
+    // An empty databasePath opens ./messanger_users.db. A read-only
+    // manager neither creates nor migrates the schema, so it must be opened
+    // after a writable one has. Messages go to messageStore, which must
+    // outlive the manager, or to the Messages table when it is null.
+    explicit DatabaseManager(const QString &connectionName = QString(), const QString &databasePath = QString(),
+                             const StorageProfile &profile = StorageProfile(), bool readOnly = false,
+                             MessageStore *messageStore = nullptr);
     ~DatabaseManager();
 
+    void setFlushPolicy(const FlushPolicy &policy);
+    // Receives the highest message id known to be committed: every message
+    // at or below it is visible to other connections.
+    void setCommittedWatermark(std::atomic<qint64> *watermark);
+    bool flushPendingMessages();
+    // Archives on a timer while the policy is on; writable managers only.
+    void setArchivePolicy(const ArchivePolicy &policy);
+    int archiveMessages();
+
     bool openDatabase();
-    void closeDatabase();
 
     bool initializeDatabase();
     bool userExists(const QString& login);
     bool addUser(const QString& login, const QString& password, const QString& salt);
-    bool checkUserPassword(const QString& login, const QString& password);
-    QJsonArray getMessages(const QString& login, const QMap<QWebSocket*, QString>& clients);
-    void addMessage(const QString& from, const QString& to, const QString& message);
-    void markMessagesAsRead(const QString &from, const QString &to, const QString& msgId = nullptr);
-    QJsonArray getUsersByName(const QMap<QWebSocket*, QString> &clients, const QString &login, const QString &letters);
-    bool executeQuery(const QString &queryString, const QMap<QString, QVariant> &params, QSqlQuery *query);
-    QString generateSalt();
-    QString hashPassword(const QString &password, const QString &salt);
-    bool registrateNewClients(const QString &login, const QString &password);
-
+    UserCredentials getUserCredentials(const QString &login);
+    bool updatePasswordHash(const QString &login, const QString &passwordHash, const QString &salt);
+    QJsonArray getConversations(const QString &login);
+    QJsonArray getMessagesSince(const QString &login, qint64 afterId, int limit, bool *truncated);
+    QJsonArray getHistory(const QString& login, const QString& partner, qint64 beforeId, int limit);
+    qint64 addMessage(const QString& from, const QString& to, const QString& message);
+    QJsonArray getPendingMessages(const QString &login);
+    void markDelivered(const QString &login, qint64 msgId);
+    void markMessagesAsRead(const QString &from, const QString &to, qint64 upToId = 0);
+    QJsonArray getUsersByName(const QString &login, const QString &letters);
+    QStringList getAllLogins();
+    bool registrateNewClients(const QString &login, const QString &passwordHash, const QString &salt);
 
 private:
+    // A chat as seen by one of its members.
+    struct UserChat
+    {
+        int chatId;
+        QString partner;
+        qint64 readByUser;
+        qint64 readByPartner;
+    };
+
+    QString connectionName;
     QSqlDatabase db;
+    bool readOnly = false;
+    std::atomic<qint64> *committedWatermark = nullptr;
+    std::unique_ptr<MessageStore> ownedStore;
+    MessageStore *store = nullptr;
+    FlushPolicy flushPolicy;
+    QVector<StoredMessage> pendingMessages;
+    // Delivered watermarks acknowledged since the last flush, by user id.
+    QHash<int, qint64> pendingDelivered;
+    QTimer flushTimer;
+    ArchivePolicy archivePolicy;
+    QTimer archiveTimer;
+    qint64 nextMessageId = 1;
+    LruCache<QString, int> userIdCache { 65536 };
+    LruCache<quint64, int> chatIdCache { 65536 };
+    LruCache<int, QString> loginCache { 65536 };
+    StatementCache statements;
+
+    void applyStorageProfile(const StorageProfile &profile);
+    bool migrateSchema();
+    void loadNextMessageId();
+    void scheduleFlush();
+    void publishArchiveStats();
+    void exportCacheMetrics();
+    PreparedStatement prepared(const char *sql);
+
+    int getUserId(const QString &login);
+    QString getLogin(int userId);
+    QVector<UserChat> getUserChats(int userId);
+    int findChatId(int userId1, int userId2);
+    int findOrCreateChatId(int userId1, int userId2);
+    static quint64 chatCacheKey(int userId1, int userId2);
 };
 
 #endif // DATABASEMANAGER_H
@@ -0,0 +1,128 @@
+#include "dbexecutor.h"
+#include "logmessagestore.h"
+
+DbExecutor::DbExecutor(int readerCount, const FlushPolicy &flushPolicy, const QString &requestedPath,
+                       const StorageProfile &storageProfile, const MessageStoreConfig &messageStoreConfig)
+{
+    QString databasePath = requestedPath;
+    if (databasePath == DatabaseManager::inMemoryDatabase)
+    {
+        scratchDirectory.reset(new QTemporaryDir);
+        if (scratchDirectory->isValid())
+        {
+            databasePath = scratchDirectory->filePath("messanger-memory.db");
+        } else {
+            qWarning() << "No temporary directory for the in-memory database, using a private one per lane:"
+                       << scratchDirectory->errorString();
+        }
+    }
+
+    if (messageStoreConfig.backend == MessageStoreConfig::Backend::Log)
+    {
+        messageStore.reset(new LogMessageStore(messageStoreConfig.logDirectory, messageStoreConfig.logShards,
+                                               messageStoreConfig.segmentBytes));
+    }
+
+    // The writer is opened first: it creates the schema and switches the
+    // journal mode before any read-only connection exists.
+    writer = startLane("writer", flushPolicy, databasePath, storageProfile, false);
+    for (int i = 0; i < qMax(1, readerCount); ++i)
+    {
+        readers.append(startLane(QString("reader-%1").arg(i), flushPolicy, databasePath, storageProfile, true));
+    }
+
+    ArchivePolicy archivePolicy = messageStoreConfig.archive;
+    write([archivePolicy](DatabaseManager &database) {
+        database.setArchivePolicy(archivePolicy);
+    });
+}
+
+DbExecutor::~DbExecutor()
+{
+    for (Lane *lane : readers)
+    {
+        stopLane(lane);
+    }
+    readers.clear();
+
+    // Last, so jobs already queued on the writer and its pending batch are
+    // committed before the connection closes.
+    stopLane(writer);
+    writer = nullptr;
+    messageStore.reset();
+}
+
+void DbExecutor::write(const Job &job)
+{
+    post(writer, job);
+}
+
+void DbExecutor::read(const Job &job)
+{
+    post(nextReader(), job);
+}
+
+DbExecutor::Lane *DbExecutor::startLane(const QString &connectionName, const FlushPolicy &flushPolicy,
+                                        const QString &databasePath, const StorageProfile &storageProfile,
+                                        bool readOnly)
+{
+    Lane *lane = new Lane;
+    lane->thread = new QThread;
+    lane->thread->setObjectName("db-" + connectionName);
+    lane->context = new QObject;
+    lane->context->moveToThread(lane->thread);
+    lane->thread->start();
+
+    // The manager, its connection and its flush timer must belong to the
+    // lane thread, so it is created there.
+    QMetaObject::invokeMethod(lane->context, [this, lane, connectionName, flushPolicy, databasePath,
+                                              storageProfile, readOnly]() {
+        lane->database = new DatabaseManager(connectionName, databasePath, storageProfile, readOnly,
+                                             messageStore.get());
+        lane->database->setFlushPolicy(flushPolicy);
+        if (!readOnly)
+        {
+            lane->database->setCommittedWatermark(&committedWatermark);
+        }
+    }, Qt::BlockingQueuedConnection);
+
+    return lane;
+}
+
+void DbExecutor::stopLane(Lane *lane)
+{
+    if (!lane)
+    {
+        return;
+    }
+
+    QMetaObject::invokeMethod(lane->context, [lane]() {
+        delete lane->database;
+        lane->database = nullptr;
+    }, Qt::BlockingQueuedConnection);
+
+    lane->thread->quit();
+    lane->thread->wait();
+    delete lane->context;
+    delete lane->thread;
+    delete lane;
+}
+
+DbExecutor::Lane *DbExecutor::nextReader()
+{
+    Lane *lane = readers.at(readerCursor);
+    readerCursor = (readerCursor + 1) % readers.size();
+    return lane;
+}
+
+void DbExecutor::post(Lane *lane, const Job &job)
+{
+    TraceContext trace = Tracer::currentContext();
+    QMetaObject::invokeMethod(lane->context, [lane, job, trace]() {
+        if (lane->database)
+        {
+            TraceContextScope traceScope(trace);
+            job(*lane->database);
+        }
+    }, Qt::QueuedConnection);
+}
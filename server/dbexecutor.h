@@ -0,0 +1,96 @@
+#ifndef DBEXECUTOR_H
+#define DBEXECUTOR_H
+
+#include <QList>
+#include <QObject>
+#include <QTemporaryDir>
+#include <QThread>
+#include <QMetaObject>
+#include <atomic>
+#include <functional>
+#include <memory>
+#include "databasemanager.h"
+
+// Runs DatabaseManager calls on dedicated threads, each owning its own named
+// SQLite connection. All mutations go to a single writer lane so they keep
+// the order they were submitted in (and therefore per-sender order); lookups
+// that do not depend on queued writes are spread across reader lanes, whose
+// connections are opened read-only. With the log message store all lanes
+// share one store instance.
+//
+// DatabaseManager::inMemoryDatabase is served from a file in a temporary
+// directory removed on shutdown. A shared-cache in-memory database would
+// let readers fail with SQLITE_LOCKED on the writer's table locks, which no
+// busy timeout waits out; a private file gets WAL and ordinary locking.
+//
+// Results are handed back to the context object's thread through a queued
+// invocation, so callbacks run on the Server thread in completion order.
+// The submitting thread's trace context travels with the job and back.
+class DbExecutor
+{
+public:
+    typedef std::function<void(DatabaseManager&)> Job;
+
+    DbExecutor(int readerCount, const FlushPolicy &flushPolicy, const QString &databasePath = QString(),
+               const StorageProfile &storageProfile = StorageProfile(),
+               const MessageStoreConfig &messageStoreConfig = MessageStoreConfig());
+    ~DbExecutor();
+
+    void write(const Job &job);
+    void read(const Job &job);
+
+    // Every message with an id at or below this is committed, so a reader
+    // lane sees it as well as the writer does.
+    qint64 committedMessageId() const { return committedWatermark.load(); }
+
+    template <typename Call, typename Done>
+    void write(Call call, QObject *context, Done done)
+    {
+        post(writer, deliver(call, context, done));
+    }
+
+    template <typename Call, typename Done>
+    void read(Call call, QObject *context, Done done)
+    {
+        post(nextReader(), deliver(call, context, done));
+    }
+
+private:
+    struct Lane
+    {
+        QThread *thread = nullptr;
+        QObject *context = nullptr;
+        DatabaseManager *database = nullptr;
+    };
+
+    Lane *writer = nullptr;
+    QList<Lane*> readers;
+    int readerCursor = 0;
+    std::atomic<qint64> committedWatermark { 0 };
+    // Null for the SQLite backend, where every lane stores messages through
+    // its own connection.
+    std::unique_ptr<MessageStore> messageStore;
+    // Holds the file behind an in-memory database.
+    std::unique_ptr<QTemporaryDir> scratchDirectory;
+
+    Lane *startLane(const QString &connectionName, const FlushPolicy &flushPolicy, const QString &databasePath,
+                    const StorageProfile &storageProfile, bool readOnly);
+    void stopLane(Lane *lane);
+    Lane *nextReader();
+    void post(Lane *lane, const Job &job);
+
+    template <typename Call, typename Done>
+    static Job deliver(Call call, QObject *context, Done done)
+    {
+        return [call, context, done](DatabaseManager &database) {
+            auto result = call(database);
+            TraceContext trace = Tracer::currentContext();
+            QMetaObject::invokeMethod(context, [done, result, trace]() {
+                TraceContextScope traceScope(trace);
+                done(result);
+            }, Qt::QueuedConnection);
+        };
+    }
+};
+
+#endif // DBEXECUTOR_H
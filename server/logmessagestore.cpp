@@ -0,0 +1,629 @@
+#include "logmessagestore.h"
+
+#include <QDateTime>
+#include <QDebug>
+#include <QDir>
+#include <QTimeZone>
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstring>
+#ifdef Q_OS_UNIX
+#include <sys/mman.h>
+#include <unistd.h>
+#include <cerrno>
+#elif defined(Q_OS_WIN)
+#include <io.h>
+#include <windows.h>
+#endif
+
+// A record as laid out in a segment, in native byte order, at an 8-byte
+// aligned offset and followed by textBytes of UTF-8 padded to 8 bytes.
+// magic is written last, so a record is only ever seen whole.
+struct LogMessageStore::Record
+{
+    quint32 magic;
+    quint32 textBytes;
+    qint64 id;
+    qint64 prevInChat;
+    qint64 prevForRecipient;
+    qint64 timestamp;
+    qint32 chatId;
+    qint32 senderId;
+    qint32 recipientId;
+    // CRC-16 of the fields from textBytes to here in the upper half, of the
+    // text in the lower; a record torn by a crash fails it.
+    quint32 checksum;
+
+    const char *text() const { return reinterpret_cast<const char*>(this + 1); }
+};
+
+namespace {
+constexpr quint32 recordMagic = 0x31524d51; // "QMR1"
+const char segmentMagic[] = "QMLOGSEG";
+// Segment header: the magic, then reserved space up to the first record.
+constexpr qint64 segmentHeaderBytes = 64;
+// Every indexInterval-th message of a chat goes into its sparse index, so
+// a page walks at most this many records past the one it starts from.
+constexpr quint32 indexInterval = 32;
+constexpr qint64 minSegmentBytes = 1024 * 1024;
+// Offsets within a segment are 32 bits in a position.
+constexpr qint64 maxSegmentBytes = 1024LL * 1024 * 1024;
+const char *const timestampFormat = "yyyy-MM-dd HH:mm:ss";
+
+quint16 crc16(const char *data, qint64 size)
+{
+#if QT_VERSION >= QT_VERSION_CHECK(6, 0, 0)
+    return qChecksum(QByteArrayView(data, size));
+#else
+    return qChecksum(data, uint(size));
+#endif
+}
+
+qint64 padded(qint64 bytes)
+{
+    return (bytes + 7) & ~qint64(7);
+}
+
+// shard (8 bits) | segment (24 bits) | offset (32 bits). Shards from 128
+// up set the sign bit, so only noPosition ends a chain; offsets stay below
+// maxSegmentBytes and never make a real position equal to it.
+qint64 makePosition(int shard, int segment, qint64 offset)
+{
+    return qint64((quint64(shard) << 56) | (quint64(segment) << 32) | quint64(offset));
+}
+
+QString segmentName(int sequence)
+{
+    return QString("%1.seg").arg(sequence, 8, 10, QChar('0'));
+}
+
+// Log header: the magic, then the shard count as a native quint32. A chat
+// lives in shard chatId % count, so its records stay in one shard, in id
+// order, only while the count never changes.
+const char headerName[] = "log.header";
+const char headerMagic[] = "QMLOGHDR";
+
+// The shard count the log at root was written with, 0 for a new log.
+// hasHeader tells whether it came from a valid header.
+int recordedShardCount(const QDir &root, bool *hasHeader)
+{
+    *hasHeader = false;
+    QFile header(root.filePath(headerName));
+    if (header.open(QIODevice::ReadOnly))
+    {
+        QByteArray bytes = header.readAll();
+        quint32 count = 0;
+        if (bytes.size() == qsizetype(sizeof(headerMagic) - 1 + sizeof(count))
+            && bytes.startsWith(headerMagic))
+        {
+            std::memcpy(&count, bytes.constData() + sizeof(headerMagic) - 1, sizeof(count));
+            *hasHeader = true;
+            return int(count);
+        }
+        qDebug() << "Unreadable message log header" << header.fileName();
+    }
+
+    // Logs from before the header have one directory per shard.
+    return int(root.entryList({ "shard-*" }, QDir::Dirs | QDir::NoDotAndDotDot).size());
+}
+
+bool writeShardCount(const QDir &root, int shardCount)
+{
+    QFile header(root.filePath(headerName));
+    quint32 count = quint32(shardCount);
+    QByteArray bytes(headerMagic, sizeof(headerMagic) - 1);
+    bytes.append(reinterpret_cast<const char*>(&count), sizeof(count));
+    return header.open(QIODevice::WriteOnly | QIODevice::Truncate) && header.write(bytes) == bytes.size();
+}
+}
+
+LogMessageStore::LogMessageStore(const QString &directory, int shardCount, qint64 segmentBytes)
+    : segmentBytes(qBound(minSegmentBytes, padded(segmentBytes), maxSegmentBytes))
+{
+    roller.setMaxThreadCount(1);
+
+    // Re-sharding would interleave a chat's records across shards and
+    // break the id order recovery relies on, so an existing log keeps the
+    // count it was written with.
+    QDir root(directory);
+    shardCount = qBound(1, shardCount, maxShards);
+    bool hasHeader = false;
+    int recorded = recordedShardCount(root, &hasHeader);
+    if (recorded > 0 && recorded != shardCount)
+    {
+        qDebug() << "Message log" << directory << "was written with" << recorded
+                 << "shards; ignoring the configured" << shardCount;
+        shardCount = qBound(1, recorded, maxShards);
+    }
+    if (!hasHeader && (!QDir().mkpath(directory) || !writeShardCount(root, shardCount)))
+    {
+        qDebug() << "Cannot write message log header in" << directory;
+    }
+
+    for (int i = 0; i < shardCount; ++i)
+    {
+        auto shard = std::make_unique<Shard>();
+        shard->directory = root.filePath(QString("shard-%1").arg(i, 3, 10, QChar('0')));
+        shards.push_back(std::move(shard));
+        openShard(i);
+    }
+
+    qDebug() << "Message log" << directory << "opened:" << chats.size() << "chats, last message" << lastId;
+}
+
+LogMessageStore::~LogMessageStore()
+{
+    // Segments are unmapped when their files close.
+    roller.waitForDone();
+}
+
+void LogMessageStore::openShard(int shardIndex)
+{
+    Shard &shard = *shards[shardIndex];
+    if (!QDir().mkpath(shard.directory))
+    {
+        qDebug() << "Cannot create message log directory" << shard.directory;
+        return;
+    }
+
+    // Positions refer to segments by sequence number, so only a gapless
+    // run from 0 can be trusted.
+    for (int sequence = 0; ; ++sequence)
+    {
+        auto segment = std::make_unique<Segment>();
+        segment->file = std::make_unique<QFile>(QDir(shard.directory).filePath(segmentName(sequence)));
+        if (!segment->file->exists())
+        {
+            break;
+        }
+
+        segment->size = segment->file->size();
+        if (segment->size < segmentHeaderBytes || segment->size > maxSegmentBytes
+            || !segment->file->open(QIODevice::ReadWrite)
+            || !(segment->data = segment->file->map(0, segment->size))
+            || std::memcmp(segment->data, segmentMagic, sizeof(segmentMagic) - 1) != 0)
+        {
+            qDebug() << "Ignoring unreadable log segment" << segment->file->fileName() << "and later ones";
+            break;
+        }
+
+        shard.segments.push_back(std::move(segment));
+        recover(shardIndex, sequence);
+    }
+
+    if (shard.segments.empty())
+    {
+        if (auto segment = createSegment(shard, 0, segmentBytes))
+        {
+            shard.segments.push_back(std::move(segment));
+        }
+    }
+}
+
+void LogMessageStore::recover(int shardIndex, int segmentIndex)
+{
+    Segment &segment = *shards[shardIndex]->segments[segmentIndex];
+
+    qint64 offset = segmentHeaderBytes;
+    while (offset + qint64(sizeof(Record)) <= segment.size)
+    {
+        const Record *record = reinterpret_cast<const Record*>(segment.data + offset);
+        qint64 bytes = padded(sizeof(Record) + record->textBytes);
+        if (record->magic != recordMagic || offset + bytes > segment.size)
+        {
+            break;
+        }
+
+        const char *fields = reinterpret_cast<const char*>(&record->textBytes);
+        quint32 checksum = quint32(crc16(fields, offsetof(Record, checksum) - offsetof(Record, textBytes))) << 16
+                           | crc16(record->text(), record->textBytes);
+        if (checksum != record->checksum)
+        {
+            qDebug() << "Log segment" << segment.file->fileName() << "ends in a torn record at" << offset;
+            break;
+        }
+
+        index(*record, makePosition(shardIndex, segmentIndex, offset));
+        offset += bytes;
+    }
+    segment.used = offset;
+}
+
+void LogMessageStore::index(const Record &record, qint64 position)
+{
+    ChatLog &chat = chats[record.chatId];
+    if (chat.count % indexInterval == 0)
+    {
+        chat.sparse.append({ record.id, position });
+    }
+    ++chat.count;
+    chat.tail = position;
+    chat.tailId = record.id;
+
+    // Recipient chains cross shards, which are recovered one after another.
+    RecipientLog &recipient = recipients[record.recipientId];
+    if (record.id > recipient.tailId)
+    {
+        recipient.tail = position;
+        recipient.tailId = record.id;
+    }
+
+    lastId = qMax(lastId, record.id);
+}
+
+std::unique_ptr<LogMessageStore::Segment> LogMessageStore::createSegment(const Shard &shard, int sequence,
+                                                                         qint64 size) const
+{
+    auto segment = std::make_unique<Segment>();
+    segment->file = std::make_unique<QFile>(QDir(shard.directory).filePath(segmentName(sequence)));
+    segment->size = size;
+    if (!segment->file->open(QIODevice::ReadWrite | QIODevice::Truncate)
+        || !segment->file->resize(size)
+        || !(segment->data = segment->file->map(0, size)))
+    {
+        qDebug() << "Cannot create log segment" << segment->file->fileName() << ":" << segment->file->errorString();
+        return nullptr;
+    }
+
+    std::memcpy(segment->data, segmentMagic, sizeof(segmentMagic) - 1);
+    segment->used = segmentHeaderBytes;
+    return segment;
+}
+
+void LogMessageStore::requestSpare(int shardIndex)
+{
+    Shard &shard = *shards[shardIndex];
+    {
+        QMutexLocker locker(&shard.spareMutex);
+        if (shard.spareRequested)
+        {
+            return;
+        }
+        shard.spareRequested = true;
+    }
+
+    // Only the writer adds segments, so this is the next sequence number.
+    int sequence = int(shard.segments.size());
+    roller.start([this, &shard, sequence]() {
+        std::unique_ptr<Segment> segment = createSegment(shard, sequence, segmentBytes);
+        QMutexLocker locker(&shard.spareMutex);
+        shard.spare = std::move(segment);
+    });
+}
+
+LogMessageStore::Segment *LogMessageStore::segmentFor(int shardIndex, qint64 bytes)
+{
+    Shard &shard = *shards[shardIndex];
+    if (shard.segments.empty())
+    {
+        return nullptr;
+    }
+
+    Segment *active = shard.segments.back().get();
+    if (active->used + bytes <= active->size)
+    {
+        return active;
+    }
+
+    // Roll over, normally onto the spare made in the background. If it is
+    // still being created, wait rather than race it for the file name.
+    std::unique_ptr<Segment> next;
+    {
+        QMutexLocker locker(&shard.spareMutex);
+        if (shard.spareRequested && !shard.spare)
+        {
+            locker.unlock();
+            roller.waitForDone();
+            locker.relock();
+        }
+        next = std::move(shard.spare);
+        shard.spareRequested = false;
+    }
+
+    int sequence = int(shard.segments.size());
+    if (!next || next->size - next->used < bytes)
+    {
+        // An oversized record gets a segment of its own size.
+        next.reset();
+        next = createSegment(shard, sequence, qMax(segmentBytes, padded(segmentHeaderBytes + bytes)));
+        if (!next)
+        {
+            return nullptr;
+        }
+    }
+
+    QWriteLocker locker(&lock);
+    shard.segments.push_back(std::move(next));
+    return shard.segments.back().get();
+}
+
+qint64 LogMessageStore::lastMessageId()
+{
+    QReadLocker locker(&lock);
+    return lastId;
+}
+
+bool LogMessageStore::append(const QVector<StoredMessage> &messages)
+{
+    // Batches share a second or two, so parse each timestamp once.
+    QString lastTimestamp;
+    qint64 lastSeconds = 0;
+
+    // The caller commits watermarks and summaries that point at these
+    // records next, so every range written is on disk before returning.
+    Segment *dirty = nullptr;
+    qint64 dirtyFrom = 0;
+    auto syncDirty = [&dirty, &dirtyFrom]() {
+        bool synced = !dirty || syncRange(*dirty, dirtyFrom, dirty->used);
+        dirty = nullptr;
+        return synced;
+    };
+
+    for (const StoredMessage &message : messages)
+    {
+        // A batch retried after its SQLite commit failed is already here.
+        if (message.id <= lastId)
+        {
+            continue;
+        }
+
+        QByteArray text = message.message.toUtf8();
+        int shardIndex = message.chatId % int(shards.size());
+        qint64 bytes = padded(sizeof(Record) + text.size());
+
+        Segment *segment = segmentFor(shardIndex, bytes);
+        if (!segment)
+        {
+            qDebug() << "Dropped message" << message.id << ": no writable log segment";
+            syncDirty();
+            return false;
+        }
+        if (segment != dirty)
+        {
+            if (!syncDirty())
+            {
+                return false;
+            }
+            dirty = segment;
+            dirtyFrom = segment->used;
+        }
+
+        if (message.timestamp != lastTimestamp)
+        {
+            QDateTime sentAt = QDateTime::fromString(message.timestamp, timestampFormat);
+            sentAt.setTimeZone(QTimeZone::utc());
+            lastTimestamp = message.timestamp;
+            lastSeconds = sentAt.toSecsSinceEpoch();
+        }
+
+        // Only this thread changes the indexes, so reading them unlocked is
+        // safe; readers never look past a segment's used size.
+        qint64 offset = segment->used;
+        Record *record = reinterpret_cast<Record*>(segment->data + offset);
+        record->textBytes = quint32(text.size());
+        record->id = message.id;
+        record->prevInChat = chats.value(message.chatId).tail;
+        record->prevForRecipient = recipients.value(message.recipientId).tail;
+        record->timestamp = lastSeconds;
+        record->chatId = message.chatId;
+        record->senderId = message.senderId;
+        record->recipientId = message.recipientId;
+        std::memcpy(segment->data + offset + sizeof(Record), text.constData(), size_t(text.size()));
+
+        const char *fields = reinterpret_cast<const char*>(&record->textBytes);
+        record->checksum = quint32(crc16(fields, offsetof(Record, checksum) - offsetof(Record, textBytes))) << 16
+                           | crc16(text.constData(), text.size());
+        std::atomic_thread_fence(std::memory_order_release);
+        record->magic = recordMagic;
+
+        {
+            QWriteLocker locker(&lock);
+            segment->used = offset + bytes;
+            index(*record, makePosition(shardIndex, int(shards[shardIndex]->segments.size()) - 1, offset));
+        }
+
+        if (segment->used > segment->size / 4 * 3)
+        {
+            requestSpare(shardIndex);
+        }
+    }
+    return syncDirty();
+}
+
+bool LogMessageStore::syncRange(const Segment &segment, qint64 from, qint64 to)
+{
+    if (to <= from)
+    {
+        return true;
+    }
+
+#ifdef Q_OS_UNIX
+    // msync wants a page-aligned start; the mapping itself is.
+    static const qint64 pageSize = sysconf(_SC_PAGESIZE);
+    qint64 start = from / pageSize * pageSize;
+    if (msync(segment.data + start, size_t(to - start), MS_SYNC) != 0)
+    {
+        qDebug() << "Cannot sync log segment" << segment.file->fileName() << ":" << qt_error_string(errno);
+        return false;
+    }
+#elif defined(Q_OS_WIN)
+    HANDLE handle = reinterpret_cast<HANDLE>(_get_osfhandle(segment.file->handle()));
+    if (!FlushViewOfFile(segment.data + from, SIZE_T(to - from)) || !FlushFileBuffers(handle))
+    {
+        qDebug() << "Cannot sync log segment" << segment.file->fileName() << ":" << qt_error_string();
+        return false;
+    }
+#endif
+    return true;
+}
+
+const LogMessageStore::Record *LogMessageStore::recordAt(qint64 position) const
+{
+    if (position == noPosition)
+    {
+        return nullptr;
+    }
+
+    size_t shardIndex = size_t(quint64(position) >> 56);
+    size_t segmentIndex = size_t((quint64(position) >> 32) & 0xffffff);
+    qint64 offset = qint64(quint64(position) & 0xffffffff);
+    if (shardIndex >= shards.size() || segmentIndex >= shards[shardIndex]->segments.size())
+    {
+        return nullptr;
+    }
+
+    const Segment &segment = *shards[shardIndex]->segments[segmentIndex];
+    if (offset + qint64(sizeof(Record)) > segment.used)
+    {
+        return nullptr;
+    }
+    const Record *record = reinterpret_cast<const Record*>(segment.data + offset);
+    return record->magic == recordMagic ? record : nullptr;
+}
+
+StoredMessage LogMessageStore::decode(const Record *record)
+{
+    StoredMessage message;
+    message.id = record->id;
+    message.chatId = record->chatId;
+    message.senderId = record->senderId;
+    message.recipientId = record->recipientId;
+    message.message = QString::fromUtf8(record->text(), record->textBytes);
+    message.timestamp = QDateTime::fromSecsSinceEpoch(record->timestamp, QTimeZone::utc()).toString(timestampFormat);
+    return message;
+}
+
+QVector<StoredMessage> LogMessageStore::readChat(int chatId, qint64 beforeId, int limit)
+{
+    QVector<StoredMessage> page;
+
+    QReadLocker locker(&lock);
+    auto chat = chats.constFind(chatId);
+    if (chat == chats.constEnd())
+    {
+        return page;
+    }
+
+    qint64 position = chat->tail;
+    if (beforeId > 0 && beforeId <= chat->tailId)
+    {
+        // Start from the first indexed message at or after the cursor.
+        auto entry = std::lower_bound(chat->sparse.cbegin(), chat->sparse.cend(), beforeId,
+                                      [](const IndexEntry &entry, qint64 id) { return entry.id < id; });
+        if (entry != chat->sparse.cend())
+        {
+            position = entry->position;
+        }
+    }
+
+    while (limit < 0 || page.size() < limit)
+    {
+        const Record *record = recordAt(position);
+        if (!record)
+        {
+            break;
+        }
+        if (beforeId <= 0 || record->id < beforeId)
+        {
+            page.append(decode(record));
+        }
+        position = record->prevInChat;
+    }
+
+    std::reverse(page.begin(), page.end());
+    return page;
+}
+
+QVector<StoredMessage> LogMessageStore::readChatsAfter(const QVector<int> &chatIds, qint64 afterId, int limit)
+{
+    QVector<StoredMessage> messages;
+
+    QReadLocker locker(&lock);
+
+    // Collect positions first and decode only the ones that make the cut.
+    QVector<IndexEntry> candidates;
+    for (int chatId : chatIds)
+    {
+        auto chat = chats.constFind(chatId);
+        if (chat == chats.constEnd() || chat->tailId <= afterId)
+        {
+            continue;
+        }
+        // Chains only link backwards, so start from the sparse entry far
+        // enough past afterId to cover limit messages instead of the tail.
+        qint64 position = chat->tail;
+        auto first = std::upper_bound(chat->sparse.cbegin(), chat->sparse.cend(), afterId,
+                                      [](qint64 id, const IndexEntry &entry) { return id < entry.id; });
+        qint64 skip = limit / indexInterval + 1;
+        if (chat->sparse.cend() - first > skip)
+        {
+            position = (first + skip)->position;
+        }
+        const Record *record;
+        while ((record = recordAt(position)) && record->id > afterId)
+        {
+            candidates.append({ record->id, position });
+            position = record->prevInChat;
+        }
+    }
+
+    std::sort(candidates.begin(), candidates.end(),
+              [](const IndexEntry &a, const IndexEntry &b) { return a.id < b.id; });
+    for (int i = 0; i < candidates.size() && i < limit; ++i)
+    {
+        messages.append(decode(recordAt(candidates.at(i).position)));
+    }
+    return messages;
+}
+
+QVector<StoredMessage> LogMessageStore::readForRecipient(int recipientId, qint64 afterId)
+{
+    QVector<StoredMessage> messages;
+
+    QReadLocker locker(&lock);
+    qint64 position = recipients.value(recipientId).tail;
+    for (const Record *record = recordAt(position); record && record->id > afterId;
+         record = recordAt(record->prevForRecipient))
+    {
+        messages.append(decode(record));
+    }
+
+    std::reverse(messages.begin(), messages.end());
+    return messages;
+}
+
+int LogMessageStore::countUnread(int chatId, int readerId, qint64 afterId)
+{
+    int unread = 0;
+
+    QReadLocker locker(&lock);
+    qint64 position = chats.value(chatId).tail;
+    for (const Record *record = recordAt(position); record && record->id > afterId;
+         record = recordAt(record->prevInChat))
+    {
+        if (record->senderId != readerId)
+        {
+            ++unread;
+        }
+    }
+    return unread;
+}
+
+QHash<int, qint64> LogMessageStore::newestPerChat(int recipientId, qint64 afterId, qint64 upToId)
+{
+    QHash<int, qint64> newest;
+
+    QReadLocker locker(&lock);
+    qint64 position = recipients.value(recipientId).tail;
+    for (const Record *record = recordAt(position); record && record->id > afterId;
+         record = recordAt(record->prevForRecipient))
+    {
+        // Walking backwards, the first one seen per chat is its newest.
+        if (record->id <= upToId && !newest.contains(record->chatId))
+        {
+            newest.insert(record->chatId, record->id);
+        }
+    }
+    return newest;
+}
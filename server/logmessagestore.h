@@ -0,0 +1,123 @@
+#ifndef LOGMESSAGESTORE_H
+#define LOGMESSAGESTORE_H
+
+#include <QFile>
+#include <QHash>
+#include <QMutex>
+#include <QReadWriteLock>
+#include <QThreadPool>
+#include <memory>
+#include <vector>
+#include "messagestore.h"
+
+// Append-only message log. Chats are spread over a fixed number of shards;
+// each shard is a sequence of fixed-size, memory-mapped segment files that
+// only ever grow at the end, so ingest is a sequential memcpy and reads
+// decode straight from the mapping without a read() call or buffer copy.
+//
+// Every record links back to the previous record of its chat and of its
+// recipient. With the chain tails and a sparse per-chat index (every
+// indexInterval-th message) kept in memory, a history page is a short walk
+// from the index entry nearest the cursor, and pending messages are a walk
+// down the recipient chain. Both are rebuilt by scanning the log on open.
+//
+// A chat's records all go to shard chatId % shardCount, which keeps each
+// chain in id order. The count is recorded in the log's header, and an
+// existing log is always reopened with the count it was written with.
+//
+// Segments are created ahead of time on a background thread once the
+// active one is three quarters full, so rolling over rarely waits for the
+// file system.
+//
+// append() returns only once the records it wrote are synced to disk, so
+// the SQLite state committed after it never points past the log.
+//
+// One instance is shared by every lane: append() is called from the writer
+// only, reads from any thread.
+class LogMessageStore : public MessageStore
+{
+public:
+    // A position holds the shard in 8 bits.
+    static constexpr int maxShards = 256;
+
+    LogMessageStore(const QString &directory, int shardCount, qint64 segmentBytes);
+    ~LogMessageStore() override;
+
+    qint64 lastMessageId() override;
+    bool append(const QVector<StoredMessage> &messages) override;
+
+    QVector<StoredMessage> readChat(int chatId, qint64 beforeId, int limit) override;
+    QVector<StoredMessage> readChatsAfter(const QVector<int> &chatIds, qint64 afterId, int limit) override;
+    QVector<StoredMessage> readForRecipient(int recipientId, qint64 afterId) override;
+
+    int countUnread(int chatId, int readerId, qint64 afterId) override;
+    QHash<int, qint64> newestPerChat(int recipientId, qint64 afterId, qint64 upToId) override;
+
+private:
+    struct Segment
+    {
+        std::unique_ptr<QFile> file;
+        uchar *data = nullptr;
+        qint64 size = 0;
+        qint64 used = 0;
+    };
+
+    struct Shard
+    {
+        QString directory;
+        std::vector<std::unique_ptr<Segment>> segments;
+        // Created in the background, waiting to become the active segment.
+        std::unique_ptr<Segment> spare;
+        bool spareRequested = false;
+        QMutex spareMutex;
+    };
+
+    // Where a record is in the log; noPosition ends a chain.
+    static constexpr qint64 noPosition = -1;
+
+    struct IndexEntry
+    {
+        qint64 id;
+        qint64 position;
+    };
+
+    struct ChatLog
+    {
+        qint64 tail = noPosition;
+        qint64 tailId = 0;
+        quint32 count = 0;
+        QVector<IndexEntry> sparse;
+    };
+
+    struct RecipientLog
+    {
+        qint64 tail = noPosition;
+        qint64 tailId = 0;
+    };
+
+    struct Record;
+
+    qint64 segmentBytes;
+    std::vector<std::unique_ptr<Shard>> shards;
+    // Guards the segment lists, the used sizes and the indexes. Record bytes
+    // below a segment's used size never change, so readers only hold it to
+    // resolve positions.
+    mutable QReadWriteLock lock;
+    QHash<int, ChatLog> chats;
+    QHash<int, RecipientLog> recipients;
+    qint64 lastId = 0;
+    QThreadPool roller;
+
+    void openShard(int shardIndex);
+    void recover(int shardIndex, int segmentIndex);
+    void index(const Record &record, qint64 position);
+    std::unique_ptr<Segment> createSegment(const Shard &shard, int sequence, qint64 size) const;
+    void requestSpare(int shardIndex);
+    Segment *segmentFor(int shardIndex, qint64 bytes);
+    static bool syncRange(const Segment &segment, qint64 from, qint64 to);
+
+    const Record *recordAt(qint64 position) const;
+    static StoredMessage decode(const Record *record);
+};
+
+#endif // LOGMESSAGESTORE_H
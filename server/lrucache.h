@@ -0,0 +1,106 @@
+#ifndef LRUCACHE_H
+#define LRUCACHE_H
+
+#include <QHash>
+#include <list>
+#include "metrics.h"
+
+// Bounded map that evicts the least recently used entry once full.
+// Once exported, lookups and the entry count go to the given metrics so the
+// hit rate can be monitored.
+template <typename Key, typename Value>
+class LruCache
+{
+public:
+    explicit LruCache(int capacity = 4096)
+        : maxSize(qMax(1, capacity))
+    {
+    }
+
+    void exportTo(Counter *hits, Counter *misses, Gauge *size)
+    {
+        hitCounter = hits;
+        missCounter = misses;
+        sizeGauge = size;
+        publishSize();
+    }
+
+    bool get(const Key &key, Value *value)
+    {
+        auto it = index.find(key);
+        if (it == index.end())
+        {
+            if (missCounter)
+            {
+                missCounter->add();
+            }
+            return false;
+        }
+
+        entries.splice(entries.begin(), entries, it.value());
+        *value = it.value()->second;
+        if (hitCounter)
+        {
+            hitCounter->add();
+        }
+        return true;
+    }
+
+    void put(const Key &key, const Value &value)
+    {
+        auto it = index.find(key);
+        if (it != index.end())
+        {
+            it.value()->second = value;
+            entries.splice(entries.begin(), entries, it.value());
+            return;
+        }
+
+        entries.emplace_front(key, value);
+        index.insert(key, entries.begin());
+        if (index.size() > maxSize)
+        {
+            index.remove(entries.back().first);
+            entries.pop_back();
+        }
+        publishSize();
+    }
+
+    void remove(const Key &key)
+    {
+        auto it = index.find(key);
+        if (it != index.end())
+        {
+            entries.erase(it.value());
+            index.erase(it);
+            publishSize();
+        }
+    }
+
+    void clear()
+    {
+        entries.clear();
+        index.clear();
+        publishSize();
+    }
+
+private:
+    typedef std::list<std::pair<Key, Value>> EntryList;
+
+    int maxSize;
+    EntryList entries;
+    QHash<Key, typename EntryList::iterator> index;
+    Counter *hitCounter = nullptr;
+    Counter *missCounter = nullptr;
+    Gauge *sizeGauge = nullptr;
+
+    void publishSize()
+    {
+        if (sizeGauge)
+        {
+            sizeGauge->set(index.size());
+        }
+    }
+};
+
+#endif // LRUCACHE_H
@@ -1,9 +1,181 @@
 #include <QCoreApplication>
+#include <QCommandLineParser>
+#include <QSocketNotifier>
+#include <cerrno>
+#include <csignal>
+#include <initializer_list>
 #include "server.h"
+#ifdef Q_OS_UNIX
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+namespace {
+#ifdef Q_OS_UNIX
+// Written by the signal handler, read on the main thread. A handler may
+// only call async-signal-safe functions, so it cannot quit the event loop
+// itself; it writes the signal number here and a QSocketNotifier does.
+int signalPipe[2] = { -1, -1 };
+
+void writeSignal(int number)
+{
+    const int savedErrno = errno;
+    const char byte = char(number);
+    ssize_t written = ::write(signalPipe[1], &byte, 1);
+    Q_UNUSED(written);
+    errno = savedErrno;
+}
+
+void quitOnSignals(QCoreApplication &app, std::initializer_list<int> numbers)
+{
+    if (::pipe(signalPipe) != 0)
+    {
+        qWarning() << "Cannot create the signal pipe; signals will not shut down gracefully";
+        return;
+    }
+    for (int fd : signalPipe)
+    {
+        ::fcntl(fd, F_SETFD, FD_CLOEXEC);
+    }
+    // A burst of signals must never block the handler.
+    ::fcntl(signalPipe[1], F_SETFL, ::fcntl(signalPipe[1], F_GETFL) | O_NONBLOCK);
+
+    QSocketNotifier *notifier = new QSocketNotifier(signalPipe[0], QSocketNotifier::Read, &app);
+    QObject::connect(notifier, &QSocketNotifier::activated, &app, []() {
+        char byte;
+        if (::read(signalPipe[0], &byte, 1) == 1)
+        {
+            QCoreApplication::quit();
+        }
+    });
+
+    struct sigaction action = {};
+    action.sa_handler = writeSignal;
+    sigemptyset(&action.sa_mask);
+    action.sa_flags = SA_RESTART;
+    for (int number : numbers)
+    {
+        ::sigaction(number, &action, nullptr);
+    }
+}
+#else
+// Elsewhere the process simply ends on a signal, without the final flush.
+void quitOnSignals(QCoreApplication &, std::initializer_list<int>)
+{
+}
+#endif
+}
 
 int main(int argc, char *argv[])
 {
     QCoreApplication a(argc, argv);
-    Server server;
-    return a.exec();
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription("QMessenger server");
+    parser.addHelpOption();
+
+    QCommandLineOption databaseOption("db", "SQLite database file, or :memory: for a throwaway one removed on exit.", "path", "./messanger_users.db");
+    QCommandLineOption flushBatchOption("flush-batch", "Commit queued chat messages once <count> are pending.", "count", "256");
+    QCommandLineOption flushIntervalOption("flush-interval", "Commit queued chat messages at most <ms> after the first one.", "ms", "5");
+    QCommandLineOption dbReadersOption("db-readers", "Number of read-only database connections, one thread each.", "count", "2");
+    parser.addOptions({ databaseOption, flushBatchOption, flushIntervalOption, dbReadersOption });
+
+    QCommandLineOption journalModeOption("journal-mode", "SQLite journal mode (WAL, DELETE, TRUNCATE, ...).", "mode", "WAL");
+    QCommandLineOption synchronousOption("synchronous", "SQLite synchronous level (OFF, NORMAL, FULL, EXTRA).", "level", "NORMAL");
+    QCommandLineOption mmapSizeOption("mmap-size", "Memory-map up to <MiB> of the database file per connection.", "MiB", "256");
+    QCommandLineOption cacheSizeOption("cache-size", "SQLite page cache per connection.", "MiB", "64");
+    QCommandLineOption tempStoreOption("temp-store", "Where SQLite keeps temporary tables (DEFAULT, FILE, MEMORY).", "where", "MEMORY");
+    QCommandLineOption busyTimeoutOption("busy-timeout", "Wait up to <ms> for a database lock.", "ms", "5000");
+    parser.addOptions({ journalModeOption, synchronousOption, mmapSizeOption, cacheSizeOption, tempStoreOption,
+                        busyTimeoutOption });
+
+    QCommandLineOption messageStoreOption("message-store", "Where chat messages are kept: sqlite or log.", "backend", "sqlite");
+    QCommandLineOption messageLogOption("message-log", "Directory of the message log (--message-store log).", "path", "./messanger_log");
+    QCommandLineOption logShardsOption("log-shards", "Number of message log shards.", "count", "16");
+    QCommandLineOption logSegmentOption("log-segment-size", "Size of one message log segment file.", "MiB", "64");
+    parser.addOptions({ messageStoreOption, messageLogOption, logShardsOption, logSegmentOption });
+
+    QCommandLineOption archiveAfterOption("archive-after", "Compress messages older than <days> into the archive (0 = never).", "days", "0");
+    QCommandLineOption archiveIntervalOption("archive-interval", "Run the archiver every <seconds>.", "seconds", "60");
+    QCommandLineOption archiveBlockOption("archive-block", "Messages per compressed archive block.", "count", "256");
+    QCommandLineOption archiveLevelOption("archive-level", "zlib level for archive blocks (-1 = default, 0-9).", "level", "-1");
+    parser.addOptions({ archiveAfterOption, archiveIntervalOption, archiveBlockOption, archiveLevelOption });
+
+    QCommandLineOption ioThreadsOption("io-threads", "Spread connections over <count> event loop threads (0 = main thread only).", "count", "0");
+    QCommandLineOption presenceIntervalOption("presence-interval", "Batch presence updates for <ms> before sending.", "ms", "100");
+    QCommandLineOption searchLimitOption("search-limit", "Return at most <count> users per search.", "count", "20");
+    parser.addOptions({ ioThreadsOption, presenceIntervalOption, searchLimitOption });
+
+    QCommandLineOption compressThresholdOption("compress-threshold", "Compress frames of at least <bytes> for clients that support it (0 = off).", "bytes", "4096");
+    QCommandLineOption compressLevelOption("compress-level", "zlib level for compressed frames (1-9).", "level", "6");
+    parser.addOptions({ compressThresholdOption, compressLevelOption });
+
+    QCommandLineOption authIterationsOption("auth-iterations", "PBKDF2 iterations for password hashes.", "count", "100000");
+    QCommandLineOption authThreadsOption("auth-threads", "Number of password hashing threads.", "count", "2");
+    QCommandLineOption authQueueOption("auth-queue", "Refuse logins once <count> are pending.", "count", "256");
+    QCommandLineOption resumeTtlOption("resume-ttl", "Seconds a resume token stays valid.", "seconds", "86400");
+    parser.addOptions({ authIterationsOption, authThreadsOption, authQueueOption, resumeTtlOption });
+
+    QCommandLineOption metricsPortOption("metrics-port", "Serve Prometheus metrics on 127.0.0.1:<port> (0 = off).", "port", "9101");
+    QCommandLineOption traceOption("trace", "Record request trace spans (served at /trace on the metrics port).");
+    QCommandLineOption traceFileOption("trace-file", "Write the Chrome trace to <path> on shutdown; implies --trace.", "path");
+    QCommandLineOption traceBufferOption("trace-buffer", "Keep the last <count> trace events per thread.", "count", "65536");
+    parser.addOptions({ metricsPortOption, traceOption, traceFileOption, traceBufferOption });
+    parser.process(a);
+
+    ServerConfig config;
+    config.databasePath = parser.value(databaseOption);
+    config.flushPolicy.maxBatchSize = parser.value(flushBatchOption).toInt();
+    config.flushPolicy.maxDelayMs = parser.value(flushIntervalOption).toInt();
+    config.dbReaderThreads = parser.value(dbReadersOption).toInt();
+    config.storage.journalMode = parser.value(journalModeOption);
+    config.storage.synchronous = parser.value(synchronousOption);
+    config.storage.mmapSizeBytes = parser.value(mmapSizeOption).toLongLong() * 1024 * 1024;
+    config.storage.cacheSizeBytes = parser.value(cacheSizeOption).toLongLong() * 1024 * 1024;
+    config.storage.tempStore = parser.value(tempStoreOption);
+    config.storage.busyTimeoutMs = parser.value(busyTimeoutOption).toInt();
+    config.messageStore.backend = parser.value(messageStoreOption).compare("log", Qt::CaseInsensitive) == 0
+        ? MessageStoreConfig::Backend::Log : MessageStoreConfig::Backend::Sqlite;
+    config.messageStore.logDirectory = parser.value(messageLogOption);
+    config.messageStore.logShards = qMax(1, parser.value(logShardsOption).toInt());
+    config.messageStore.segmentBytes = qMax<qint64>(1, parser.value(logSegmentOption).toLongLong()) * 1024 * 1024;
+    config.messageStore.archive.maxAgeDays = parser.value(archiveAfterOption).toInt();
+    config.messageStore.archive.intervalSeconds = parser.value(archiveIntervalOption).toInt();
+    config.messageStore.archive.blockMessages = parser.value(archiveBlockOption).toInt();
+    config.messageStore.archive.compressionLevel = parser.value(archiveLevelOption).toInt();
+    config.connectionThreads = parser.value(ioThreadsOption).toInt();
+    config.compression.thresholdBytes = qMax(0, parser.value(compressThresholdOption).toInt());
+    config.compression.level = qBound(1, parser.value(compressLevelOption).toInt(), 9);
+    config.presenceIntervalMs = parser.value(presenceIntervalOption).toInt();
+    config.searchResultLimit = parser.value(searchLimitOption).toInt();
+    config.auth.iterations = parser.value(authIterationsOption).toInt();
+    config.auth.threads = parser.value(authThreadsOption).toInt();
+    config.auth.maxPending = parser.value(authQueueOption).toInt();
+    config.resumeTokenTtlSeconds = parser.value(resumeTtlOption).toInt();
+    config.metricsPort = parser.value(metricsPortOption).toInt();
+    config.traceFile = parser.value(traceFileOption);
+    config.trace = parser.isSet(traceOption) || !config.traceFile.isEmpty();
+    config.traceEventsPerThread = parser.value(traceBufferOption).toInt();
+
+    // Leave the event loop on Ctrl+C / SIGTERM so queued messages are
+    // committed by the destructors instead of being lost.
+    quitOnSignals(a, { SIGINT, SIGTERM });
+
+    int exitCode;
+    {
+        Server server(config);
+        exitCode = a.exec();
+    }
+
+    // After the Server is gone, so the final flush of every lane is included.
+    if (!config.traceFile.isEmpty())
+    {
+        if (Tracer::writeChromeTrace(config.traceFile))
+        {
+            qDebug() << "Trace written to" << config.traceFile;
+        } else {
+            qDebug() << "Failed to write trace to" << config.traceFile;
+        }
+    }
+    return exitCode;
 }
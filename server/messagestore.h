@@ -0,0 +1,104 @@
+#ifndef MESSAGESTORE_H
+#define MESSAGESTORE_H
+
+#include <QHash>
+#include <QString>
+#include <QVector>
+
+struct StoredMessage
+{
+    qint64 id = 0;
+    int chatId = 0;
+    int senderId = 0;
+    int recipientId = 0;
+    QString message;
+    // UTC, "yyyy-MM-dd HH:mm:ss".
+    QString timestamp;
+};
+
+// Messages older than maxAgeDays that reached their recipient are moved out
+// of the hot table into compressed per-chat blocks of blockMessages, at most
+// maxBlocksPerRun blocks every intervalSeconds. Archiving rewrites stored
+// rows, so it is off (0 days) unless asked for.
+struct ArchivePolicy
+{
+    int maxAgeDays = 0;
+    int intervalSeconds = 60;
+    int blockMessages = 256;
+    int maxBlocksPerRun = 64;
+    // zlib level, -1 for its default.
+    int compressionLevel = -1;
+};
+
+struct ArchiveStats
+{
+    qint64 blocks = 0;
+    qint64 messages = 0;
+    // Serialized size of the archived messages before and after compression.
+    qint64 rawBytes = 0;
+    qint64 storedBytes = 0;
+};
+
+// Where chat messages live. Users, chats and per-member watermarks stay in
+// SQLite whatever the backend; a store only keeps the messages themselves
+// and answers the range queries DatabaseManager builds on.
+//
+// Ids are assigned by the caller and appended in ascending order. Only the
+// writer lane appends; reads may come from any lane.
+class MessageStore
+{
+public:
+    virtual ~MessageStore() = default;
+
+    // Highest id stored, 0 when empty.
+    virtual qint64 lastMessageId() = 0;
+    virtual bool append(const QVector<StoredMessage> &messages) = 0;
+
+    // Up to limit messages of a chat with ids below beforeId (0 for the
+    // newest), oldest first. A negative limit reads the whole chat.
+    virtual QVector<StoredMessage> readChat(int chatId, qint64 beforeId, int limit) = 0;
+    // Up to limit messages of the given chats with ids above afterId, in id
+    // order.
+    virtual QVector<StoredMessage> readChatsAfter(const QVector<int> &chatIds, qint64 afterId, int limit) = 0;
+    // Messages addressed to recipientId with ids above afterId, in id order.
+    virtual QVector<StoredMessage> readForRecipient(int recipientId, qint64 afterId) = 0;
+
+    // Watermark support. Messages in chatId above afterId not sent by
+    // readerId, i.e. still unread once the reader's watermark is afterId.
+    virtual int countUnread(int chatId, int readerId, qint64 afterId) = 0;
+    // Per chat, the newest message addressed to recipientId with an id in
+    // (afterId, upToId]: where each delivered watermark moves to when the
+    // recipient's overall watermark goes from afterId to upToId.
+    virtual QHash<int, qint64> newestPerChat(int recipientId, qint64 afterId, qint64 upToId) = 0;
+
+    // Cold tier. Moves delivered messages stamped before cutoff out of the
+    // hot store and returns how many moved; reads keep returning them. Only
+    // delivered messages move, so reads above a delivered watermark never
+    // need the cold tier. Stores without one keep everything hot.
+    virtual int archive(const QString &cutoff, const ArchivePolicy &policy)
+    {
+        Q_UNUSED(cutoff);
+        Q_UNUSED(policy);
+        return 0;
+    }
+    virtual ArchiveStats archiveStats() { return ArchiveStats(); }
+};
+
+struct MessageStoreConfig
+{
+    enum class Backend
+    {
+        Sqlite,
+        Log
+    };
+
+    Backend backend = Backend::Sqlite;
+    // Log backend only.
+    QString logDirectory = "./messanger_log";
+    int logShards = 16;
+    qint64 segmentBytes = 64LL * 1024 * 1024;
+    // Sqlite backend only; the log is compact already.
+    ArchivePolicy archive;
+};
+
+#endif // MESSAGESTORE_H
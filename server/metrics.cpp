@@ -0,0 +1,228 @@
+#include "metrics.h"
+
+#include <QTextStream>
+
+namespace {
+// Bucket bounds exported to Prometheus; the fine-grained buckets are folded
+// into these, and quantiles are exported separately at full precision.
+const qint64 exportedBoundsMicros[] = {
+    50, 100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000,
+    100000, 250000, 500000, 1000000, 2500000, 5000000, 10000000
+};
+const double exportedQuantiles[] = { 0.5, 0.99, 0.999 };
+
+QString withLabel(const QString &labels, const QString &extra)
+{
+    return labels.isEmpty() ? extra : labels + "," + extra;
+}
+
+QString braced(const QString &labels)
+{
+    return labels.isEmpty() ? QString() : "{" + labels + "}";
+}
+
+QString seconds(qint64 micros)
+{
+    return QString::number(micros / 1e6, 'g', 9);
+}
+}
+
+void Histogram::record(qint64 micros)
+{
+    quint64 value = quint64(qMax<qint64>(0, micros));
+    buckets[bucketIndex(value)].fetch_add(1, std::memory_order_relaxed);
+    total.fetch_add(1, std::memory_order_relaxed);
+    sum.fetch_add(value, std::memory_order_relaxed);
+}
+
+quint64 Histogram::count() const
+{
+    return total.load(std::memory_order_relaxed);
+}
+
+quint64 Histogram::sumMicros() const
+{
+    return sum.load(std::memory_order_relaxed);
+}
+
+quint64 Histogram::countAtOrBelow(qint64 micros) const
+{
+    quint64 result = 0;
+    for (int i = 0; i < bucketCount && bucketUpperBound(i) <= quint64(micros); ++i)
+    {
+        result += buckets[i].load(std::memory_order_relaxed);
+    }
+    return result;
+}
+
+qint64 Histogram::quantile(double q) const
+{
+    quint64 samples = count();
+    if (samples == 0)
+    {
+        return 0;
+    }
+
+    quint64 rank = qMax<quint64>(1, quint64(q * samples + 0.5));
+    quint64 seen = 0;
+    for (int i = 0; i < bucketCount; ++i)
+    {
+        seen += buckets[i].load(std::memory_order_relaxed);
+        if (seen >= rank)
+        {
+            return qint64(bucketUpperBound(i));
+        }
+    }
+    return qint64(bucketUpperBound(bucketCount - 1));
+}
+
+int Histogram::bucketIndex(quint64 value)
+{
+    if (value < quint64(subBuckets))
+    {
+        return int(value);
+    }
+
+    // Position of the highest set bit picks the power of two; the next
+    // subBucketBits bits pick the linear sub-bucket inside it.
+    int exponent = 63;
+    while (!(value >> exponent))
+    {
+        --exponent;
+    }
+    int shift = exponent - subBucketBits;
+    int sub = int(value >> shift) - subBuckets;
+    return (shift + 1) * subBuckets + sub;
+}
+
+quint64 Histogram::bucketUpperBound(int index)
+{
+    if (index < subBuckets)
+    {
+        return quint64(index);
+    }
+
+    int shift = index / subBuckets - 1;
+    quint64 lower = quint64(subBuckets + index % subBuckets) << shift;
+    return lower + (quint64(1) << shift) - 1;
+}
+
+Metrics &Metrics::instance()
+{
+    static Metrics metrics;
+    return metrics;
+}
+
+Counter &Metrics::counter(const QString &name, const QString &help, const QString &labels)
+{
+    QMutexLocker locker(&mutex);
+    std::unique_ptr<Counter> &metric = family(name, help, Kind::Counter).counters[labels];
+    if (!metric)
+    {
+        metric.reset(new Counter);
+    }
+    return *metric;
+}
+
+Gauge &Metrics::gauge(const QString &name, const QString &help, const QString &labels)
+{
+    QMutexLocker locker(&mutex);
+    std::unique_ptr<Gauge> &metric = family(name, help, Kind::Gauge).gauges[labels];
+    if (!metric)
+    {
+        metric.reset(new Gauge);
+    }
+    return *metric;
+}
+
+Histogram &Metrics::histogram(const QString &name, const QString &help, const QString &labels)
+{
+    QMutexLocker locker(&mutex);
+    std::unique_ptr<Histogram> &metric = family(name, help, Kind::Histogram).histograms[labels];
+    if (!metric)
+    {
+        metric.reset(new Histogram);
+    }
+    return *metric;
+}
+
+Histogram &Metrics::dbOperation(const char *operation)
+{
+    return instance().histogram("qmessenger_db_operation_duration_seconds",
+                                "Time spent in DatabaseManager calls.",
+                                QString("op=\"%1\"").arg(QLatin1String(operation)));
+}
+
+QByteArray Metrics::renderPrometheus() const
+{
+    QMutexLocker locker(&mutex);
+
+    QString text;
+    QTextStream out(&text);
+
+    for (auto it = families.cbegin(); it != families.cend(); ++it)
+    {
+        const QString &name = it->first;
+        const Family &family = it->second;
+
+        switch (family.kind)
+        {
+        case Kind::Counter:
+            out << "# HELP " << name << " " << family.help << "\n# TYPE " << name << " counter\n";
+            for (const auto &metric : family.counters)
+            {
+                out << name << braced(metric.first) << " " << metric.second->get() << "\n";
+            }
+            break;
+        case Kind::Gauge:
+            out << "# HELP " << name << " " << family.help << "\n# TYPE " << name << " gauge\n";
+            for (const auto &metric : family.gauges)
+            {
+                out << name << braced(metric.first) << " " << metric.second->get() << "\n";
+            }
+            break;
+        case Kind::Histogram:
+            out << "# HELP " << name << " " << family.help << "\n# TYPE " << name << " histogram\n";
+            for (const auto &metric : family.histograms)
+            {
+                const Histogram &histogram = *metric.second;
+                for (qint64 bound : exportedBoundsMicros)
+                {
+                    out << name << "_bucket" << braced(withLabel(metric.first, QString("le=\"%1\"").arg(seconds(bound))))
+                        << " " << histogram.countAtOrBelow(bound) << "\n";
+                }
+                out << name << "_bucket" << braced(withLabel(metric.first, "le=\"+Inf\"")) << " " << histogram.count() << "\n"
+                    << name << "_sum" << braced(metric.first) << " " << seconds(qint64(histogram.sumMicros())) << "\n"
+                    << name << "_count" << braced(metric.first) << " " << histogram.count() << "\n";
+            }
+
+            out << "# HELP " << name << "_quantile " << family.help << " Quantiles from the full-resolution histogram.\n"
+                << "# TYPE " << name << "_quantile gauge\n";
+            for (const auto &metric : family.histograms)
+            {
+                for (double q : exportedQuantiles)
+                {
+                    out << name << "_quantile" << braced(withLabel(metric.first, QString("quantile=\"%1\"").arg(q)))
+                        << " " << seconds(metric.second->quantile(q)) << "\n";
+                }
+            }
+            break;
+        }
+    }
+
+    out.flush();
+    return text.toUtf8();
+}
+
+Metrics::Family &Metrics::family(const QString &name, const QString &help, Kind kind)
+{
+    auto it = families.find(name);
+    if (it == families.end())
+    {
+        Family family;
+        family.kind = kind;
+        family.help = help;
+        it = families.emplace(name, std::move(family)).first;
+    }
+    return it->second;
+}
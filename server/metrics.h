@@ -0,0 +1,110 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <QElapsedTimer>
+#include <QMutex>
+#include <QString>
+#include <atomic>
+#include <map>
+#include <memory>
+
+// Process-wide counters, gauges and latency histograms, rendered in the
+// Prometheus text format by MetricsServer.
+//
+// Looking a metric up takes a lock, so callers resolve it once and keep the
+// reference (metrics are never removed). Updating one is a relaxed atomic
+// add and safe from any thread.
+class Counter
+{
+public:
+    void add(quint64 n = 1) { value.fetch_add(n, std::memory_order_relaxed); }
+    quint64 get() const { return value.load(std::memory_order_relaxed); }
+
+private:
+    std::atomic<quint64> value { 0 };
+};
+
+class Gauge
+{
+public:
+    void set(qint64 v) { value.store(v, std::memory_order_relaxed); }
+    void add(qint64 n) { value.fetch_add(n, std::memory_order_relaxed); }
+    qint64 get() const { return value.load(std::memory_order_relaxed); }
+
+private:
+    std::atomic<qint64> value { 0 };
+};
+
+// HDR-style histogram of microsecond durations: every power of two is split
+// into 8 linear sub-buckets, so any recorded value is kept to within 12.5%
+// over the whole range with a fixed 4 KB of counters.
+class Histogram
+{
+public:
+    void record(qint64 micros);
+
+    quint64 count() const;
+    quint64 sumMicros() const;
+    quint64 countAtOrBelow(qint64 micros) const;
+    // Upper bound of the bucket holding the q-th fraction of samples.
+    qint64 quantile(double q) const;
+
+private:
+    static constexpr int subBucketBits = 3;
+    static constexpr int subBuckets = 1 << subBucketBits;
+    static constexpr int bucketCount = (64 - subBucketBits + 1) * subBuckets;
+
+    static int bucketIndex(quint64 value);
+    static quint64 bucketUpperBound(int index);
+
+    std::atomic<quint64> buckets[bucketCount] {};
+    std::atomic<quint64> total { 0 };
+    std::atomic<quint64> sum { 0 };
+};
+
+// Records the lifetime of the scope into a histogram.
+class MetricsTimer
+{
+public:
+    explicit MetricsTimer(Histogram &histogram) : histogram(histogram) { timer.start(); }
+    ~MetricsTimer() { histogram.record(timer.nsecsElapsed() / 1000); }
+
+private:
+    Histogram &histogram;
+    QElapsedTimer timer;
+};
+
+class Metrics
+{
+public:
+    static Metrics &instance();
+
+    // labels are Prometheus label pairs, already formatted: type="chat".
+    Counter &counter(const QString &name, const QString &help, const QString &labels = QString());
+    Gauge &gauge(const QString &name, const QString &help, const QString &labels = QString());
+    Histogram &histogram(const QString &name, const QString &help, const QString &labels = QString());
+
+    // Shorthands for the families the server records everywhere.
+    static Histogram &dbOperation(const char *operation);
+
+    QByteArray renderPrometheus() const;
+
+private:
+    enum class Kind { Counter, Gauge, Histogram };
+
+    struct Family
+    {
+        Kind kind;
+        QString help;
+        std::map<QString, std::unique_ptr<Counter>> counters;
+        std::map<QString, std::unique_ptr<Gauge>> gauges;
+        std::map<QString, std::unique_ptr<Histogram>> histograms;
+    };
+
+    mutable QMutex mutex;
+    std::map<QString, Family> families;
+
+    Family &family(const QString &name, const QString &help, Kind kind);
+};
+
+#endif // METRICS_H
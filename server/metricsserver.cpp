@@ -0,0 +1,87 @@
+#include "metricsserver.h"
+#include "metrics.h"
+#include "tracer.h"
+
+#include <QDebug>
+
+namespace {
+// Request line and headers of a scrape are tiny; anything bigger is junk.
+constexpr int maxRequestSize = 8192;
+}
+
+MetricsServer::MetricsServer(QObject *parent)
+    : QObject(parent)
+{
+    connect(&tcpServer, &QTcpServer::newConnection, this, &MetricsServer::slotNewConnection);
+}
+
+bool MetricsServer::listen(quint16 port)
+{
+    if (!tcpServer.listen(QHostAddress::LocalHost, port))
+    {
+        qDebug() << "Metrics endpoint failed to listen on port" << port << ":" << tcpServer.errorString();
+        return false;
+    }
+
+    qDebug() << "Metrics available at http://127.0.0.1:" << port << "/metrics";
+    return true;
+}
+
+void MetricsServer::slotNewConnection()
+{
+    while (QTcpSocket *socket = tcpServer.nextPendingConnection())
+    {
+        requests.insert(socket, QByteArray());
+        connect(socket, &QTcpSocket::readyRead, this, &MetricsServer::slotReadyRead);
+        connect(socket, &QTcpSocket::disconnected, this, [this, socket]() {
+            requests.remove(socket);
+            socket->deleteLater();
+        });
+    }
+}
+
+void MetricsServer::slotReadyRead()
+{
+    QTcpSocket *socket = qobject_cast<QTcpSocket*>(sender());
+    if (!socket || !requests.contains(socket))
+    {
+        return;
+    }
+
+    QByteArray &request = requests[socket];
+    request += socket->readAll();
+    if (request.size() > maxRequestSize)
+    {
+        respond(socket, "400 Bad Request", "text/plain", "Bad Request\n");
+        return;
+    }
+    if (!request.contains("\r\n\r\n"))
+    {
+        return;
+    }
+
+    QList<QByteArray> requestLine = request.left(request.indexOf("\r\n")).split(' ');
+    QByteArray path = requestLine.value(1).split('?').first();
+    if (requestLine.value(0) == "GET" && path == "/metrics")
+    {
+        respond(socket, "200 OK", "text/plain; version=0.0.4; charset=utf-8", Metrics::instance().renderPrometheus());
+    } else if (requestLine.value(0) == "GET" && path == "/trace" && Tracer::isEnabled()) {
+        respond(socket, "200 OK", "application/json", Tracer::renderChromeTrace());
+    } else {
+        respond(socket, "404 Not Found", "text/plain", "Not Found\n");
+    }
+}
+
+void MetricsServer::respond(QTcpSocket *socket, const QByteArray &status, const QByteArray &contentType,
+                            const QByteArray &body)
+{
+    requests.remove(socket);
+    disconnect(socket, &QTcpSocket::readyRead, this, &MetricsServer::slotReadyRead);
+
+    QByteArray response = "HTTP/1.1 " + status + "\r\n"
+                          "Content-Type: " + contentType + "\r\n"
+                          "Content-Length: " + QByteArray::number(body.size()) + "\r\n"
+                          "Connection: close\r\n\r\n" + body;
+    socket->write(response);
+    socket->disconnectFromHost();
+}
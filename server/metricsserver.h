@@ -0,0 +1,33 @@
+#ifndef METRICSSERVER_H
+#define METRICSSERVER_H
+
+#include <QObject>
+#include <QTcpServer>
+#include <QTcpSocket>
+#include <QHash>
+
+// Minimal HTTP endpoint answering GET /metrics with Metrics in the
+// Prometheus text format, and GET /trace with the Chrome trace recorded so
+// far while tracing is on. One request per connection; anything else is a
+// 404. Meant for a local scraper, so it binds to the loopback interface.
+class MetricsServer : public QObject
+{
+    Q_OBJECT
+
+public:
+    explicit MetricsServer(QObject *parent = nullptr);
+
+    bool listen(quint16 port);
+
+private slots:
+    void slotNewConnection();
+    void slotReadyRead();
+
+private:
+    QTcpServer tcpServer;
+    QHash<QTcpSocket*, QByteArray> requests;
+
+    void respond(QTcpSocket *socket, const QByteArray &status, const QByteArray &contentType, const QByteArray &body);
+};
+
+#endif // METRICSSERVER_H
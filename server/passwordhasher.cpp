@@ -0,0 +1,78 @@
+#include "passwordhasher.h"
+
+#include <QCryptographicHash>
+#include <QPasswordDigestor>
+#include <QRandomGenerator>
+#include <QStringList>
+
+namespace {
+const QString pbkdf2Scheme = QStringLiteral("pbkdf2-sha256");
+constexpr int derivedKeyLength = 32;
+constexpr int saltLength = 16;
+
+QByteArray derive(const QString &password, const QString &salt, int iterations)
+{
+    return QPasswordDigestor::deriveKeyPbkdf2(QCryptographicHash::Sha256, password.toUtf8(), salt.toUtf8(),
+                                              iterations, derivedKeyLength).toHex();
+}
+
+QByteArray legacyHash(const QString &password, const QString &salt)
+{
+    return QCryptographicHash::hash(password.toUtf8() + salt.toUtf8(), QCryptographicHash::Sha256).toHex();
+}
+
+// Compares without an early exit so response time does not reveal how much
+// of the digest matched.
+bool constantTimeEquals(const QByteArray &a, const QByteArray &b)
+{
+    if (a.size() != b.size())
+    {
+        return false;
+    }
+
+    char difference = 0;
+    for (qsizetype i = 0; i < a.size(); ++i)
+    {
+        difference |= a.at(i) ^ b.at(i);
+    }
+    return difference == 0;
+}
+
+int storedIterations(const QString &stored)
+{
+    const QStringList parts = stored.split('$');
+    if (parts.size() != 3 || parts.at(0) != pbkdf2Scheme)
+    {
+        return 0;
+    }
+    return parts.at(1).toInt();
+}
+}
+
+QString PasswordHasher::generateSalt()
+{
+    QByteArray salt(saltLength, Qt::Uninitialized);
+    QRandomGenerator::system()->fillRange(reinterpret_cast<quint32*>(salt.data()), saltLength / sizeof(quint32));
+    return QString::fromLatin1(salt.toHex());
+}
+
+QString PasswordHasher::hash(const QString &password, const QString &salt, int iterations)
+{
+    iterations = qMax(1, iterations);
+    return QString("%1$%2$%3").arg(pbkdf2Scheme).arg(iterations).arg(QString::fromLatin1(derive(password, salt, iterations)));
+}
+
+bool PasswordHasher::verify(const QString &password, const QString &salt, const QString &stored)
+{
+    int iterations = storedIterations(stored);
+    if (iterations > 0)
+    {
+        return constantTimeEquals(derive(password, salt, iterations), stored.section('$', 2).toLatin1());
+    }
+    return constantTimeEquals(legacyHash(password, salt), stored.toLatin1());
+}
+
+bool PasswordHasher::needsRehash(const QString &stored, int iterations)
+{
+    return storedIterations(stored) != qMax(1, iterations);
+}
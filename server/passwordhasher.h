@@ -0,0 +1,22 @@
+#ifndef PASSWORDHASHER_H
+#define PASSWORDHASHER_H
+
+#include <QByteArray>
+#include <QString>
+
+// Password hashes as stored in Users.Password. New hashes are PBKDF2-SHA256
+// written as "pbkdf2-sha256$<iterations>$<hex>"; anything else is the
+// original single SHA-256(password + salt) hex digest, still
+// accepted so existing accounts can log in and be upgraded.
+namespace PasswordHasher
+{
+QString generateSalt();
+QString hash(const QString &password, const QString &salt, int iterations);
+bool verify(const QString &password, const QString &salt, const QString &stored);
+
+// True when stored was produced by the legacy scheme or with a different
+// work factor than the one currently configured.
+bool needsRehash(const QString &stored, int iterations);
+}
+
+#endif // PASSWORDHASHER_H
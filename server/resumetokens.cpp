@@ -0,0 +1,72 @@
+#include "resumetokens.h"
+
+#include <QByteArray>
+#include <QDateTime>
+#include <QRandomGenerator>
+
+namespace {
+constexpr int tokenBytes = 16;
+// Expired tokens are only ever dropped on lookup otherwise.
+constexpr int sweepInterval = 1024;
+}
+
+ResumeTokenStore::ResumeTokenStore(int ttlSeconds)
+{
+    setTtl(ttlSeconds);
+}
+
+void ResumeTokenStore::setTtl(int ttlSeconds)
+{
+    ttlMs = qMax(1, ttlSeconds) * qint64(1000);
+}
+
+QString ResumeTokenStore::issue(const QString &login)
+{
+    if (++issuedSinceSweep >= sweepInterval)
+    {
+        removeExpired();
+    }
+
+    QByteArray bytes(tokenBytes, Qt::Uninitialized);
+    QRandomGenerator::system()->fillRange(reinterpret_cast<quint32*>(bytes.data()), tokenBytes / sizeof(quint32));
+    QString token = QString::fromLatin1(bytes.toHex());
+
+    Entry entry;
+    entry.login = login;
+    entry.expiresAt = QDateTime::currentMSecsSinceEpoch() + ttlMs;
+    tokens.insert(token, entry);
+    return token;
+}
+
+QString ResumeTokenStore::take(const QString &token)
+{
+    auto it = tokens.find(token);
+    if (it == tokens.end())
+    {
+        return QString();
+    }
+
+    Entry entry = it.value();
+    tokens.erase(it);
+    return entry.expiresAt > QDateTime::currentMSecsSinceEpoch() ? entry.login : QString();
+}
+
+void ResumeTokenStore::removeExpired()
+{
+    issuedSinceSweep = 0;
+    qint64 now = QDateTime::currentMSecsSinceEpoch();
+    for (auto it = tokens.begin(); it != tokens.end();)
+    {
+        if (it->expiresAt <= now)
+        {
+            it = tokens.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+int ResumeTokenStore::size() const
+{
+    return int(tokens.size());
+}
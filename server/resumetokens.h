@@ -0,0 +1,35 @@
+#ifndef RESUMETOKENS_H
+#define RESUMETOKENS_H
+
+#include <QHash>
+#include <QString>
+
+// Opaque tokens handed out at login that let a client reattach to its
+// account after a dropped connection without sending the password again.
+// Tokens are single-use: resuming consumes the token and issues a new one.
+class ResumeTokenStore
+{
+public:
+    explicit ResumeTokenStore(int ttlSeconds = 86400);
+
+    void setTtl(int ttlSeconds);
+    QString issue(const QString &login);
+    // Returns the login the token was issued to, or an empty string if it
+    // is unknown or expired. The token is invalid afterwards either way.
+    QString take(const QString &token);
+    void removeExpired();
+    int size() const;
+
+private:
+    struct Entry
+    {
+        QString login;
+        qint64 expiresAt = 0;
+    };
+
+    QHash<QString, Entry> tokens;
+    qint64 ttlMs;
+    int issuedSinceSweep = 0;
+};
+
+#endif // RESUMETOKENS_H
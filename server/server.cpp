@@ -1,167 +1,693 @@
 #include "server.h"
 #include <QFile>
 
-Server::Server(QObject *parent)
+namespace {
+// Messages per chat attached to the login response; older ones are fetched
+// page by page through get_history.
+constexpr int defaultHistoryPage = 50;
+constexpr int maxHistoryPage = 200;
+// A reconnect further behind than this falls back to per-chat history
+// requests instead of one large reply.
+constexpr int maxResumeMessages = 1000;
+// Request types get their own metrics; anything else is counted as
+// "unknown" so clients cannot grow the label set.
+const char *const requestTypes[] = {
+    "login", "registration", "resume", "chat", "get_history", "get_conversations",
+    "search_users", "get_online_status", "mark_as_read", "ack", "unknown"
+};
+// Candidates examined per search before ranking gives up on finding more
+// online users.
+constexpr int searchScanFactor = 8;
+}
+
+Server::Server(const ServerConfig &config, QObject *parent)
     : QObject(parent),
     webSocketServer(new QWebSocketServer(QStringLiteral("Chat Server"), QWebSocketServer::NonSecureMode, this)),
-    dbManager()
+    dbExecutor(config.dbReaderThreads, config.flushPolicy, config.databasePath, config.storage,
+               config.messageStore),
+    authService(dbExecutor, config.auth),
+    resumeTokens(config.resumeTokenTtlSeconds)
 {
+    for (const char *type : requestTypes)
+    {
+        QString labels = QString("type=\"%1\"").arg(QLatin1String(type));
+        RequestMetrics metrics;
+        metrics.name = type;
+        metrics.received = &Metrics::instance().counter("qmessenger_requests_total",
+                                                        "Requests received, by message type.", labels);
+        metrics.dispatchTime = &Metrics::instance().histogram("qmessenger_request_dispatch_duration_seconds",
+                                                              "Server thread time spent dispatching a request, "
+                                                              "excluding the database and auth work it queues.",
+                                                              labels);
+        requestMetrics.insert(QLatin1String(type), metrics);
+    }
+    connectedSockets = &Metrics::instance().gauge("qmessenger_connected_sockets", "Open WebSocket connections.");
+
+    if (config.trace)
+    {
+        Tracer::enable(config.traceEventsPerThread);
+    }
+
+    startShards(config.connectionThreads, config.compression);
+
+    if (config.metricsPort > 0)
+    {
+        metricsServer.listen(quint16(config.metricsPort));
+    }
+
+    searchResultLimit = qMax(1, config.searchResultLimit);
+    dbExecutor.read([](DatabaseManager &db) {
+        return db.getAllLogins();
+    }, this, [this](const QStringList &logins) {
+        userIndex.load(logins);
+        qDebug() << "User search index loaded:" << userIndex.size() << "logins";
+    });
+
+    presenceTimer.setSingleShot(true);
+    presenceTimer.setInterval(qMax(0, config.presenceIntervalMs));
+    connect(&presenceTimer, &QTimer::timeout, this, &Server::flushPresence);
+
     if (webSocketServer->listen(QHostAddress::Any, 1111))
     {
-        qDebug() << "Server started";
+        qDebug() << "Server started with" << shards.size() << "connection shard(s)";
         connect(webSocketServer, &QWebSocketServer::newConnection, this, &Server::slotNewConnection);
 
     } 
 }
 
-void Server::slotNewConnection()
+Server::~Server()
 {
-    QWebSocket *socket = webSocketServer->nextPendingConnection();
-    if (!socket)
+    // dbExecutor is destroyed after this and commits any queued messages.
+    webSocketServer->close();
+    stopShards();
+}
+
+void Server::startShards(int threadCount, const CompressionPolicy &compression)
+{
+    // Without worker threads a single shard runs on this thread, which is
+    // the original single-threaded behaviour.
+    if (threadCount <= 0)
+    {
+        ConnectionShard *shard = new ConnectionShard(0, compression, this);
+        connect(shard, &ConnectionShard::messageReceived, this, &Server::slotMessageReceived);
+        connect(shard, &ConnectionShard::connectionClosed, this, &Server::slotConnectionClosed);
+        shards.append(shard);
+        shardLoad.append(0);
+        return;
+    }
+
+    for (int i = 0; i < threadCount; ++i)
+    {
+        QThread *thread = new QThread(this);
+        thread->setObjectName(QString("shard-%1").arg(i));
+
+        ConnectionShard *shard = new ConnectionShard(i, compression);
+        shard->moveToThread(thread);
+        connect(thread, &QThread::finished, shard, &QObject::deleteLater);
+        connect(shard, &ConnectionShard::messageReceived, this, &Server::slotMessageReceived);
+        connect(shard, &ConnectionShard::connectionClosed, this, &Server::slotConnectionClosed);
+
+        thread->start();
+        shards.append(shard);
+        shardThreads.append(thread);
+        shardLoad.append(0);
+    }
+}
+
+void Server::stopShards()
+{
+    for (ConnectionShard *shard : std::as_const(shards))
+    {
+        if (shard->thread() == thread())
+        {
+            shard->closeAll();
+            continue;
+        }
+
+        QMetaObject::invokeMethod(shard, [shard]() {
+            shard->closeAll();
+        }, Qt::BlockingQueuedConnection);
+    }
+    shards.clear();
+
+    for (QThread *shardThread : std::as_const(shardThreads))
+    {
+        shardThread->quit();
+        shardThread->wait();
+    }
+    shardThreads.clear();
+}
+
+ConnectionShard *Server::shardFor(ConnectionId connection) const
+{
+    // Connection ids encode their shard: serial * shardCount + shardIndex.
+    if (shards.isEmpty())
+    {
+        return nullptr;
+    }
+    return shards.value(int(connection % quint64(shards.size())), nullptr);
+}
+
+void Server::sendTo(ConnectionId connection, const QJsonObject &message)
+{
+    ConnectionShard *shard = shardFor(connection);
+    if (!shard || !connections.contains(connection))
     {
         return;
     }
 
-    connect(socket, &QWebSocket::textMessageReceived, this, &Server::slotTextMessageReceived);
-    connect(socket, &QWebSocket::disconnected, this, &Server::slotDisconnected);
+    if (shard->thread() == thread())
+    {
+        shard->send(connection, message);
+        return;
+    }
 
+    TraceContext trace = Tracer::currentContext();
+    QMetaObject::invokeMethod(shard, [shard, connection, message, trace]() {
+        TraceContextScope traceScope(trace);
+        shard->send(connection, message);
+    }, Qt::QueuedConnection);
 }
 
-void Server::slotTextMessageReceived(const QString &message)
+void Server::slotNewConnection()
 {
-    QWebSocket *socket = qobject_cast<QWebSocket*>(sender());
+    QWebSocket *socket = webSocketServer->nextPendingConnection();
     if (!socket)
     {
         return;
     }
 
-    QJsonDocument docJson = QJsonDocument::fromJson(message.toUtf8());
-    if (!docJson.isObject())
+    // Least-loaded shard takes the connection.
+    int shardIndex = 0;
+    for (int i = 1; i < shardLoad.size(); ++i)
+    {
+        if (shardLoad[i] < shardLoad[shardIndex])
+        {
+            shardIndex = i;
+        }
+    }
+
+    ConnectionShard *shard = shards[shardIndex];
+    ConnectionId connection = nextConnectionSerial++ * quint64(shards.size()) + quint64(shardIndex);
+    connections.insert(connection);
+    ++shardLoad[shardIndex];
+    connectedSockets->add(1);
+
+    if (shard->thread() == thread())
     {
+        shard->adopt(connection, socket);
         return;
     }
 
-    QJsonObject jsonObj = docJson.object();
+    socket->setParent(nullptr);
+    socket->moveToThread(shard->thread());
+    QMetaObject::invokeMethod(shard, [shard, connection, socket]() {
+        shard->adopt(connection, socket);
+    }, Qt::QueuedConnection);
+}
+
+void Server::slotMessageReceived(quint64 connection, const QJsonObject &message)
+{
+    if (!connections.contains(connection))
+    {
+        return;
+    }
+
+    QJsonObject jsonObj = message;
     QString typeMessage = jsonObj["type"].toString();
 
+    auto metrics = requestMetrics.constFind(typeMessage);
+    if (metrics == requestMetrics.constEnd())
+    {
+        metrics = requestMetrics.constFind("unknown");
+    }
+    metrics->received->add();
+    MetricsTimer timer(*metrics->dispatchTime);
+
+    // Everything done on behalf of this request, on any thread, is tagged
+    // with its id in the trace.
+    TraceContext trace;
+    if (Tracer::isEnabled())
+    {
+        trace.connection = connection;
+        trace.request = Tracer::nextRequestId();
+    }
+    TraceContextScope traceScope(trace);
+    TraceSpan span(metrics->name, "handler");
+
     if (typeMessage == "login") 
     {
-        handleLogin(socket, jsonObj);
+        handleLogin(connection, jsonObj);
     } else if (typeMessage == "registration") {
-        handleRegistration(socket, jsonObj);
+        handleRegistration(connection, jsonObj);
+    } else if (typeMessage == "resume") {
+        handleResume(connection, jsonObj);
     } else if (typeMessage == "chat") {
-        handleChatMessage(socket, jsonObj);
+        handleChatMessage(connection, jsonObj);
+    } else if (typeMessage == "get_history") {
+        handleGetHistory(connection, jsonObj);
+    } else if (typeMessage == "get_conversations") {
+        handleGetConversations(connection, jsonObj);
     } else if (typeMessage == "search_users") {
-        sendMessageToClients(jsonObj, socket);
+        handleSearchUsers(connection, jsonObj);
     } else if (typeMessage == "get_online_status") {
+        // Asking for someone's status subscribes to their later changes.
+        watchPresence(sessions.loginFor(connection), jsonObj["message"].toString());
         jsonObj["online"] = checkOnlineStatus(jsonObj["message"].toString());
-        sendMessageToClients(jsonObj, socket);
+        sendMessageToClients(jsonObj, connection);
     } else if (typeMessage == "mark_as_read") {
-        dbManager.markMessagesAsRead(jsonObj["from"].toString(), jsonObj["to"].toString());
+        // Only the connection's own user can be the reader.
+        QString from = sessions.loginFor(connection);
+        QString to = jsonObj["to"].toString();
+        qint64 upToId = jsonObj["msg_id"].toVariant().toLongLong();
+        if (from.isEmpty())
+        {
+            return;
+        }
+        dbExecutor.write([from, to, upToId](DatabaseManager &db) {
+            db.markMessagesAsRead(from, to, upToId);
+        });
     } else if (typeMessage == "ack") {
-        dbManager.markMessagesAsRead(jsonObj["from"].toString(), jsonObj["to"].toString(), jsonObj["msg_id"].toString());
+        // Acks are cumulative: messages reach a recipient in id order.
+        QString login = sessions.loginFor(connection);
+        qint64 msgId = jsonObj["msg_id"].toVariant().toLongLong();
+        dbExecutor.write([login, msgId](DatabaseManager &db) {
+            db.markDelivered(login, msgId);
+        });
     } 
 }
 
-void Server::handleLogin(QWebSocket* socket, const QJsonObject &jsonObj)
+void Server::handleLogin(ConnectionId connection, const QJsonObject &jsonObj)
 {
-    if (!socket || jsonObj["login"].toString().isEmpty() || jsonObj["password"].toString().isEmpty()) 
+    if (jsonObj["login"].toString().isEmpty() || jsonObj["password"].toString().isEmpty()) 
     {
         return;
     }
 
-    bool statusLogin = dbManager.checkUserPassword(jsonObj["login"].toString(), jsonObj["password"].toString());
+    QString login = jsonObj["login"].toString();
+    QString password = jsonObj["password"].toString();
+
+    bool accepted = authService.authenticate(login, password, [this, connection, jsonObj, login](bool statusLogin) {
+        if (!connections.contains(connection))
+        {
+            return;
+        }
+
+        if (!statusLogin)
+        {
+            sendMessageToClients(jsonObj, connection, false);
+            return;
+        }
 
-    if(statusLogin)
+        startSession(connection, login);
+
+        // The conversation list is read on the writer lane so it includes
+        // messages still waiting in the write-behind queue.
+        dbExecutor.write([login](DatabaseManager &db) {
+            return db.getConversations(login);
+        }, this, [this, connection, jsonObj, login](QJsonArray conversations) {
+            if (!connections.contains(connection))
+            {
+                return;
+            }
+            annotatePresence(conversations, "login");
+            for (const QJsonValue &conversation : std::as_const(conversations))
+            {
+                watchPresence(login, conversation.toObject()["login"].toString());
+            }
+            sendMessageToClients(jsonObj, connection, true, conversations);
+        });
+
+        // Queued right behind the summary so it arrives after it, and ahead
+        // of any message routed to this connection from now on.
+        deliverPending(connection, login);
+    });
+
+    if (!accepted)
     {
-        clients.insert(socket, jsonObj["login"].toString());
-        notifyAllClients(jsonObj["login"].toString(), socket, "TRUE");
+        rejectBusy(connection, jsonObj);
     }
-    sendMessageToClients(jsonObj, socket, statusLogin);
 }
 
 
 
-void Server::handleRegistration(QWebSocket* socket, const QJsonObject &jsonObj)
+void Server::handleRegistration(ConnectionId connection, const QJsonObject &jsonObj)
 {
-    if (!socket || jsonObj["login"].toString().isEmpty() || jsonObj["password"].toString().isEmpty()) 
+    if (jsonObj["login"].toString().isEmpty() || jsonObj["password"].toString().isEmpty()) 
     {
         return;
     }
 
-    bool statusRegistartion = dbManager.registrateNewClients(jsonObj["login"].toString(), jsonObj["password"].toString());
-    clients.insert(socket, jsonObj["login"].toString());
-    sendMessageToClients(jsonObj, socket, statusRegistartion);
-    if(statusRegistartion)
+    QString login = jsonObj["login"].toString();
+    QString password = jsonObj["password"].toString();
+
+    bool accepted = authService.registerUser(login, password, [this, connection, jsonObj, login](bool statusRegistartion) {
+        if (!connections.contains(connection))
+        {
+            return;
+        }
+
+        sendMessageToClients(jsonObj, connection, statusRegistartion);
+        if(statusRegistartion)
+        {
+            userIndex.insert(login);
+            startSession(connection, login);
+        }
+    });
+
+    if (!accepted)
     {
-        clients.insert(socket, jsonObj["login"].toString());
-        notifyAllClients(jsonObj["login"].toString(), socket, "TRUE");
+        rejectBusy(connection, jsonObj);
+    }
+}
 
+void Server::handleResume(ConnectionId connection, const QJsonObject &jsonObj)
+{
+    QString login = resumeTokens.take(jsonObj["resume_token"].toString());
+    if (login.isEmpty() || login != jsonObj["login"].toString())
+    {
+        sendMessageToClients(jsonObj, connection, false);
+        return;
     }
+
+    startSession(connection, login);
+    sendResumeDelta(connection, jsonObj, login, jsonObj["last_msg_id"].toVariant().toLongLong());
 }
 
-void Server::handleChatMessage(QWebSocket *socket, const QJsonObject &jsonObj)
+void Server::sendResumeDelta(ConnectionId connection, const QJsonObject &jsonObj, const QString &login,
+                             qint64 afterId)
 {
-    QString toLogin = jsonObj["to"].toString();
-    QWebSocket *recipientSocket = clients.key(toLogin, nullptr);
+    dbExecutor.write([login, afterId](DatabaseManager &db) {
+        bool truncated = false;
+        QJsonArray chats = db.getMessagesSince(login, afterId, maxResumeMessages, &truncated);
+        return qMakePair(chats, truncated);
+    }, this, [this, connection, jsonObj, login](const QPair<QJsonArray, bool> &delta) {
+        if (!connections.contains(connection))
+        {
+            return;
+        }
 
-    dbManager.addMessage(jsonObj["from"].toString(), jsonObj["to"].toString(), jsonObj["message"].toString());
+        QJsonArray chats = delta.first;
+        annotatePresence(chats, "otherUser");
+        qint64 newestId = 0;
+        for (const QJsonValue &chat : std::as_const(chats))
+        {
+            QJsonObject chatObj = chat.toObject();
+            watchPresence(login, chatObj["otherUser"].toString());
+            const QJsonArray messages = chatObj["messages"].toArray();
+            for (const QJsonValue &message : messages)
+            {
+                newestId = qMax(newestId, message.toObject()["id"].toVariant().toLongLong());
+            }
+        }
 
-    if (recipientSocket) 
+        QJsonObject request = jsonObj;
+        request["has_more"] = delta.second;
+        sendMessageToClients(request, connection, true, chats);
+
+        // Pages are cut by id, so the next one starts after the newest
+        // message sent; the client acks each page as it arrives.
+        if (delta.second && newestId > 0)
+        {
+            sendResumeDelta(connection, jsonObj, login, newestId);
+        }
+    });
+}
+
+void Server::rejectBusy(ConnectionId connection, const QJsonObject &jsonIncoming)
+{
+    QJsonObject response;
+    response["type"] = jsonIncoming["type"];
+    response["to"] = jsonIncoming["login"];
+    response["status"] = "fail";
+    response["message"] = "Server is busy, please try again";
+    sendTo(connection, response);
+}
+
+void Server::handleChatMessage(ConnectionId connection, const QJsonObject &jsonObj)
+{
+    // The sender is whoever the connection logged in as, whatever the frame
+    // claims.
+    QString from = sessions.loginFor(connection);
+    QString toLogin = jsonObj["to"].toString();
+    QString message = jsonObj["message"].toString();
+    if (from.isEmpty())
     {
-        sendMessageToClients(jsonObj, socket);
-    } 
+        return;
+    }
+
+    // Decided now, in queue order: a recipient that connects later gets the
+    // message from its pending-delivery push instead.
+    const QList<ConnectionId> recipients = sessions.connectionsFor(toLogin);
+
+    dbExecutor.write([from, toLogin, message](DatabaseManager &db) {
+        return db.addMessage(from, toLogin, message);
+    }, this, [this, connection, recipients, from, toLogin, message](qint64 msgId) {
+        if (!msgId)
+        {
+            if (connections.contains(connection))
+            {
+                QJsonObject failed;
+                failed["type"] = "chat";
+                failed["from"] = toLogin;
+                failed["to"] = from;
+                failed["status"] = "fail";
+                failed["message"] = "Message could not be stored, please try again";
+                sendTo(connection, failed);
+            }
+            return;
+        }
+
+        // Accepted, so the sender can show it as sent whether or not the
+        // recipient is online; the text identifies which message it was.
+        // The ack means the message holds its id in the writer's queue, not
+        // that its batch has committed: a failed commit is retried with the
+        // same ids, but a crash before it loses the message.
+        if (connections.contains(connection))
+        {
+            QJsonObject ack;
+            ack["type"] = "ack";
+            ack["to"] = from;
+            ack["with"] = toLogin;
+            ack["message"] = message;
+            ack["msg_id"] = msgId;
+            sendTo(connection, ack);
+        }
+
+        // A new conversation makes both sides contacts of each other. The
+        // sender watches the recipient even while they are offline, so they
+        // hear when the recipient comes online; an offline recipient
+        // subscribes from its conversation list when it logs in. Watches are
+        // only held for users online now, as they are dropped on logout.
+        if (sessions.isOnline(from))
+        {
+            watchPresence(from, toLogin);
+        }
+        if (sessions.isOnline(toLogin))
+        {
+            watchPresence(toLogin, from);
+        }
+
+        if (recipients.isEmpty())
+        {
+            return;
+        }
+
+        // Every session of the recipient gets it. They may be owned by other
+        // shards; sendTo() hands the frame over to whichever thread runs
+        // each socket.
+        QJsonObject delivered;
+        delivered["type"] = "chat";
+        delivered["from"] = from;
+        delivered["to"] = toLogin;
+        delivered["message"] = message;
+        delivered["msg_id"] = msgId;
+        delivered["status"] = "success";
+        for (ConnectionId recipient : recipients)
+        {
+            if (connections.contains(recipient))
+            {
+                sendTo(recipient, delivered);
+            }
+        }
+    });
 }
 
-QString Server::checkOnlineStatus(const QString &login)
+void Server::deliverPending(ConnectionId connection, const QString &login)
+{
+    dbExecutor.write([login](DatabaseManager &db) {
+        return db.getPendingMessages(login);
+    }, this, [this, connection, login](const QJsonArray &pending) {
+        if (!connections.contains(connection))
+        {
+            return;
+        }
+
+        for (const QJsonValue &value : pending)
+        {
+            QJsonObject pendingMessage = value.toObject();
+            QJsonObject response;
+            response["type"] = "chat";
+            response["from"] = pendingMessage["sender"];
+            response["to"] = login;
+            response["message"] = pendingMessage["message"];
+            response["msg_id"] = pendingMessage["id"];
+            response["timestamp"] = pendingMessage["timestamp"];
+            response["status"] = "success";
+            sendTo(connection, response);
+        }
+    });
+}
+
+void Server::handleGetHistory(ConnectionId connection, const QJsonObject &jsonObj)
 {
-   for (auto it = clients.begin(); it != clients.end(); ++it) 
-   {
-        if (it.value() == login) 
+    QString login = sessions.loginFor(connection);
+    if (login.isEmpty())
+    {
+        return;
+    }
+
+    QString partner = jsonObj["to"].toString();
+    int limit = qBound(1, jsonObj["limit"].toInt(defaultHistoryPage), maxHistoryPage);
+    qint64 beforeId = jsonObj["before_id"].toVariant().toLongLong();
+
+    QJsonObject request = jsonObj;
+    request["login"] = login;
+    request["limit"] = limit;
+
+    auto call = [login, partner, beforeId, limit](DatabaseManager &db) {
+        return db.getHistory(login, partner, beforeId, limit);
+    };
+    auto done = [this, connection, request](const QJsonArray &messages) {
+        if (connections.contains(connection))
         {
-            return "TRUE";
+            sendMessageToClients(request, connection, true, messages);
         }
+    };
+
+    // A page strictly older than a committed message holds only committed
+    // rows, so any reader can serve it. The first page may include messages
+    // still queued on the writer.
+    if (beforeId > 0 && beforeId <= dbExecutor.committedMessageId())
+    {
+        dbExecutor.read(call, this, done);
+    } else {
+        dbExecutor.write(call, this, done);
     }
-    return "FALSE";
 }
 
+void Server::handleGetConversations(ConnectionId connection, const QJsonObject &jsonObj)
+{
+    QString login = sessions.loginFor(connection);
+    if (login.isEmpty())
+    {
+        return;
+    }
+
+    QJsonObject request = jsonObj;
+    request["login"] = login;
 
+    dbExecutor.write([login](DatabaseManager &db) {
+        return db.getConversations(login);
+    }, this, [this, connection, request](QJsonArray conversations) {
+        if (!connections.contains(connection))
+        {
+            return;
+        }
+        annotatePresence(conversations, "login");
+        sendMessageToClients(request, connection, true, conversations);
+    });
+}
 
-void Server::slotDisconnected()
+void Server::handleSearchUsers(ConnectionId connection, const QJsonObject &jsonObj)
 {
-    QWebSocket *socket = qobject_cast<QWebSocket*>(sender());
-    if (!socket)
+    QString login = jsonObj["login"].toString();
+    QString letters = jsonObj["message"].toString();
+
+    if (userIndex.isLoaded())
     {
+        int limit = qBound(1, jsonObj["limit"].toInt(searchResultLimit), searchResultLimit);
+        const QVector<UserIndex::Match> matches = userIndex.search(letters, login, limit, limit * searchScanFactor,
+            [this](const QString &candidate) { return sessions.isOnline(candidate); });
+
+        QJsonArray users;
+        for (const UserIndex::Match &match : matches)
+        {
+            QJsonObject user;
+            user["login"] = match.login;
+            user["online"] = match.online ? "TRUE" : "FALSE";
+            users.append(user);
+        }
+        sendMessageToClients(jsonObj, connection, true, users);
         return;
     }
-    
-    if (clients.contains(socket)) 
+
+    // Only while the index is still loading at startup.
+    dbExecutor.read([login, letters](DatabaseManager &db) {
+        return db.getUsersByName(login, letters);
+    }, this, [this, connection, jsonObj](QJsonArray users) {
+        if (!connections.contains(connection))
+        {
+            return;
+        }
+        annotatePresence(users, "login");
+        sendMessageToClients(jsonObj, connection, true, users);
+    });
+}
+
+void Server::annotatePresence(QJsonArray &entries, const QString &loginKey) const
+{
+    for (int i = 0; i < entries.size(); ++i)
     {
-        notifyAllClients(clients[socket], socket, "FALSE");
-        clients.remove(socket);
+        QJsonObject entry = entries[i].toObject();
+        entry["online"] = sessions.isOnline(entry[loginKey].toString()) ? "TRUE" : "FALSE";
+        entries[i] = entry;
     }
-    socket->deleteLater();
 }
 
-QJsonArray Server::getOnlineClientsList(QWebSocket *socket) 
+QString Server::checkOnlineStatus(const QString &login)
 {
-    QJsonArray onlineClients;
+    return sessions.isOnline(login) ? "TRUE" : "FALSE";
+}
+
 
-    for (auto it = clients.begin(); it != clients.end(); ++it) 
+
+void Server::slotConnectionClosed(quint64 connection)
+{
+    ConnectionShard *shard = shardFor(connection);
+    if (!connections.remove(connection) || !shard)
     {
-        if (socket != it.key())
+        return;
+    }
+    --shardLoad[shard->index()];
+    connectedSockets->add(-1);
+
+    if (sessions.contains(connection)) 
+    {
+        QString login = sessions.loginFor(connection);
+        sessions.remove(connection);
+        if (!sessions.isOnline(login))
         {
-            QJsonObject client;
-            client["login"] = it.value();
-            onlineClients.append(client);
+            unwatchAll(login);
+            publishPresence(login, false);
         }
     }
+}
 
-    return onlineClients;
+void Server::startSession(ConnectionId connection, const QString &login)
+{
+    bool wasOnline = sessions.isOnline(login);
+    sessions.insert(connection, login);
+    if (!wasOnline)
+    {
+        publishPresence(login, true);
+    }
 }
 
-void Server::sendMessageToClients(const QJsonObject &jsonIncoming, QWebSocket *socket, bool status)
+void Server::sendMessageToClients(const QJsonObject &jsonIncoming, ConnectionId connection, bool status,
+                                  const QJsonArray &payload)
 {
+    TraceSpan span("build_response", "handler");
     QString messageType = jsonIncoming["type"].toString();
 
     QJsonObject response;
@@ -175,7 +701,8 @@ void Server::sendMessageToClients(const QJsonObject &jsonIncoming, QWebSocket *s
 
         if (status)
         {
-            response["history_messages"] = dbManager.getMessages(jsonIncoming["login"].toString(), clients);
+            response["conversations"] = payload;
+            response["resume_token"] = resumeTokens.issue(jsonIncoming["login"].toString());
         }
 
     } else if (messageType == "registration") {
@@ -183,53 +710,131 @@ void Server::sendMessageToClients(const QJsonObject &jsonIncoming, QWebSocket *s
         response["to"] = jsonIncoming["login"];
         response["status"] = status ? "success" : "fail";
         response["message"] = status ? "Registration successful" : "Login is used, please try again";
-    } else if (messageType == "chat") {
-        response["type"] = "chat";
-        response["from"] = jsonIncoming["from"];
-        response["to"] = jsonIncoming["to"];
-        response["message"] = jsonIncoming["message"];
-        
-        QWebSocket *tempSocket = clients.key(response["to"].toString(), nullptr);
-        if (tempSocket)
+
+        if (status)
         {
-            socket = tempSocket;
-            response["status"] = "success";
+            response["resume_token"] = resumeTokens.issue(jsonIncoming["login"].toString());
+        }
+    } else if (messageType == "resume") {
+        response["type"] = "resume";
+        response["to"] = jsonIncoming["login"];
+        response["status"] = status ? "success" : "fail";
+
+        if (status)
+        {
+            response["history_messages"] = payload;
+            response["has_more"] = jsonIncoming["has_more"];
+            if (!jsonIncoming["has_more"].toBool())
+            {
+                response["resume_token"] = resumeTokens.issue(jsonIncoming["login"].toString());
+            }
         } else {
-            response["status"] = "fail";
-            response["message"] = "Client not found!";
+            response["message"] = "Session expired, please log in again";
         }
+    } else if (messageType == "get_conversations") {
+        response["type"] = "get_conversations";
+        response["to"] = jsonIncoming["login"];
+        response["conversations"] = payload;
+    } else if (messageType == "get_history") {
+        response["type"] = "get_history";
+        response["to"] = jsonIncoming["login"];
+        response["with"] = jsonIncoming["to"];
+        response["before_id"] = jsonIncoming["before_id"].toVariant().toLongLong();
+        response["has_more"] = payload.size() == jsonIncoming["limit"].toInt();
+        response["messages"] = payload;
     } else if (messageType == "search_users") {
         response["type"] = "search_users";
         response["to"] = jsonIncoming["login"];
-        response["clients"] = dbManager.getUsersByName(clients, jsonIncoming["login"].toString(), jsonIncoming["message"].toString());
+        response["clients"] = payload;
     } else if (messageType == "get_online_status") {
         response["type"] = "get_online_status";
         response["to"] = jsonIncoming["login"];
         response["online"] = jsonIncoming["online"];
         response["message"] = jsonIncoming["message"];
     } 
-    QJsonDocument doc(response);
-    socket->sendTextMessage(QString::fromUtf8(doc.toJson(QJsonDocument::Compact)));
+    sendTo(connection, response);
 }
 
-void Server::notifyAllClients(const QString &newClientLogin, QWebSocket *socket, const QString &status) 
+void Server::watchPresence(const QString &watcher, const QString &target)
 {
-    QJsonObject notification;
-    notification["type"] = "update_clients";
-    notification["login"] = newClientLogin;
-    notification["online"] = status;
-
-    QJsonDocument doc(notification);
-    QString message = QString::fromUtf8(doc.toJson(QJsonDocument::Compact));
+    if (watcher.isEmpty() || target.isEmpty() || watcher == target)
+    {
+        return;
+    }
+    presenceWatchers[target].insert(watcher);
+    presenceSubscriptions[watcher].insert(target);
+}
 
-    for (QWebSocket *clientSocket : clients.keys()) 
+void Server::unwatchAll(const QString &watcher)
+{
+    const QSet<QString> targets = presenceSubscriptions.take(watcher);
+    for (const QString &target : targets)
     {
-        if (clientSocket && clientSocket != socket) 
+        auto it = presenceWatchers.find(target);
+        if (it != presenceWatchers.end())
         {
-            clientSocket->sendTextMessage(message);
-        } 
+            it->remove(watcher);
+            if (it->isEmpty())
+            {
+                presenceWatchers.erase(it);
+            }
+        }
     }
+    pendingPresence.remove(watcher);
 }
 
+void Server::publishPresence(const QString &login, bool online)
+{
+    auto it = presenceWatchers.constFind(login);
+    if (it == presenceWatchers.constEnd())
+    {
+        return;
+    }
+
+    for (const QString &watcher : *it)
+    {
+        // A later change within the same interval overwrites an earlier one.
+        pendingPresence[watcher].insert(login, online);
+    }
 
+    if (!presenceTimer.isActive())
+    {
+        presenceTimer.start();
+    }
+}
 
+void Server::flushPresence()
+{
+    for (auto it = pendingPresence.constBegin(); it != pendingPresence.constEnd(); ++it)
+    {
+        const QList<ConnectionId> watcherConnections = sessions.connectionsFor(it.key());
+        if (watcherConnections.isEmpty())
+        {
+            continue;
+        }
+
+        QJsonArray changes;
+        for (auto change = it->constBegin(); change != it->constEnd(); ++change)
+        {
+            QJsonObject client;
+            client["login"] = change.key();
+            client["online"] = change.value() ? "TRUE" : "FALSE";
+            changes.append(client);
+        }
+
+        QJsonObject notification;
+        notification["type"] = "update_clients";
+        notification["changes"] = changes;
+        if (changes.size() == 1)
+        {
+            // Single changes keep the old flat shape for older clients.
+            notification["login"] = changes[0].toObject()["login"];
+            notification["online"] = changes[0].toObject()["online"];
+        }
+        for (ConnectionId connection : watcherConnections)
+        {
+            sendTo(connection, notification);
+        }
+    }
+    pendingPresence.clear();
+}
@@ -19,32 +19,90 @@
 #include <QJsonObject>
 #include <QJsonArray>
 #include <QJsonValue>
-#include "databasemanager.h"
+#include <QThread>
+#include <QSet>
+#include <QTimer>
+#include "authservice.h"
+#include "connectionshard.h"
+#include "dbexecutor.h"
+#include "metrics.h"
+#include "metricsserver.h"
+#include "resumetokens.h"
+#include "sessionregistry.h"
+#include "tracer.h"
+#include "userindex.h"
+#include "serverconfig.h"
 
 class Server : public QObject
 {
     Q_OBJECT
 
 public:
-    explicit Server(QObject *parent = nullptr);
+    explicit Server(const ServerConfig &config, QObject *parent = nullptr);
     ~Server();
 
 private slots:
     void slotNewConnection();
-    void slotDisconnected();
-    void slotTextMessageReceived(const QString &message);
+    void slotConnectionClosed(quint64 connection);
+    void slotMessageReceived(quint64 connection, const QJsonObject &message);
 
 private:
     QWebSocketServer *webSocketServer;
-    QMap<QWebSocket*, QString> clients;
-    DatabaseManager dbManager;
-
-    void sendMessageToClients(const QJsonObject &jsonIncoming, QWebSocket *socket = nullptr, bool status = false);
-    void handleLogin(QWebSocket* socket, const QJsonObject &jsonObj);
-    void handleRegistration(QWebSocket* socket,const QJsonObject &jsonObj);
-    void handleChatMessage(QWebSocket *socket, const QJsonObject &jsonObj);
-    QJsonArray getOnlineClientsList(QWebSocket *socket);
-    void notifyAllClients(const QString &newClientLogin, QWebSocket *socket, const QString &status);
+    SessionRegistry sessions;
+    DbExecutor dbExecutor;
+    AuthService authService;
+    ResumeTokenStore resumeTokens;
+    QList<ConnectionShard*> shards;
+    QList<QThread*> shardThreads;
+    QVector<int> shardLoad;
+    QSet<ConnectionId> connections;
+    ConnectionId nextConnectionSerial = 1;
+    UserIndex userIndex;
+    MetricsServer metricsServer;
+
+    struct RequestMetrics
+    {
+        const char *name = nullptr;
+        Counter *received = nullptr;
+        // Only the synchronous part on the Server thread: database and auth
+        // work the handler hands off is timed by their own metrics.
+        Histogram *dispatchTime = nullptr;
+    };
+    QHash<QString, RequestMetrics> requestMetrics;
+    Gauge *connectedSockets = nullptr;
+    int searchResultLimit = 20;
+
+    // Presence is only sent to online users that share a chat with, or asked
+    // about, the user whose state changed, batched per recipient.
+    QHash<QString, QSet<QString>> presenceWatchers;
+    QHash<QString, QSet<QString>> presenceSubscriptions;
+    QHash<QString, QHash<QString, bool>> pendingPresence;
+    QTimer presenceTimer;
+
+    void startShards(int threadCount, const CompressionPolicy &compression);
+    void stopShards();
+    ConnectionShard *shardFor(ConnectionId connection) const;
+    void sendTo(ConnectionId connection, const QJsonObject &message);
+    void sendMessageToClients(const QJsonObject &jsonIncoming, ConnectionId connection, bool status = false,
+                              const QJsonArray &payload = QJsonArray());
+    void handleLogin(ConnectionId connection, const QJsonObject &jsonObj);
+    void handleRegistration(ConnectionId connection, const QJsonObject &jsonObj);
+    void handleResume(ConnectionId connection, const QJsonObject &jsonObj);
+    // Sends the messages after afterId in pages of maxResumeMessages until none
+    // are left.
+    void sendResumeDelta(ConnectionId connection, const QJsonObject &jsonObj, const QString &login, qint64 afterId);
+    void rejectBusy(ConnectionId connection, const QJsonObject &jsonIncoming);
+    void handleChatMessage(ConnectionId connection, const QJsonObject &jsonObj);
+    void deliverPending(ConnectionId connection, const QString &login);
+    void handleGetHistory(ConnectionId connection, const QJsonObject &jsonObj);
+    void handleGetConversations(ConnectionId connection, const QJsonObject &jsonObj);
+    void handleSearchUsers(ConnectionId connection, const QJsonObject &jsonObj);
+    void annotatePresence(QJsonArray &entries, const QString &loginKey) const;
+    void startSession(ConnectionId connection, const QString &login);
+    void watchPresence(const QString &watcher, const QString &target);
+    void unwatchAll(const QString &watcher);
+    void publishPresence(const QString &login, bool online);
+    void flushPresence();
     QString checkOnlineStatus(const QString &login);
 };
 
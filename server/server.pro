@@ -1,16 +1,34 @@
 QT += core network sql websockets
 
-CONFIG += c++11 console
+CONFIG += c++17 console
 CONFIG -= app_bundle
 
+equals(QT_MAJOR_VERSION, 5):lessThan(QT_MINOR_VERSION, 15): error("Building needs Qt 5.15 or Qt 6")
+
+INCLUDEPATH += ../common
+
 # You can make your code fail to compile if it uses deprecated APIs.
 # In order to do so, uncomment the following line.
 #DEFINES += QT_DISABLE_DEPRECATED_BEFORE=0x060000    # disables all the APIs deprecated before Qt 6.0.0
 
 SOURCES += \
+        ../common/wireprotocol.cpp \
+        authservice.cpp \
+        connectionshard.cpp \
         databasemanager.cpp \
+        dbexecutor.cpp \
+        logmessagestore.cpp \
         main.cpp \
-        server.cpp
+        metrics.cpp \
+        metricsserver.cpp \
+        passwordhasher.cpp \
+        resumetokens.cpp \
+        server.cpp \
+        sessionregistry.cpp \
+        sqlitemessagestore.cpp \
+        statementcache.cpp \
+        tracer.cpp \
+        userindex.cpp
 
 # Default rules for deployment.
 qnx: target.path = /tmp/$${TARGET}/bin
@@ -18,5 +36,23 @@ else: unix:!android: target.path = /opt/$${TARGET}/bin
 !isEmpty(target.path): INSTALLS += target
 
 HEADERS += \
+    ../common/systemmessage.h \
+    ../common/wireprotocol.h \
+    authservice.h \
+    connectionshard.h \
     databasemanager.h \
-    server.h
+    dbexecutor.h \
+    logmessagestore.h \
+    lrucache.h \
+    messagestore.h \
+    metrics.h \
+    metricsserver.h \
+    passwordhasher.h \
+    resumetokens.h \
+    server.h \
+    serverconfig.h \
+    sessionregistry.h \
+    sqlitemessagestore.h \
+    statementcache.h \
+    tracer.h \
+    userindex.h
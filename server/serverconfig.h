@@ -0,0 +1,34 @@
+#ifndef SERVERCONFIG_H
+#define SERVERCONFIG_H
+
+#include "authservice.h"
+#include "connectionshard.h"
+#include "databasemanager.h"
+
+struct ServerConfig
+{
+    // Empty for ./messanger_users.db, DatabaseManager::inMemoryDatabase for
+    // a throwaway database in a temporary file.
+    QString databasePath;
+    FlushPolicy flushPolicy;
+    StorageProfile storage;
+    MessageStoreConfig messageStore;
+    int dbReaderThreads = 2;
+    // 0 keeps every socket on the main thread.
+    int connectionThreads = 0;
+    // Presence changes are coalesced into one frame per recipient per interval.
+    int presenceIntervalMs = 100;
+    CompressionPolicy compression;
+    int searchResultLimit = 20;
+    AuthConfig auth;
+    int resumeTokenTtlSeconds = 86400;
+    // Loopback port serving /metrics; 0 turns the endpoint off.
+    int metricsPort = 9101;
+    // Record trace spans, served at /trace and written to traceFile on
+    // shutdown when it is set.
+    bool trace = false;
+    int traceEventsPerThread = 65536;
+    QString traceFile;
+};
+
+#endif // SERVERCONFIG_H
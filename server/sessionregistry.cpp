@@ -0,0 +1,69 @@
+#include "sessionregistry.h"
+
+void SessionRegistry::insert(ConnectionId connection, const QString &login)
+{
+    if (!connection || login.isEmpty())
+    {
+        return;
+    }
+
+    remove(connection);
+
+    Session session;
+    session.connection = connection;
+    session.login = login;
+    byConnection.insert(connection, session);
+    byLogin[login].append(connection);
+}
+
+void SessionRegistry::remove(ConnectionId connection)
+{
+    auto it = byConnection.find(connection);
+    if (it == byConnection.end())
+    {
+        return;
+    }
+
+    // Any other connection of the same user keeps the login mapped.
+    auto loginIt = byLogin.find(it->login);
+    if (loginIt != byLogin.end())
+    {
+        loginIt->removeOne(connection);
+        if (loginIt->isEmpty())
+        {
+            byLogin.erase(loginIt);
+        }
+    }
+    byConnection.erase(it);
+}
+
+bool SessionRegistry::contains(ConnectionId connection) const
+{
+    return byConnection.contains(connection);
+}
+
+bool SessionRegistry::isOnline(const QString &login) const
+{
+    return byLogin.contains(login);
+}
+
+QList<ConnectionId> SessionRegistry::connectionsFor(const QString &login) const
+{
+    return byLogin.value(login);
+}
+
+QString SessionRegistry::loginFor(ConnectionId connection) const
+{
+    auto it = byConnection.constFind(connection);
+    return it != byConnection.constEnd() ? it->login : QString();
+}
+
+const QHash<ConnectionId, Session> &SessionRegistry::sessions() const
+{
+    return byConnection;
+}
+
+int SessionRegistry::size() const
+{
+    return int(byConnection.size());
+}
@@ -0,0 +1,44 @@
+#ifndef SESSIONREGISTRY_H
+#define SESSIONREGISTRY_H
+
+#include <QHash>
+#include <QList>
+#include <QString>
+
+// Identifies one accepted WebSocket connection. Sockets themselves live on
+// their connection shard's thread, so the rest of the server refers to
+// them only through this id.
+typedef quint64 ConnectionId;
+
+struct Session
+{
+    ConnectionId connection = 0;
+    QString login;
+};
+
+// Connected sessions indexed both by connection and by login, so routing a
+// message to a user and resolving the user behind a connection are both O(1).
+// A user may be connected more than once; they stay online until the last of
+// their connections is removed, and messages go to every one of them.
+class SessionRegistry
+{
+public:
+    void insert(ConnectionId connection, const QString &login);
+    void remove(ConnectionId connection);
+
+    bool contains(ConnectionId connection) const;
+    bool isOnline(const QString &login) const;
+    // Oldest first, empty when the user is offline.
+    QList<ConnectionId> connectionsFor(const QString &login) const;
+    QString loginFor(ConnectionId connection) const;
+
+    const QHash<ConnectionId, Session> &sessions() const;
+    int size() const;
+
+private:
+    QHash<ConnectionId, Session> byConnection;
+    // Oldest first.
+    QHash<QString, QList<ConnectionId>> byLogin;
+};
+
+#endif // SESSIONREGISTRY_H
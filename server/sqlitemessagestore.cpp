@@ -0,0 +1,517 @@
+#include "sqlitemessagestore.h"
+
+#include <QDataStream>
+#include <QDebug>
+#include <QSqlError>
+#include <algorithm>
+#include <limits>
+#include "metrics.h"
+
+namespace {
+// Columns every read selects, in this order.
+StoredMessage readRow(const QSqlQuery &query)
+{
+    StoredMessage message;
+    message.id = query.value(0).toLongLong();
+    message.chatId = query.value(1).toInt();
+    message.senderId = query.value(2).toInt();
+    message.recipientId = query.value(3).toInt();
+    message.message = query.value(4).toString();
+    message.timestamp = query.value(5).toString();
+    return message;
+}
+
+// Block layout before compression: a message count, then per message its
+// id, sender, recipient, text and timestamp, ascending by id. The stream
+// version is pinned so Qt 5 and Qt 6 builds read each other's blocks.
+QByteArray encodeBlock(const QVector<StoredMessage> &messages)
+{
+    QByteArray raw;
+    QDataStream stream(&raw, QIODevice::WriteOnly);
+    stream.setVersion(QDataStream::Qt_5_15);
+    stream << quint32(messages.size());
+    for (const StoredMessage &message : messages)
+    {
+        stream << message.id << qint32(message.senderId) << qint32(message.recipientId)
+               << message.message << message.timestamp;
+    }
+    return raw;
+}
+
+QVector<StoredMessage> decodeBlock(int chatId, const QByteArray &block)
+{
+    static Counter &blocksRead = Metrics::instance().counter("qmessenger_archive_blocks_read_total",
+                                                             "Archived message blocks decompressed by reads.");
+    blocksRead.add();
+
+    QVector<StoredMessage> messages;
+    QByteArray raw = qUncompress(block);
+    QDataStream stream(raw);
+    stream.setVersion(QDataStream::Qt_5_15);
+
+    quint32 count = 0;
+    stream >> count;
+    messages.reserve(int(count));
+    for (quint32 i = 0; i < count && stream.status() == QDataStream::Ok; ++i)
+    {
+        StoredMessage message;
+        qint32 senderId = 0;
+        qint32 recipientId = 0;
+        stream >> message.id >> senderId >> recipientId >> message.message >> message.timestamp;
+        message.chatId = chatId;
+        message.senderId = senderId;
+        message.recipientId = recipientId;
+        messages.append(message);
+    }
+    if (stream.status() != QDataStream::Ok)
+    {
+        qDebug() << "Corrupt archive block in chat" << chatId;
+    }
+    return messages;
+}
+
+Histogram &coldReadLatency()
+{
+    static Histogram &latency = Metrics::instance().histogram("qmessenger_archive_read_duration_seconds",
+                                                              "Time spent loading and decompressing archived messages for one read.");
+    return latency;
+}
+}
+
+SqliteMessageStore::SqliteMessageStore(const QSqlDatabase &db)
+    : db(db)
+{
+}
+
+qint64 SqliteMessageStore::lastMessageId()
+{
+    // Ids are handed out before the row reaches the table, so count both
+    // the highest stored row and the AUTOINCREMENT high-water mark.
+    PreparedStatement query = statements.prepared(db, "SELECT MAX(COALESCE((SELECT MAX(Id) FROM Messages), 0), "
+                                                      "COALESCE((SELECT seq FROM sqlite_sequence WHERE name = 'Messages'), 0))");
+    if (!query->exec() || !query->next())
+    {
+        return 0;
+    }
+    return query->value(0).toLongLong();
+}
+
+bool SqliteMessageStore::append(const QVector<StoredMessage> &messages)
+{
+    PreparedStatement query = statements.prepared(db, "INSERT INTO Messages (Id, ChatId, SenderId, RecipientId, Message, Timestamp, Status) "
+                                                      "VALUES (?, ?, ?, ?, ?, ?, 'sent')");
+
+    bool ok = true;
+    for (const StoredMessage &message : messages)
+    {
+        query->bindValue(0, message.id);
+        query->bindValue(1, message.chatId);
+        query->bindValue(2, message.senderId);
+        query->bindValue(3, message.recipientId);
+        query->bindValue(4, message.message);
+        query->bindValue(5, message.timestamp);
+        if (!query->exec())
+        {
+            qDebug() << "Dropped message" << message.id << ":" << query->lastError().text();
+            ok = false;
+        }
+    }
+    return ok;
+}
+
+QVector<StoredMessage> SqliteMessageStore::readChat(int chatId, qint64 beforeId, int limit)
+{
+    QVector<StoredMessage> page;
+
+    // Keyset pagination over idx_chat_messages: (ChatId, Timestamp, rowid)
+    // is walked backwards from the cursor row, so a page costs O(limit)
+    // regardless of how deep into the history it is.
+    PreparedStatement query = beforeId > 0
+        ? statements.prepared(db, "SELECT Id, ChatId, SenderId, RecipientId, Message, Timestamp FROM Messages "
+                                  "WHERE ChatId = ? "
+                                  "AND (Timestamp, Id) < (SELECT Timestamp, Id FROM Messages WHERE Id = ?) "
+                                  "ORDER BY Timestamp DESC, Id DESC LIMIT ?")
+        : statements.prepared(db, "SELECT Id, ChatId, SenderId, RecipientId, Message, Timestamp FROM Messages "
+                                  "WHERE ChatId = ? "
+                                  "ORDER BY Timestamp DESC, Id DESC LIMIT ?");
+    int position = 0;
+    query->bindValue(position++, chatId);
+    if (beforeId > 0)
+    {
+        query->bindValue(position++, beforeId);
+    }
+    query->bindValue(position++, limit);
+
+    if (!query->exec())
+    {
+        return page;
+    }
+    while (query->next())
+    {
+        page.append(readRow(*query));
+    }
+    query->finish();
+
+    std::reverse(page.begin(), page.end());
+
+    // The hot rows below the cursor ran out: the rest of the page is older
+    // than all of them and comes from the archive.
+    if (limit < 0 || page.size() < limit)
+    {
+        qint64 coldBefore = page.isEmpty() ? beforeId : page.first().id;
+        QVector<StoredMessage> cold = readColdChat(chatId, coldBefore, limit < 0 ? -1 : limit - page.size());
+        if (!cold.isEmpty())
+        {
+            cold += page;
+            page.swap(cold);
+        }
+    }
+    return page;
+}
+
+QVector<StoredMessage> SqliteMessageStore::readColdChat(int chatId, qint64 beforeId, int limit)
+{
+    QVector<StoredMessage> page;
+
+    // Newest block first; a block is only decompressed once the page reaches it.
+    PreparedStatement query = statements.prepared(db, "SELECT Block FROM MessageArchive "
+                                                      "WHERE ChatId = ? AND FirstId < ? ORDER BY LastId DESC");
+    query->bindValue(0, chatId);
+    query->bindValue(1, beforeId > 0 ? beforeId : std::numeric_limits<qint64>::max());
+    if (!query->exec() || !query->next())
+    {
+        return page;
+    }
+
+    MetricsTimer timer(coldReadLatency());
+    do
+    {
+        const QVector<StoredMessage> block = decodeBlock(chatId, query->value(0).toByteArray());
+        for (auto it = block.crbegin(); it != block.crend() && (limit < 0 || page.size() < limit); ++it)
+        {
+            if (beforeId <= 0 || it->id < beforeId)
+            {
+                page.append(*it);
+            }
+        }
+    } while ((limit < 0 || page.size() < limit) && query->next());
+
+    std::reverse(page.begin(), page.end());
+    return page;
+}
+
+QVector<StoredMessage> SqliteMessageStore::readChatsAfter(const QVector<int> &chatIds, qint64 afterId, int limit)
+{
+    QVector<StoredMessage> messages;
+    if (limit <= 0)
+    {
+        return messages;
+    }
+
+    // Per chat of the user, archived blocks first (a client that was away
+    // long enough needs those too), then one range scan on idx_chat_ids.
+    // A chat never contributes more than limit messages, so blocks are only
+    // decompressed until it has that many. Only the lowest limit ids are
+    // kept overall: once that many are held, later chats are only asked for
+    // ids below the highest of them.
+    auto byId = [](const StoredMessage &a, const StoredMessage &b) {
+        return a.id < b.id;
+    };
+    auto keepLowest = [&messages, limit, byId]() {
+        std::sort(messages.begin(), messages.end(), byId);
+        messages.resize(limit);
+        return messages.last().id;
+    };
+    qint64 ceiling = std::numeric_limits<qint64>::max();
+
+    PreparedStatement cold = statements.prepared(db, "SELECT Block FROM MessageArchive "
+                                                     "WHERE ChatId = ? AND LastId > ? AND FirstId < ? "
+                                                     "ORDER BY LastId ASC");
+    PreparedStatement query = statements.prepared(db, "SELECT Id, ChatId, SenderId, RecipientId, Message, Timestamp "
+                                                      "FROM Messages WHERE ChatId = ? AND Id > ? AND Id < ? "
+                                                      "ORDER BY Id ASC LIMIT ?");
+    for (int chatId : chatIds)
+    {
+        int taken = 0;
+        cold->bindValue(0, chatId);
+        cold->bindValue(1, afterId);
+        cold->bindValue(2, ceiling);
+        if (cold->exec() && cold->next())
+        {
+            MetricsTimer timer(coldReadLatency());
+            do
+            {
+                const QVector<StoredMessage> block = decodeBlock(chatId, cold->value(0).toByteArray());
+                for (const StoredMessage &message : block)
+                {
+                    if (message.id > afterId && message.id < ceiling && taken < limit)
+                    {
+                        messages.append(message);
+                        ++taken;
+                    }
+                }
+            } while (taken < limit && cold->next());
+        }
+        cold->finish();
+
+        if (taken < limit)
+        {
+            query->bindValue(0, chatId);
+            query->bindValue(1, afterId);
+            query->bindValue(2, ceiling);
+            query->bindValue(3, limit - taken);
+            if (!query->exec())
+            {
+                qDebug() << "Failed to load messages of chat" << chatId << ":" << query->lastError().text();
+                continue;
+            }
+            while (query->next())
+            {
+                messages.append(readRow(*query));
+            }
+        }
+        if (messages.size() >= 2 * limit)
+        {
+            ceiling = keepLowest();
+        }
+    }
+
+    std::sort(messages.begin(), messages.end(), byId);
+    if (messages.size() > limit)
+    {
+        messages.resize(limit);
+    }
+    return messages;
+}
+
+QVector<StoredMessage> SqliteMessageStore::readForRecipient(int recipientId, qint64 afterId)
+{
+    QVector<StoredMessage> messages;
+
+    // One range scan on idx_recipient_messages.
+    PreparedStatement query = statements.prepared(db, "SELECT Id, ChatId, SenderId, RecipientId, Message, Timestamp "
+                                                      "FROM Messages WHERE RecipientId = ? AND Id > ? ORDER BY Id ASC");
+    query->bindValue(0, recipientId);
+    query->bindValue(1, afterId);
+    if (!query->exec())
+    {
+        qDebug() << "Failed to load messages for recipient" << recipientId << ":" << query->lastError().text();
+        return messages;
+    }
+    while (query->next())
+    {
+        messages.append(readRow(*query));
+    }
+    return messages;
+}
+
+int SqliteMessageStore::countUnread(int chatId, int readerId, qint64 afterId)
+{
+    PreparedStatement query = statements.prepared(db, "SELECT COUNT(*) FROM Messages "
+                                                      "WHERE ChatId = ? AND SenderId <> ? AND Id > ?");
+    query->bindValue(0, chatId);
+    query->bindValue(1, readerId);
+    query->bindValue(2, afterId);
+    if (!query->exec() || !query->next())
+    {
+        return 0;
+    }
+    int unread = query->value(0).toInt();
+    query->finish();
+
+    // Every archived message past afterId counts, so no limit applies here;
+    // the range on idx_archive_blocks only reaches the chat's newer blocks.
+    PreparedStatement cold = statements.prepared(db, "SELECT Block FROM MessageArchive "
+                                                     "WHERE ChatId = ? AND LastId > ? ORDER BY LastId ASC");
+    cold->bindValue(0, chatId);
+    cold->bindValue(1, afterId);
+    if (cold->exec() && cold->next())
+    {
+        MetricsTimer timer(coldReadLatency());
+        do
+        {
+            const QVector<StoredMessage> block = decodeBlock(chatId, cold->value(0).toByteArray());
+            for (const StoredMessage &message : block)
+            {
+                if (message.id > afterId && message.senderId != readerId)
+                {
+                    ++unread;
+                }
+            }
+        } while (cold->next());
+    }
+    return unread;
+}
+
+QHash<int, qint64> SqliteMessageStore::newestPerChat(int recipientId, qint64 afterId, qint64 upToId)
+{
+    QHash<int, qint64> newest;
+
+    // The chats that gained delivered messages are exactly those with
+    // messages between the two watermarks, a range scan on
+    // idx_recipient_messages.
+    PreparedStatement query = statements.prepared(db, "SELECT ChatId, MAX(Id) FROM Messages "
+                                                      "WHERE RecipientId = ? AND Id > ? AND Id <= ? GROUP BY ChatId");
+    query->bindValue(0, recipientId);
+    query->bindValue(1, afterId);
+    query->bindValue(2, upToId);
+    if (!query->exec())
+    {
+        return newest;
+    }
+    while (query->next())
+    {
+        newest.insert(query->value(0).toInt(), query->value(1).toLongLong());
+    }
+    return newest;
+}
+
+int SqliteMessageStore::archive(const QString &cutoff, const ArchivePolicy &policy)
+{
+    int budget = qMax(1, policy.maxBlocksPerRun) * qMax(1, policy.blockMessages);
+
+    // Chats holding messages past the cutoff, taken in id order from where
+    // the previous run stopped so a busy chat cannot starve the others.
+    QVector<int> chatIds;
+    {
+        PreparedStatement chats = statements.prepared(db, "SELECT Id FROM Chats c WHERE Id > ? "
+                                                          "AND EXISTS (SELECT 1 FROM Messages WHERE ChatId = c.Id AND Timestamp < ?) "
+                                                          "ORDER BY Id LIMIT ?");
+        chats->bindValue(0, archiveCursor);
+        chats->bindValue(1, cutoff);
+        chats->bindValue(2, qMax(1, policy.maxBlocksPerRun));
+        if (!chats->exec())
+        {
+            qDebug() << "Failed to find chats to archive:" << chats->lastError().text();
+            return 0;
+        }
+        while (chats->next())
+        {
+            chatIds.append(chats->value(0).toInt());
+        }
+    }
+    if (chatIds.size() < qMax(1, policy.maxBlocksPerRun))
+    {
+        archiveCursor = 0;
+    }
+
+    int moved = 0;
+    for (int chatId : std::as_const(chatIds))
+    {
+        if (moved >= budget)
+        {
+            break;
+        }
+        moved += archiveChat(chatId, cutoff, policy, budget - moved);
+        archiveCursor = chatId;
+    }
+    return moved;
+}
+
+int SqliteMessageStore::archiveChat(int chatId, const QString &cutoff, const ArchivePolicy &policy, int budget)
+{
+    int blockMessages = qMax(1, policy.blockMessages);
+
+    // The oldest messages of the chat, up to the first one that is too new
+    // or not yet delivered: the archive must stay a prefix of the chat.
+    QVector<StoredMessage> aged;
+    {
+        PreparedStatement query = statements.prepared(db, "SELECT m.Id, m.ChatId, m.SenderId, m.RecipientId, m.Message, m.Timestamp, "
+                                                          "COALESCE(m.Id <= u.DeliveredUpTo, 1) "
+                                                          "FROM Messages m LEFT JOIN Users u ON u.Id = m.RecipientId "
+                                                          "WHERE m.ChatId = ? ORDER BY m.Timestamp, m.Id LIMIT ?");
+        query->bindValue(0, chatId);
+        query->bindValue(1, budget);
+        if (!query->exec())
+        {
+            return 0;
+        }
+        while (query->next())
+        {
+            if (query->value(5).toString() >= cutoff || !query->value(6).toBool())
+            {
+                break;
+            }
+            aged.append(readRow(*query));
+        }
+    }
+    if (aged.isEmpty())
+    {
+        return 0;
+    }
+    int moved = aged.size();
+
+    // A partly filled newest block is reopened so blocks fill up instead of
+    // every run leaving a small one behind.
+    {
+        PreparedStatement tail = statements.prepared(db, "SELECT Id, MessageCount, Block FROM MessageArchive "
+                                                         "WHERE ChatId = ? ORDER BY LastId DESC LIMIT 1");
+        tail->bindValue(0, chatId);
+        if (tail->exec() && tail->next() && tail->value(1).toInt() < blockMessages)
+        {
+            qint64 tailId = tail->value(0).toLongLong();
+            QVector<StoredMessage> reopened = decodeBlock(chatId, tail->value(2).toByteArray());
+            tail->finish();
+
+            PreparedStatement drop = statements.prepared(db, "DELETE FROM MessageArchive WHERE Id = ?");
+            drop->bindValue(0, tailId);
+            if (!drop->exec())
+            {
+                qDebug() << "Failed to reopen archive block of chat" << chatId << ":" << drop->lastError().text();
+                return 0;
+            }
+            reopened += aged;
+            aged.swap(reopened);
+        }
+    }
+
+    PreparedStatement insert = statements.prepared(db, "INSERT INTO MessageArchive "
+                                                       "(ChatId, FirstId, LastId, MessageCount, RawBytes, StoredBytes, Block) "
+                                                       "VALUES (?, ?, ?, ?, ?, ?, ?)");
+    for (int first = 0; first < aged.size(); first += blockMessages)
+    {
+        QVector<StoredMessage> messages = aged.mid(first, blockMessages);
+        QByteArray raw = encodeBlock(messages);
+        QByteArray block = qCompress(raw, policy.compressionLevel);
+
+        insert->bindValue(0, chatId);
+        insert->bindValue(1, messages.first().id);
+        insert->bindValue(2, messages.last().id);
+        insert->bindValue(3, messages.size());
+        insert->bindValue(4, raw.size());
+        insert->bindValue(5, block.size());
+        insert->bindValue(6, block);
+        if (!insert->exec())
+        {
+            qDebug() << "Failed to archive messages of chat" << chatId << ":" << insert->lastError().text();
+            return 0;
+        }
+    }
+
+    PreparedStatement remove = statements.prepared(db, "DELETE FROM Messages WHERE Id = ?");
+    for (int i = aged.size() - moved; i < aged.size(); ++i)
+    {
+        remove->bindValue(0, aged.at(i).id);
+        if (!remove->exec())
+        {
+            qDebug() << "Failed to remove archived message" << aged.at(i).id << ":" << remove->lastError().text();
+        }
+    }
+    return moved;
+}
+
+ArchiveStats SqliteMessageStore::archiveStats()
+{
+    ArchiveStats stats;
+    PreparedStatement query = statements.prepared(db, "SELECT COUNT(*), COALESCE(SUM(MessageCount), 0), "
+                                                      "COALESCE(SUM(RawBytes), 0), COALESCE(SUM(StoredBytes), 0) "
+                                                      "FROM MessageArchive");
+    if (query->exec() && query->next())
+    {
+        stats.blocks = query->value(0).toLongLong();
+        stats.messages = query->value(1).toLongLong();
+        stats.rawBytes = query->value(2).toLongLong();
+        stats.storedBytes = query->value(3).toLongLong();
+    }
+    return stats;
+}
@@ -0,0 +1,44 @@
+#ifndef SQLITEMESSAGESTORE_H
+#define SQLITEMESSAGESTORE_H
+
+#include <QSqlDatabase>
+#include "messagestore.h"
+#include "statementcache.h"
+
+// Messages in the Messages table of the connection it is given, so appends
+// join the caller's transaction. One instance per connection.
+//
+// Archived messages live in MessageArchive as qCompress'd blocks of
+// consecutive messages of one chat, indexed by (ChatId, LastId). Within a
+// chat every archived message is older than every hot one, so a history
+// page reads the hot rows first and only continues into the blocks when it
+// runs out of them.
+class SqliteMessageStore : public MessageStore
+{
+public:
+    explicit SqliteMessageStore(const QSqlDatabase &db);
+
+    qint64 lastMessageId() override;
+    bool append(const QVector<StoredMessage> &messages) override;
+
+    QVector<StoredMessage> readChat(int chatId, qint64 beforeId, int limit) override;
+    QVector<StoredMessage> readChatsAfter(const QVector<int> &chatIds, qint64 afterId, int limit) override;
+    QVector<StoredMessage> readForRecipient(int recipientId, qint64 afterId) override;
+
+    int countUnread(int chatId, int readerId, qint64 afterId) override;
+    QHash<int, qint64> newestPerChat(int recipientId, qint64 afterId, qint64 upToId) override;
+
+    int archive(const QString &cutoff, const ArchivePolicy &policy) override;
+    ArchiveStats archiveStats() override;
+
+private:
+    QSqlDatabase db;
+    StatementCache statements;
+    // Chats are archived in id order across runs; the last one handled.
+    int archiveCursor = 0;
+
+    QVector<StoredMessage> readColdChat(int chatId, qint64 beforeId, int limit);
+    int archiveChat(int chatId, const QString &cutoff, const ArchivePolicy &policy, int budget);
+};
+
+#endif // SQLITEMESSAGESTORE_H
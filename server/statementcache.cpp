@@ -0,0 +1,37 @@
+#include "statementcache.h"
+
+#include <QDebug>
+#include <QSqlError>
+
+StatementCache::~StatementCache()
+{
+    clear();
+}
+
+PreparedStatement StatementCache::prepared(const QSqlDatabase &db, const char *sql)
+{
+    auto it = statements.constFind(sql);
+    if (it != statements.constEnd())
+    {
+        return PreparedStatement(it.value(), false);
+    }
+
+    QSqlQuery *query = new QSqlQuery(db);
+    query->setForwardOnly(true);
+    if (!query->prepare(QString::fromLatin1(sql)))
+    {
+        // Not cached, so a statement that failed to compile (the database
+        // was locked, say) is retried on the next call.
+        qDebug() << "Failed to prepare statement:" << query->lastError().text();
+        return PreparedStatement(query, true);
+    }
+
+    statements.insert(sql, query);
+    return PreparedStatement(query, false);
+}
+
+void StatementCache::clear()
+{
+    qDeleteAll(statements);
+    statements.clear();
+}
@@ -0,0 +1,51 @@
+#ifndef STATEMENTCACHE_H
+#define STATEMENTCACHE_H
+
+#include <QHash>
+#include <QSqlDatabase>
+#include <QSqlQuery>
+
+// A cached statement borrowed for one use. It is reset when the scope ends,
+// so a partly read SELECT never keeps its read lock between calls.
+class PreparedStatement
+{
+public:
+    PreparedStatement(QSqlQuery *query, bool owned) : query(query), owned(owned) {}
+    PreparedStatement(const PreparedStatement &) = delete;
+    PreparedStatement &operator=(const PreparedStatement &) = delete;
+    ~PreparedStatement()
+    {
+        query->finish();
+        if (owned)
+        {
+            delete query;
+        }
+    }
+
+    QSqlQuery *operator->() const { return query; }
+    QSqlQuery &operator*() const { return *query; }
+
+private:
+    QSqlQuery *query;
+    bool owned;
+};
+
+// Statements compiled once per connection and reused with positional
+// binding, keyed by the address of the SQL literal. Must be cleared before
+// the connection closes.
+class StatementCache
+{
+public:
+    StatementCache() = default;
+    StatementCache(const StatementCache &) = delete;
+    StatementCache &operator=(const StatementCache &) = delete;
+    ~StatementCache();
+
+    PreparedStatement prepared(const QSqlDatabase &db, const char *sql);
+    void clear();
+
+private:
+    QHash<const char*, QSqlQuery*> statements;
+};
+
+#endif // STATEMENTCACHE_H
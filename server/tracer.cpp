@@ -0,0 +1,220 @@
+#include "tracer.h"
+
+#include <QCoreApplication>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QMutex>
+#include <QThread>
+#include <QVector>
+#include <memory>
+#include <vector>
+
+namespace {
+struct Event
+{
+    const char *name = nullptr;
+    const char *category = nullptr;
+    qint64 start = 0;
+    qint64 end = 0;
+    TraceContext context;
+};
+
+// Written by its own thread only; the mutex is uncontended except while a
+// dump copies the buffer out.
+struct ThreadBuffer
+{
+    QMutex mutex;
+    QVector<Event> events;
+    int next = 0;
+    bool wrapped = false;
+    int tid = 0;
+    QString threadName;
+};
+
+struct Registry
+{
+    QMutex mutex;
+    // Buffers outlive their threads so a dump at shutdown still sees the
+    // events of lanes and shards that have already stopped.
+    std::vector<std::shared_ptr<ThreadBuffer>> buffers;
+    int nextTid = 1;
+};
+
+Registry &registry()
+{
+    static Registry instance;
+    return instance;
+}
+
+const QElapsedTimer &clock()
+{
+    static const QElapsedTimer instance = []() {
+        QElapsedTimer timer;
+        timer.start();
+        return timer;
+    }();
+    return instance;
+}
+
+std::atomic<int> eventsPerThread { 65536 };
+std::atomic<quint64> requestSerial { 0 };
+thread_local TraceContext currentTraceContext;
+thread_local std::shared_ptr<ThreadBuffer> localBuffer;
+
+ThreadBuffer &threadBuffer()
+{
+    if (!localBuffer)
+    {
+        auto buffer = std::make_shared<ThreadBuffer>();
+        buffer->events.resize(qMax(1, eventsPerThread.load(std::memory_order_relaxed)));
+
+        QThread *thread = QThread::currentThread();
+        buffer->threadName = thread->objectName();
+        if (buffer->threadName.isEmpty() && QCoreApplication::instance()
+            && thread == QCoreApplication::instance()->thread())
+        {
+            buffer->threadName = "main";
+        }
+
+        Registry &reg = registry();
+        QMutexLocker locker(&reg.mutex);
+        buffer->tid = reg.nextTid++;
+        if (buffer->threadName.isEmpty())
+        {
+            buffer->threadName = QString("thread-%1").arg(buffer->tid);
+        }
+        reg.buffers.push_back(buffer);
+        localBuffer = buffer;
+    }
+    return *localBuffer;
+}
+
+QByteArray micros(qint64 nanos)
+{
+    return QByteArray::number(double(nanos) / 1000.0, 'f', 3);
+}
+
+QByteArray quoted(const QByteArray &text)
+{
+    QByteArray escaped = text;
+    escaped.replace('\\', "\\\\").replace('"', "\\\"");
+    return '"' + escaped + '"';
+}
+}
+
+std::atomic<bool> Tracer::enabled { false };
+
+void Tracer::enable(int capacity)
+{
+    eventsPerThread.store(qMax(1, capacity), std::memory_order_relaxed);
+    clock();
+    enabled.store(true, std::memory_order_relaxed);
+}
+
+quint64 Tracer::nextRequestId()
+{
+    return requestSerial.fetch_add(1, std::memory_order_relaxed) + 1;
+}
+
+TraceContext Tracer::currentContext()
+{
+    return currentTraceContext;
+}
+
+void Tracer::setCurrentContext(const TraceContext &context)
+{
+    currentTraceContext = context;
+}
+
+qint64 Tracer::nowNanos()
+{
+    return clock().nsecsElapsed();
+}
+
+void Tracer::record(const char *name, const char *category, qint64 startNanos, qint64 endNanos,
+                    const TraceContext &context)
+{
+    ThreadBuffer &buffer = threadBuffer();
+    QMutexLocker locker(&buffer.mutex);
+
+    Event &event = buffer.events[buffer.next];
+    event.name = name;
+    event.category = category;
+    event.start = startNanos;
+    event.end = endNanos;
+    event.context = context;
+
+    if (++buffer.next == buffer.events.size())
+    {
+        buffer.next = 0;
+        buffer.wrapped = true;
+    }
+}
+
+QByteArray Tracer::renderChromeTrace()
+{
+    std::vector<std::shared_ptr<ThreadBuffer>> buffers;
+    {
+        Registry &reg = registry();
+        QMutexLocker locker(&reg.mutex);
+        buffers = reg.buffers;
+    }
+
+    QByteArray json = "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+    bool first = true;
+    auto append = [&json, &first](const QByteArray &event) {
+        if (!first)
+        {
+            json += ",\n";
+        }
+        json += event;
+        first = false;
+    };
+
+    for (const auto &buffer : buffers)
+    {
+        QVector<Event> events;
+        int next;
+        bool wrapped;
+        {
+            QMutexLocker locker(&buffer->mutex);
+            events = buffer->events;
+            next = buffer->next;
+            wrapped = buffer->wrapped;
+        }
+
+        QByteArray tid = QByteArray::number(buffer->tid);
+        append("{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" + tid
+               + ",\"args\":{\"name\":" + quoted(buffer->threadName.toUtf8()) + "}}");
+
+        // Oldest first: after a wrap the oldest event sits at the cursor.
+        int count = wrapped ? events.size() : next;
+        int begin = wrapped ? next : 0;
+        for (int i = 0; i < count; ++i)
+        {
+            const Event &event = events.at((begin + i) % events.size());
+            QByteArray line = "{\"name\":" + quoted(event.name) + ",\"cat\":" + quoted(event.category)
+                              + ",\"ph\":\"X\",\"pid\":1,\"tid\":" + tid
+                              + ",\"ts\":" + micros(event.start) + ",\"dur\":" + micros(event.end - event.start);
+            if (event.context.connection || event.context.request)
+            {
+                line += ",\"args\":{\"connection\":" + QByteArray::number(event.context.connection)
+                        + ",\"request\":" + QByteArray::number(event.context.request) + "}";
+            }
+            append(line + "}");
+        }
+    }
+
+    json += "]}\n";
+    return json;
+}
+
+bool Tracer::writeChromeTrace(const QString &path)
+{
+    QFile file(path);
+    if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate))
+    {
+        return false;
+    }
+    return file.write(renderChromeTrace()) >= 0;
+}
@@ -0,0 +1,85 @@
+#ifndef TRACER_H
+#define TRACER_H
+
+#include <QByteArray>
+#include <QString>
+#include <atomic>
+
+// Request-level tracing in the Chrome trace-event format (chrome://tracing,
+// Perfetto). Spans are recorded into a fixed-size ring buffer per thread, so
+// a long run keeps only the most recent events and recording never
+// allocates. While tracing is off a span costs one relaxed atomic load.
+//
+// Span and category names must be string literals (or otherwise outlive the
+// process): only the pointer is stored.
+struct TraceContext
+{
+    quint64 connection = 0;
+    quint64 request = 0;
+};
+
+class Tracer
+{
+public:
+    static bool isEnabled() { return enabled.load(std::memory_order_relaxed); }
+    // capacity is in events per thread and applies to buffers of threads
+    // that record afterwards.
+    static void enable(int capacity);
+
+    static quint64 nextRequestId();
+
+    // The connection and request the current thread is working for. It is
+    // handed across threads by DbExecutor, AuthService and Server::sendTo.
+    static TraceContext currentContext();
+    static void setCurrentContext(const TraceContext &context);
+
+    static qint64 nowNanos();
+    static void record(const char *name, const char *category, qint64 startNanos, qint64 endNanos,
+                       const TraceContext &context);
+
+    // Snapshot of every thread's buffer as a trace-event JSON document.
+    static QByteArray renderChromeTrace();
+    static bool writeChromeTrace(const QString &path);
+
+private:
+    static std::atomic<bool> enabled;
+};
+
+// Makes a context current for the lifetime of the scope.
+class TraceContextScope
+{
+public:
+    explicit TraceContextScope(const TraceContext &context) : saved(Tracer::currentContext())
+    {
+        Tracer::setCurrentContext(context);
+    }
+    ~TraceContextScope() { Tracer::setCurrentContext(saved); }
+
+private:
+    TraceContext saved;
+};
+
+// Records the lifetime of the scope as a complete ("X") event attributed to
+// the current context.
+class TraceSpan
+{
+public:
+    TraceSpan(const char *name, const char *category)
+        : name(name), category(category), start(Tracer::isEnabled() ? Tracer::nowNanos() : -1)
+    {
+    }
+    ~TraceSpan()
+    {
+        if (start >= 0)
+        {
+            Tracer::record(name, category, start, Tracer::nowNanos(), Tracer::currentContext());
+        }
+    }
+
+private:
+    const char *name;
+    const char *category;
+    qint64 start;
+};
+
+#endif // TRACER_H
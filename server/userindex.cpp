@@ -0,0 +1,89 @@
+#include "userindex.h"
+
+#include <algorithm>
+
+void UserIndex::load(const QStringList &logins)
+{
+    // Registrations accepted while the snapshot was being read may already
+    // have been inserted; keep them and drop the duplicates.
+    entries.reserve(entries.size() + logins.size());
+    for (const QString &login : logins)
+    {
+        Entry entry;
+        entry.key = login.toLower();
+        entry.login = login;
+        entries.append(entry);
+    }
+    std::sort(entries.begin(), entries.end());
+    entries.erase(std::unique(entries.begin(), entries.end(), [](const Entry &a, const Entry &b) {
+        return a.login == b.login;
+    }), entries.end());
+    loaded = true;
+}
+
+void UserIndex::insert(const QString &login)
+{
+    Entry entry;
+    entry.key = login.toLower();
+    entry.login = login;
+
+    auto it = std::lower_bound(entries.begin(), entries.end(), entry);
+    if (it != entries.end() && it->login == login)
+    {
+        return;
+    }
+    entries.insert(it, entry);
+}
+
+bool UserIndex::isLoaded() const
+{
+    return loaded;
+}
+
+int UserIndex::size() const
+{
+    return int(entries.size());
+}
+
+QVector<UserIndex::Match> UserIndex::search(const QString &prefix, const QString &exclude, int limit, int scanLimit,
+                                            const std::function<bool(const QString&)> &isOnline) const
+{
+    QVector<Match> online;
+    QVector<Match> offline;
+    QString key = prefix.toLower();
+
+    auto it = std::lower_bound(entries.constBegin(), entries.constEnd(), key,
+                               [](const Entry &entry, const QString &value) { return entry.key < value; });
+
+    for (int scanned = 0; it != entries.constEnd() && scanned < scanLimit && online.size() < limit; ++it, ++scanned)
+    {
+        if (!it->key.startsWith(key))
+        {
+            break;
+        }
+        if (it->login == exclude)
+        {
+            continue;
+        }
+
+        Match match;
+        match.login = it->login;
+        match.online = isOnline(it->login);
+        if (match.online)
+        {
+            online.append(match);
+        } else if (offline.size() < limit) {
+            offline.append(match);
+        }
+    }
+
+    for (const Match &match : std::as_const(offline))
+    {
+        if (online.size() >= limit)
+        {
+            break;
+        }
+        online.append(match);
+    }
+    return online;
+}
@@ -0,0 +1,47 @@
+#ifndef USERINDEX_H
+#define USERINDEX_H
+
+#include <QString>
+#include <QStringList>
+#include <QVector>
+#include <functional>
+
+// Sorted in-memory index of every registered login for prefix search.
+// A lookup is a binary search to the start of the prefix range followed by
+// a bounded scan, so its cost does not grow with the number of users.
+class UserIndex
+{
+public:
+    struct Match
+    {
+        QString login;
+        bool online = false;
+    };
+
+    void load(const QStringList &logins);
+    void insert(const QString &login);
+    bool isLoaded() const;
+    int size() const;
+
+    // Returns at most limit logins starting with prefix (case-insensitive),
+    // online users first. At most scanLimit candidates are examined.
+    QVector<Match> search(const QString &prefix, const QString &exclude, int limit, int scanLimit,
+                          const std::function<bool(const QString&)> &isOnline) const;
+
+private:
+    struct Entry
+    {
+        QString key;
+        QString login;
+
+        bool operator<(const Entry &other) const
+        {
+            return key < other.key || (key == other.key && login < other.login);
+        }
+    };
+
+    QVector<Entry> entries;
+    bool loaded = false;
+};
+
+#endif // USERINDEX_H
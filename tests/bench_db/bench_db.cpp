@@ -0,0 +1,421 @@
+#include <QtTest>
+#include <QEventLoop>
+#include <QSqlDatabase>
+#include <QSqlQuery>
+#include <QTemporaryDir>
+#include <memory>
+#include <random>
+#include "databasemanager.h"
+#include "datasetgenerator.h"
+#include "dbexecutor.h"
+#include "passwordhasher.h"
+#include "statementcache.h"
+
+// Microbenchmarks of the DatabaseManager calls on the request path, run
+// against a synthetic dataset seeded by dbgen's generator into a temporary
+// file. The dataset size comes from the environment, so the same binary
+// measures a laptop-sized and a production-sized database:
+//
+//   BENCH_USERS, BENCH_CHATS_PER_USER, BENCH_MESSAGES_PER_CHAT,
+//   BENCH_SKEW, BENCH_SEED
+//
+// Login history is measured on a dataset of its own, one user with
+// BENCH_HISTORY_CHATS chats of BENCH_HISTORY_MESSAGES messages each
+// (1000 x 1000 by default), built the first time that case runs.
+//
+// Storage profiles are compared under mixed load through a DbExecutor with
+// BENCH_READERS reader lanes, each profile on its own copy of the dataset.
+//
+// Run with -tickcounter or -iterations N as with any QBENCHMARK test.
+
+namespace {
+int envInt(const char *name, int fallback)
+{
+    bool ok = false;
+    int value = qEnvironmentVariableIntValue(name, &ok);
+    return ok ? value : fallback;
+}
+
+double envDouble(const char *name, double fallback)
+{
+    bool ok = false;
+    double value = qEnvironmentVariable(name).toDouble(&ok);
+    return ok ? value : fallback;
+}
+
+QString login(int user)
+{
+    return DatasetSpec().loginPrefix + QString::number(user);
+}
+
+// Point lookups as issued on every request, each bound to one login.
+const char *const lookupStatements[] = {
+    "SELECT Id, Password, Salt FROM Users WHERE Login = ?",
+    "SELECT COUNT(*) FROM ChatMembers m JOIN Users u ON u.Id = m.UserId WHERE u.Login = ?",
+};
+}
+
+class BenchDb : public QObject
+{
+    Q_OBJECT
+
+private slots:
+    void initTestCase();
+    void cleanupTestCase();
+
+    void addMessage_data();
+    void addMessage();
+    void getHistory();
+    void loginHistory_data();
+    void loginHistory();
+    void getUsersByName_data();
+    void getUsersByName();
+    void checkUserPassword();
+    void registrateNewClients();
+    void markMessagesAsRead_data();
+    void markMessagesAsRead();
+    void preparedStatements_data();
+    void preparedStatements();
+    void storageProfiles_data();
+    void storageProfiles();
+
+private:
+    QTemporaryDir directory;
+    QString path;
+    DatasetSpec spec;
+    std::unique_ptr<DatabaseManager> manager;
+    std::mt19937_64 random { 1 };
+    int registered = 0;
+    std::unique_ptr<DatabaseManager> historyManager;
+
+    // Two distinct users picked uniformly; their chat is created on first use.
+    std::pair<QString, QString> pickPair();
+};
+
+void BenchDb::initTestCase()
+{
+    QVERIFY(directory.isValid());
+    path = directory.filePath("bench.db");
+
+    spec.users = qMax(2, envInt("BENCH_USERS", 10000));
+    spec.chatsPerUser = qMax(0, envInt("BENCH_CHATS_PER_USER", 5));
+    spec.messagesPerChat = qMax(0, envInt("BENCH_MESSAGES_PER_CHAT", 20));
+    spec.skew = envDouble("BENCH_SKEW", 1.0);
+    spec.seed = quint64(envInt("BENCH_SEED", 1));
+    random.seed(spec.seed);
+
+    manager.reset(new DatabaseManager("bench", path));
+    FlushPolicy policy;
+    policy.maxBatchSize = 4096;
+    manager->setFlushPolicy(policy);
+
+    DatasetSummary summary;
+    QVERIFY(generateDataset(*manager, path, spec, &summary));
+    qInfo("dataset: %d users, %d chats, %llu messages", summary.users, summary.chats,
+          static_cast<unsigned long long>(summary.messages));
+}
+
+void BenchDb::cleanupTestCase()
+{
+    historyManager.reset();
+    manager.reset();
+}
+
+std::pair<QString, QString> BenchDb::pickPair()
+{
+    std::uniform_int_distribution<int> users(0, spec.users - 1);
+    int from = users(random);
+    int to = users(random);
+    if (to == from)
+    {
+        to = (from + 1) % spec.users;
+    }
+    return { login(from), login(to) };
+}
+
+void BenchDb::addMessage_data()
+{
+    QTest::addColumn<int>("batch");
+    QTest::newRow("1") << 1;
+    QTest::newRow("64") << 64;
+    QTest::newRow("256") << 256;
+}
+
+// One write-behind batch of the given size, committed as the flush timer
+// would commit it.
+void BenchDb::addMessage()
+{
+    QFETCH(int, batch);
+    QVector<std::pair<QString, QString>> pairs;
+    for (int i = 0; i < batch; ++i)
+    {
+        pairs.append(pickPair());
+    }
+
+    QBENCHMARK {
+        for (const auto &pair : pairs)
+        {
+            QVERIFY(manager->addMessage(pair.first, pair.second, "benchmark message") > 0);
+        }
+        QVERIFY(manager->flushPendingMessages());
+    }
+}
+
+// The first history page of a chat, as served when it is opened.
+void BenchDb::getHistory()
+{
+    const std::pair<QString, QString> pair = pickPair();
+    manager->addMessage(pair.first, pair.second, "benchmark message");
+
+    QBENCHMARK {
+        QJsonArray page = manager->getHistory(pair.first, pair.second, 0, 50);
+        QVERIFY(!page.isEmpty());
+    }
+}
+
+void BenchDb::loginHistory_data()
+{
+    QTest::addColumn<bool>("conversations");
+    QTest::newRow("getConversations") << true;
+    QTest::newRow("getMessagesSince") << false;
+}
+
+// What a login with a long history costs: the conversation list sent on
+// login, and the message delta a resume with no known message reads.
+void BenchDb::loginHistory()
+{
+    QFETCH(bool, conversations);
+
+    DatasetSpec history;
+    history.hubChats = qMax(1, envInt("BENCH_HISTORY_CHATS", 1000));
+    history.users = history.hubChats + 1;
+    history.chatsPerUser = 0;
+    history.messagesPerChat = qMax(1, envInt("BENCH_HISTORY_MESSAGES", 1000));
+    history.seed = spec.seed;
+    if (!historyManager)
+    {
+        const QString historyPath = directory.filePath("history.db");
+        historyManager.reset(new DatabaseManager("bench-history", historyPath));
+        FlushPolicy policy;
+        policy.maxBatchSize = 4096;
+        historyManager->setFlushPolicy(policy);
+        QVERIFY(generateDataset(*historyManager, historyPath, history));
+    }
+
+    const QString hub = login(0);
+    QBENCHMARK {
+        if (conversations)
+        {
+            QCOMPARE(int(historyManager->getConversations(hub).size()), history.hubChats);
+        } else {
+            bool truncated = false;
+            QVERIFY(!historyManager->getMessagesSince(hub, 0, 1000, &truncated).isEmpty());
+        }
+    }
+}
+
+void BenchDb::getUsersByName_data()
+{
+    // From a prefix matching every user down to one matching a handful.
+    QTest::addColumn<QString>("letters");
+    QTest::newRow("prefix") << DatasetSpec().loginPrefix;
+    QTest::newRow("prefix+1") << login(1);
+    QTest::newRow("prefix+12") << login(12);
+    QTest::newRow("prefix+123") << login(123);
+}
+
+void BenchDb::getUsersByName()
+{
+    QFETCH(QString, letters);
+    const QString self = login(0);
+
+    QBENCHMARK {
+        manager->getUsersByName(self, letters);
+    }
+}
+
+// What a login costs on the database side: the credential lookup and the
+// key derivation that checks it, at the dataset's work factor.
+void BenchDb::checkUserPassword()
+{
+    std::uniform_int_distribution<int> users(0, spec.users - 1);
+
+    QBENCHMARK {
+        UserCredentials credentials = manager->getUserCredentials(login(users(random)));
+        QVERIFY(credentials.id >= 0);
+        QVERIFY(PasswordHasher::verify(spec.password, credentials.salt, credentials.passwordHash));
+    }
+}
+
+void BenchDb::registrateNewClients()
+{
+    const QString salt = PasswordHasher::generateSalt();
+    const QString hash = PasswordHasher::hash(spec.password, salt, spec.authIterations);
+
+    QBENCHMARK {
+        QVERIFY(manager->registrateNewClients(QString("bench-new%1").arg(registered++), hash, salt));
+    }
+}
+
+void BenchDb::markMessagesAsRead_data()
+{
+    QTest::addColumn<bool>("upToNewest");
+    QTest::newRow("whole chat") << false;
+    QTest::newRow("up to id") << true;
+}
+
+// A reader catching up after a new message came in.
+void BenchDb::markMessagesAsRead()
+{
+    QFETCH(bool, upToNewest);
+    const std::pair<QString, QString> pair = pickPair();
+
+    QBENCHMARK {
+        qint64 id = manager->addMessage(pair.second, pair.first, "benchmark message");
+        manager->markMessagesAsRead(pair.first, pair.second, upToNewest ? id : 0);
+    }
+}
+
+void BenchDb::preparedStatements_data()
+{
+    QTest::addColumn<int>("statement");
+    QTest::addColumn<bool>("cached");
+    QTest::newRow("user, cached") << 0 << true;
+    QTest::newRow("user, prepared per call") << 0 << false;
+    QTest::newRow("chat count, cached") << 1 << true;
+    QTest::newRow("chat count, prepared per call") << 1 << false;
+}
+
+// A StatementCache against compiling the same SQL on every call, on a
+// connection of its own.
+void BenchDb::preparedStatements()
+{
+    QFETCH(int, statement);
+    QFETCH(bool, cached);
+    const char *sql = lookupStatements[statement];
+    std::uniform_int_distribution<int> users(0, spec.users - 1);
+
+    {
+        QSqlDatabase connection = QSqlDatabase::addDatabase("QSQLITE", "bench-statements");
+        connection.setDatabaseName(path);
+        QVERIFY(connection.open());
+        StatementCache statements;
+
+        QBENCHMARK {
+            if (cached)
+            {
+                PreparedStatement query = statements.prepared(connection, sql);
+                query->bindValue(0, login(users(random)));
+                QVERIFY(query->exec() && query->next());
+            } else {
+                QSqlQuery query(connection);
+                QVERIFY(query.prepare(sql));
+                query.bindValue(0, login(users(random)));
+                QVERIFY(query.exec() && query.next());
+            }
+        }
+
+        statements.clear();
+        connection.close();
+    }
+    QSqlDatabase::removeDatabase("bench-statements");
+}
+
+void BenchDb::storageProfiles_data()
+{
+    QTest::addColumn<QString>("journalMode");
+    QTest::addColumn<QString>("synchronous");
+    QTest::addColumn<qint64>("mmapSizeBytes");
+
+    const qint64 mmap = StorageProfile().mmapSizeBytes;
+    QTest::newRow("WAL, NORMAL") << "WAL" << "NORMAL" << mmap;
+    QTest::newRow("WAL, NORMAL, no mmap") << "WAL" << "NORMAL" << qint64(0);
+    QTest::newRow("WAL, FULL") << "WAL" << "FULL" << mmap;
+    QTest::newRow("DELETE, NORMAL") << "DELETE" << "NORMAL" << mmap;
+    QTest::newRow("DELETE, FULL") << "DELETE" << "FULL" << mmap;
+}
+
+// One round of server-like traffic: a batch of messages through the writer
+// lane, committed, while searches and history pages run on the readers.
+void BenchDb::storageProfiles()
+{
+    QFETCH(QString, journalMode);
+    QFETCH(QString, synchronous);
+    QFETCH(qint64, mmapSizeBytes);
+
+    // Every profile starts from the same file: fold the WAL back into it
+    // and copy it while nothing else writes.
+    QVERIFY(manager->flushPendingMessages());
+    {
+        QSqlDatabase connection = QSqlDatabase::addDatabase("QSQLITE", "bench-checkpoint");
+        connection.setDatabaseName(path);
+        QVERIFY(connection.open());
+        QSqlQuery checkpoint(connection);
+        QVERIFY(checkpoint.exec("PRAGMA wal_checkpoint(TRUNCATE)") && checkpoint.next());
+        QCOMPARE(checkpoint.value(0).toInt(), 0);
+        checkpoint = QSqlQuery();
+        connection.close();
+    }
+    QSqlDatabase::removeDatabase("bench-checkpoint");
+    const QString profilePath = directory.filePath(QString("profile-%1.db").arg(journalMode + synchronous
+                                                                               + QString::number(mmapSizeBytes)));
+    QFile::remove(profilePath);
+    QVERIFY(QFile::copy(path, profilePath));
+
+    StorageProfile profile;
+    profile.journalMode = journalMode;
+    profile.synchronous = synchronous;
+    profile.mmapSizeBytes = mmapSizeBytes;
+    DbExecutor executor(qMax(1, envInt("BENCH_READERS", 2)), FlushPolicy(), profilePath, profile);
+
+    const int writes = 64;
+    const int reads = 64;
+    QVector<std::pair<QString, QString>> pairs;
+    for (int i = 0; i < qMax(writes, reads); ++i)
+    {
+        pairs.append(pickPair());
+    }
+
+    QBENCHMARK {
+        QEventLoop loop;
+        int outstanding = writes + 1 + reads;
+        auto finished = [&outstanding, &loop](auto) {
+            if (--outstanding == 0)
+            {
+                loop.quit();
+            }
+        };
+
+        for (int i = 0; i < writes; ++i)
+        {
+            const std::pair<QString, QString> pair = pairs.at(i);
+            executor.write([pair](DatabaseManager &db) {
+                return db.addMessage(pair.first, pair.second, "benchmark message");
+            }, this, finished);
+        }
+        executor.write([](DatabaseManager &db) {
+            return db.flushPendingMessages();
+        }, this, finished);
+
+        for (int i = 0; i < reads; ++i)
+        {
+            const std::pair<QString, QString> pair = pairs.at(i);
+            if (i % 2 == 0)
+            {
+                executor.read([pair](DatabaseManager &db) {
+                    return db.getUsersByName(pair.first, pair.second.left(pair.second.size() - 1));
+                }, this, finished);
+            } else {
+                executor.read([pair](DatabaseManager &db) {
+                    return db.getHistory(pair.first, pair.second, 0, 50);
+                }, this, finished);
+            }
+        }
+
+        loop.exec();
+    }
+}
+
+QTEST_GUILESS_MAIN(BenchDb)
+
+#include "bench_db.moc"
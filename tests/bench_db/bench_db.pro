@@ -0,0 +1,32 @@
+QT += core network sql testlib websockets
+QT -= gui
+
+CONFIG += c++17 console testcase
+CONFIG -= app_bundle
+
+INCLUDEPATH += ../../server ../../dbgen
+
+SOURCES += \
+        ../../dbgen/datasetgenerator.cpp \
+        ../../server/databasemanager.cpp \
+        ../../server/dbexecutor.cpp \
+        ../../server/logmessagestore.cpp \
+        ../../server/metrics.cpp \
+        ../../server/passwordhasher.cpp \
+        ../../server/sqlitemessagestore.cpp \
+        ../../server/statementcache.cpp \
+        ../../server/tracer.cpp \
+        bench_db.cpp
+
+HEADERS += \
+    ../../dbgen/datasetgenerator.h \
+    ../../server/databasemanager.h \
+    ../../server/dbexecutor.h \
+    ../../server/logmessagestore.h \
+    ../../server/lrucache.h \
+    ../../server/messagestore.h \
+    ../../server/metrics.h \
+    ../../server/passwordhasher.h \
+    ../../server/sqlitemessagestore.h \
+    ../../server/statementcache.h \
+    ../../server/tracer.h
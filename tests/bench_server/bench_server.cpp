@@ -0,0 +1,324 @@
+#include <QtTest>
+#include <QJsonArray>
+#include <algorithm>
+#include <functional>
+#include <random>
+#include <vector>
+#include "sessionregistry.h"
+#include "tracer.h"
+#include "userindex.h"
+#include "wireprotocol.h"
+
+// Microbenchmarks of the in-process work on the Server thread that does not
+// touch the database. Sizes are data rows, so one case can be run alone
+// with its tag, e.g. "routing:100000". User search runs over
+// BENCH_SEARCH_USERS logins, 1M by default.
+
+namespace {
+QString login(int user)
+{
+    return QString("load%1").arg(user);
+}
+
+QJsonObject storedMessage(int id)
+{
+    QJsonObject message;
+    message["id"] = id;
+    message["sender"] = login(id % 2);
+    message["message"] = QString("message %1 of a conversation that goes on for a while").arg(id);
+    message["timestamp"] = "2026-10-17 12:00:00";
+    message["is_read"] = id % 3 != 0;
+    return message;
+}
+
+// Frames the server sends most: a live chat message, a history page and
+// the conversation list sent on login.
+QJsonObject sampleFrame(const QString &kind)
+{
+    QJsonObject frame;
+    if (kind == "chat")
+    {
+        frame["type"] = "chat";
+        frame["from"] = login(0);
+        frame["to"] = login(1);
+        frame["message"] = "hello, are you there?";
+        frame["msg_id"] = 123456;
+    } else if (kind == "history") {
+        QJsonArray messages;
+        for (int i = 0; i < 50; ++i)
+        {
+            messages.append(storedMessage(1000 + i));
+        }
+        frame["type"] = "get_history";
+        frame["to"] = login(0);
+        frame["with"] = login(1);
+        frame["before_id"] = 1050;
+        frame["has_more"] = true;
+        frame["messages"] = messages;
+    } else {
+        QJsonArray conversations;
+        for (int i = 0; i < 100; ++i)
+        {
+            QJsonObject conversation;
+            conversation["with"] = login(i + 1);
+            conversation["unread"] = i % 4;
+            conversation["messages"] = QJsonArray { storedMessage(5000 + i) };
+            conversations.append(conversation);
+        }
+        frame["type"] = "get_conversations";
+        frame["to"] = login(0);
+        frame["conversations"] = conversations;
+    }
+    return frame;
+}
+}
+
+class BenchServer : public QObject
+{
+    Q_OBJECT
+
+private slots:
+    void routing_data();
+    void routing();
+    void sessionChurn_data();
+    void sessionChurn();
+    void wireEncode_data();
+    void wireEncode();
+    void wireDecode_data();
+    void wireDecode();
+    void search_data();
+    void search();
+    void tracing_data();
+    void tracing();
+
+private:
+    std::mt19937_64 random { 1 };
+    UserIndex userIndex;
+    // Every tenth indexed user.
+    SessionRegistry online;
+
+    static void addSizes();
+    static void addFrames();
+};
+
+void BenchServer::addSizes()
+{
+    QTest::addColumn<int>("sessions");
+    QTest::newRow("100") << 100;
+    QTest::newRow("1000") << 1000;
+    QTest::newRow("10000") << 10000;
+    QTest::newRow("100000") << 100000;
+}
+
+void BenchServer::routing_data()
+{
+    addSizes();
+}
+
+// Routing one chat message: the sender behind the connection, then the
+// recipient's connection.
+void BenchServer::routing()
+{
+    QFETCH(int, sessions);
+    SessionRegistry registry;
+    for (int i = 0; i < sessions; ++i)
+    {
+        registry.insert(ConnectionId(i + 1), login(i));
+    }
+
+    const int lookups = 1000;
+    std::uniform_int_distribution<int> users(0, sessions - 1);
+    std::vector<std::pair<ConnectionId, QString>> routes;
+    for (int i = 0; i < lookups; ++i)
+    {
+        routes.emplace_back(ConnectionId(users(random) + 1), login(users(random)));
+    }
+
+    QBENCHMARK {
+        for (const auto &route : routes)
+        {
+            QVERIFY(!registry.loginFor(route.first).isEmpty());
+            QVERIFY(!registry.connectionsFor(route.second).isEmpty());
+        }
+    }
+}
+
+void BenchServer::sessionChurn_data()
+{
+    addSizes();
+}
+
+// A user reconnecting while the old connection is still open, then the old
+// one closing, against a registry of the given size.
+void BenchServer::sessionChurn()
+{
+    QFETCH(int, sessions);
+    SessionRegistry registry;
+    QStringList logins;
+    for (int i = 0; i < sessions; ++i)
+    {
+        logins.append(login(i));
+        registry.insert(ConnectionId(i + 1), logins.last());
+    }
+
+    std::uniform_int_distribution<int> users(0, sessions - 1);
+    std::vector<int> picks;
+    for (int i = 0; i < 1000; ++i)
+    {
+        picks.push_back(users(random));
+    }
+    std::vector<ConnectionId> current(sessions);
+    for (int i = 0; i < sessions; ++i)
+    {
+        current[i] = ConnectionId(i + 1);
+    }
+    ConnectionId next = ConnectionId(sessions + 1);
+
+    QBENCHMARK {
+        for (int user : picks)
+        {
+            registry.insert(next, logins.at(user));
+            registry.remove(current[user]);
+            current[user] = next++;
+            QVERIFY(registry.isOnline(logins.at(user)));
+        }
+    }
+    QCOMPARE(registry.size(), sessions);
+}
+
+void BenchServer::addFrames()
+{
+    QTest::addColumn<QString>("kind");
+    QTest::addColumn<bool>("cbor");
+    for (const char *kind : { "chat", "history", "conversations" })
+    {
+        QTest::addRow("%s, json", kind) << QString(kind) << false;
+        QTest::addRow("%s, cbor", kind) << QString(kind) << true;
+    }
+}
+
+void BenchServer::wireEncode_data()
+{
+    addFrames();
+}
+
+void BenchServer::wireEncode()
+{
+    QFETCH(QString, kind);
+    QFETCH(bool, cbor);
+    const QJsonObject frame = sampleFrame(kind);
+    qInfo("%s frame: %lld bytes", cbor ? "cbor" : "json",
+          static_cast<long long>((cbor ? WireProtocol::encodeCbor(frame) : WireProtocol::encodeJson(frame)).size()));
+
+    QBENCHMARK {
+        QByteArray bytes = cbor ? WireProtocol::encodeCbor(frame) : WireProtocol::encodeJson(frame);
+        QVERIFY(!bytes.isEmpty());
+    }
+}
+
+void BenchServer::wireDecode_data()
+{
+    addFrames();
+}
+
+void BenchServer::wireDecode()
+{
+    QFETCH(QString, kind);
+    QFETCH(bool, cbor);
+    const QJsonObject frame = sampleFrame(kind);
+    const QByteArray bytes = cbor ? WireProtocol::encodeCbor(frame) : WireProtocol::encodeJson(frame);
+
+    QBENCHMARK {
+        bool ok = false;
+        QJsonObject decoded = cbor ? WireProtocol::decodeCbor(bytes, &ok) : WireProtocol::decodeJson(bytes, &ok);
+        QVERIFY(ok && decoded.size() == frame.size());
+    }
+}
+
+void BenchServer::search_data()
+{
+    QTest::addColumn<QString>("prefix");
+    QTest::newRow("every user") << "load";
+    QTest::newRow("a tenth") << "load1";
+    QTest::newRow("a few") << "load12345";
+    QTest::newRow("one") << "load123456";
+    QTest::newRow("none") << "nobody";
+}
+
+// search_users as the server answers it, with the default result limit and
+// scan budget.
+void BenchServer::search()
+{
+    QFETCH(QString, prefix);
+    if (!userIndex.isLoaded())
+    {
+        bool ok = false;
+        int users = qEnvironmentVariableIntValue("BENCH_SEARCH_USERS", &ok);
+        users = ok ? qMax(1, users) : 1000000;
+
+        // Loaded in shuffled order, as a login snapshot would not be sorted.
+        std::vector<int> order(users);
+        for (int i = 0; i < users; ++i)
+        {
+            order[i] = i;
+        }
+        std::shuffle(order.begin(), order.end(), random);
+        QStringList logins;
+        logins.reserve(users);
+        for (int user : order)
+        {
+            logins.append(login(user));
+            if (user % 10 == 0)
+            {
+                online.insert(ConnectionId(user + 1), logins.last());
+            }
+        }
+        userIndex.load(logins);
+        QCOMPARE(userIndex.size(), users);
+    }
+
+    const int limit = 20;
+    const std::function<bool(const QString&)> isOnline = [this](const QString &candidate) {
+        return online.isOnline(candidate);
+    };
+    QBENCHMARK {
+        userIndex.search(prefix, login(0), limit, limit * 8, isOnline);
+    }
+}
+
+void BenchServer::tracing_data()
+{
+    // Tracing cannot be switched off again, so the row with it off runs
+    // first.
+    QTest::addColumn<bool>("enabled");
+    QTest::newRow("off") << false;
+    QTest::newRow("on") << true;
+}
+
+// What tracing adds to a request: a context handed over, as DbExecutor does
+// for every job, and a request span around a nested database span.
+void BenchServer::tracing()
+{
+    QFETCH(bool, enabled);
+    if (enabled)
+    {
+        Tracer::enable(65536);
+    }
+    QCOMPARE(Tracer::isEnabled(), enabled);
+
+    TraceContext context;
+    context.connection = 1;
+    QBENCHMARK {
+        for (int i = 0; i < 1000; ++i)
+        {
+            context.request = Tracer::nextRequestId();
+            TraceContextScope scope(context);
+            TraceSpan request("chat", "request");
+            TraceSpan database("addMessage", "db");
+        }
+    }
+}
+
+QTEST_GUILESS_MAIN(BenchServer)
+
+#include "bench_server.moc"
@@ -0,0 +1,23 @@
+QT += core testlib
+QT -= gui
+
+CONFIG += c++17 console testcase
+CONFIG -= app_bundle
+
+INCLUDEPATH += ../../common ../../server
+
+SOURCES += \
+        ../../common/wireprotocol.cpp \
+        ../../server/metrics.cpp \
+        ../../server/sessionregistry.cpp \
+        ../../server/tracer.cpp \
+        ../../server/userindex.cpp \
+        bench_server.cpp
+
+HEADERS += \
+    ../../common/systemmessage.h \
+    ../../common/wireprotocol.h \
+    ../../server/metrics.h \
+    ../../server/sessionregistry.h \
+    ../../server/tracer.h \
+    ../../server/userindex.h
@@ -0,0 +1,140 @@
+#include <QtTest>
+#include <QSqlDatabase>
+#include <QSqlQuery>
+#include <QTemporaryDir>
+#include "databasemanager.h"
+#include "logmessagestore.h"
+
+// Checks of the message stores that the benchmarks do not cover: what is
+// written can be read back, and stored data is left alone unless asked.
+
+namespace {
+StoredMessage message(qint64 id, int chatId, int senderId, int recipientId)
+{
+    StoredMessage stored;
+    stored.id = id;
+    stored.chatId = chatId;
+    stored.senderId = senderId;
+    stored.recipientId = recipientId;
+    stored.message = QString("message %1").arg(id);
+    stored.timestamp = "2026-10-17 12:00:00";
+    return stored;
+}
+
+int messageRows(const QString &path)
+{
+    int rows = -1;
+    {
+        QSqlDatabase db = QSqlDatabase::addDatabase("QSQLITE", "storage-check");
+        db.setDatabaseName(path);
+        QSqlQuery query(db);
+        if (db.open() && query.exec("SELECT COUNT(*) FROM Messages") && query.next())
+        {
+            rows = query.value(0).toInt();
+        }
+    }
+    QSqlDatabase::removeDatabase("storage-check");
+    return rows;
+}
+}
+
+class TestStorage : public QObject
+{
+    Q_OBJECT
+
+private slots:
+    void logShards_data();
+    void logShards();
+    void archiveOffByDefault();
+};
+
+void TestStorage::logShards_data()
+{
+    QTest::addColumn<int>("chatId");
+    QTest::newRow("shard 0") << 0;
+    QTest::newRow("shard 127") << 127;
+    // The first shard whose positions have the sign bit set.
+    QTest::newRow("shard 128") << 128;
+    QTest::newRow("shard 255") << 255;
+}
+
+// Two messages of a chat in the given shard of a full-size log, read back
+// through the chat chain, the recipient chain and the resume range, before
+// and after reopening the log.
+void TestStorage::logShards()
+{
+    QFETCH(int, chatId);
+    QTemporaryDir directory;
+    QVERIFY(directory.isValid());
+    const int shards = LogMessageStore::maxShards;
+    const QVector<StoredMessage> written = { message(1, chatId, 1, 2), message(2, chatId, 2, 1) };
+
+    for (int pass = 0; pass < 2; ++pass)
+    {
+        LogMessageStore store(directory.path(), shards, 1024 * 1024);
+        if (pass == 0)
+        {
+            QVERIFY(store.append(written));
+        }
+        QCOMPARE(store.lastMessageId(), qint64(2));
+
+        const QVector<StoredMessage> chat = store.readChat(chatId, 0, 10);
+        QCOMPARE(int(chat.size()), 2);
+        QCOMPARE(chat.at(0).id, qint64(1));
+        QCOMPARE(chat.at(1).id, qint64(2));
+        QCOMPARE(chat.at(1).message, written.at(1).message);
+
+        const QVector<StoredMessage> pending = store.readForRecipient(1, 0);
+        QCOMPARE(int(pending.size()), 1);
+        QCOMPARE(pending.at(0).id, qint64(2));
+
+        QCOMPARE(int(store.readChatsAfter({ chatId }, 0, 10).size()), 2);
+        QCOMPARE(store.countUnread(chatId, 1, 0), 1);
+    }
+}
+
+// Delivered messages far past any archive age stay in Messages with the
+// archive policy a server gets without --archive-after, and only move once
+// an age is configured.
+void TestStorage::archiveOffByDefault()
+{
+    QTemporaryDir directory;
+    QVERIFY(directory.isValid());
+    const QString path = directory.filePath("storage.db");
+    const int messages = 10;
+    {
+        DatabaseManager database("storage", path);
+        QVERIFY(database.registrateNewClients("alice", "hash", "salt"));
+        QVERIFY(database.registrateNewClients("bob", "hash", "salt"));
+        qint64 lastId = 0;
+        for (int i = 0; i < messages; ++i)
+        {
+            lastId = database.addMessage("alice", "bob", QString("message %1").arg(i));
+        }
+        database.markDelivered("bob", lastId);
+        QVERIFY(database.flushPendingMessages());
+    }
+    {
+        QSqlDatabase db = QSqlDatabase::addDatabase("QSQLITE", "storage-age");
+        db.setDatabaseName(path);
+        QVERIFY(db.open());
+        QSqlQuery query(db);
+        QVERIFY(query.exec("UPDATE Messages SET Timestamp = '2000-01-01 00:00:00'"));
+    }
+    QSqlDatabase::removeDatabase("storage-age");
+
+    DatabaseManager database("storage", path);
+    database.setArchivePolicy(MessageStoreConfig().archive);
+    QCOMPARE(database.archiveMessages(), 0);
+    QCOMPARE(messageRows(path), messages);
+
+    ArchivePolicy enabled;
+    enabled.maxAgeDays = 30;
+    database.setArchivePolicy(enabled);
+    QCOMPARE(database.archiveMessages(), messages);
+    QCOMPARE(messageRows(path), 0);
+}
+
+QTEST_GUILESS_MAIN(TestStorage)
+
+#include "storage.moc"
@@ -0,0 +1,26 @@
+QT += core network sql testlib websockets
+QT -= gui
+
+CONFIG += c++17 console testcase
+CONFIG -= app_bundle
+
+INCLUDEPATH += ../../server
+
+SOURCES += \
+        ../../server/databasemanager.cpp \
+        ../../server/logmessagestore.cpp \
+        ../../server/metrics.cpp \
+        ../../server/sqlitemessagestore.cpp \
+        ../../server/statementcache.cpp \
+        ../../server/tracer.cpp \
+        storage.cpp
+
+HEADERS += \
+    ../../server/databasemanager.h \
+    ../../server/logmessagestore.h \
+    ../../server/lrucache.h \
+    ../../server/messagestore.h \
+    ../../server/metrics.h \
+    ../../server/sqlitemessagestore.h \
+    ../../server/statementcache.h \
+    ../../server/tracer.h